@@ -0,0 +1,203 @@
+#include "pxt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// Compares event-to-handler latency of the fiber scheduler in core---linux (event queue plus a
+// fiber per handler) with the previous model (a pthread per handler, serialized on a mutex),
+// and finds out how many fibers can be alive at once. Every fiber stack is two mappings (stack
+// and guard page), so on Linux the count is usually capped by vm.max_map_count (65530) at about
+// 32k, whatever PXT_FIBER_STACK_KB is set to.
+
+#define NUM_EVENTS 5000
+#define EVENT_SPACING_US 200
+#define MAX_FIBERS 100000
+
+using namespace pxt;
+
+extern "C" void *xmalloc(size_t sz) {
+    return malloc(sz);
+}
+
+extern "C" void target_panic(int code) {
+    printf("PANIC %d\n", code);
+    exit(1);
+}
+
+namespace pxt {
+int dmesgLevel = DMESG_LEVEL_INFO;
+
+void dmesg(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    printf("\n");
+}
+
+// tracing stays off; see trace.cpp
+volatile int traceEnabled;
+
+void traceRecord(char, const char *, int, int) {}
+
+Buffer mkBuffer(const uint8_t *, int) {
+    return NULL;
+}
+
+static uint64_t now_us() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+int current_time_ms() {
+    return (int)(now_us() / 1000);
+}
+} // namespace pxt
+
+static uint64_t raiseTime[NUM_EVENTS];
+static uint32_t latency[NUM_EVENTS];
+static volatile int numHandled;
+
+static void *producer(void *) {
+    for (int i = 0; i < NUM_EVENTS; ++i) {
+        raiseTime[i] = now_us();
+        eventQueuePush(1, i);
+        usleep(EVENT_SPACING_US);
+    }
+    return NULL;
+}
+
+static int cmpU32(const void *a, const void *b) {
+    return *(uint32_t *)a < *(uint32_t *)b ? -1 : *(uint32_t *)a > *(uint32_t *)b;
+}
+
+static void report(const char *name, uint64_t elapsed) {
+    qsort(latency, NUM_EVENTS, sizeof(uint32_t), cmpU32);
+    printf("%-8s %d events in %dms; latency us: p50=%u p90=%u p99=%u max=%u\n", name, NUM_EVENTS,
+           (int)(elapsed / 1000), latency[NUM_EVENTS / 2], latency[NUM_EVENTS * 9 / 10],
+           latency[NUM_EVENTS * 99 / 100], latency[NUM_EVENTS - 1]);
+}
+
+// fibers
+
+static FiberCtx *executor;
+
+static void handlerEntry(void *arg) {
+    int idx = (int)(uintptr_t)arg;
+    latency[idx] = (uint32_t)(now_us() - raiseTime[idx]);
+    numHandled++;
+}
+
+static FiberCtx *handlerFiber;
+
+static void fiberHandler(void *arg) {
+    handlerEntry(arg);
+    fiberSwitch(handlerFiber, executor);
+}
+
+static void benchFibers() {
+    numHandled = 0;
+    executor = fiberCreateMain();
+    pthread_t pid;
+    auto start = now_us();
+    pthread_create(&pid, NULL, producer, NULL);
+    while (numHandled < NUM_EVENTS) {
+        int source, value;
+        if (!eventQueuePop(&source, &value)) {
+            eventQueueWait(100);
+            continue;
+        }
+        handlerFiber = fiberCreate(fiberHandler, (void *)(uintptr_t)value);
+        fiberSwitch(executor, handlerFiber);
+        fiberDestroy(handlerFiber);
+    }
+    pthread_join(pid, NULL);
+    report("fibers", now_us() - start);
+}
+
+// thread per handler
+
+static pthread_mutex_t execMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t eventMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t newEvent = PTHREAD_COND_INITIALIZER;
+static int eventHead, eventTail;
+static int eventQueue[NUM_EVENTS];
+
+static void *threadProducer(void *) {
+    for (int i = 0; i < NUM_EVENTS; ++i) {
+        raiseTime[i] = now_us();
+        pthread_mutex_lock(&eventMutex);
+        eventQueue[eventTail++] = i;
+        pthread_cond_broadcast(&newEvent);
+        pthread_mutex_unlock(&eventMutex);
+        usleep(EVENT_SPACING_US);
+    }
+    return NULL;
+}
+
+static void *threadHandler(void *arg) {
+    pthread_mutex_lock(&execMutex);
+    handlerEntry(arg);
+    pthread_mutex_unlock(&execMutex);
+    return NULL;
+}
+
+static void benchThreads() {
+    numHandled = 0;
+    pthread_t pid;
+    auto start = now_us();
+    pthread_create(&pid, NULL, threadProducer, NULL);
+    pthread_mutex_lock(&eventMutex);
+    while (eventHead < NUM_EVENTS) {
+        while (eventHead == eventTail)
+            pthread_cond_wait(&newEvent, &eventMutex);
+        while (eventHead < eventTail) {
+            pthread_t thr;
+            pthread_create(&thr, NULL, threadHandler, (void *)(uintptr_t)eventQueue[eventHead++]);
+            pthread_detach(thr);
+        }
+    }
+    pthread_mutex_unlock(&eventMutex);
+    pthread_join(pid, NULL);
+    while (numHandled < NUM_EVENTS)
+        usleep(1000);
+    report("threads", now_us() - start);
+}
+
+// maximum number of fibers alive at once
+
+static FiberCtx **fibers;
+
+// like a handler blocked in waitForEvent()
+static void parkedFiber(void *arg) {
+    fiberSwitch(fibers[(uintptr_t)arg], executor);
+}
+
+static void benchMaxFibers() {
+    fibers = (FiberCtx **)malloc(MAX_FIBERS * sizeof(FiberCtx *));
+    int n = 0;
+    auto start = now_us();
+    while (n < MAX_FIBERS) {
+        auto f = fiberCreate(parkedFiber, (void *)(uintptr_t)n);
+        if (!f)
+            break;
+        fibers[n] = f;
+        fiberSwitch(executor, f);
+        n++;
+    }
+    printf("max fibers: %d (created in %dms)\n", n, (int)((now_us() - start) / 1000));
+    for (int i = 0; i < n; ++i)
+        fiberDestroy(fibers[i]);
+    free(fibers);
+}
+
+int main() {
+    benchFibers();
+    benchThreads();
+    benchMaxFibers();
+    return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef __PXTBASE_H
+#define __PXTBASE_H
+
+// Just enough of the runtime to build fiber.cpp and eventqueue.cpp from core---linux.
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "pxtcore.h"
+
+#define PANIC_INTERNAL_ERROR 906
+
+extern "C" void target_panic(int code);
+
+namespace pxt {
+typedef struct BufferStub *Buffer;
+Buffer mkBuffer(const uint8_t *data, int len);
+int current_time_ms();
+} // namespace pxt
+
+#endif
@@ -0,0 +1,229 @@
+#include "pxt.h"
+#include <stdlib.h>
+#include <sys/time.h>
+
+// Times drawImageCore() on a 320x240 screen, and checks every result against per-pixel goldens.
+// `make bench` runs it with and without the vector blitters (PXT_SIMD_BLIT).
+//
+// Sprites drawn from compressed images (ImageMethods::compressed()) are compared with the same
+// sprites uncompressed.
+//
+// Also measures the cost of a frame of a mostly static screen (a score changes) in a display
+// backend, sending the whole screen vs. just the part changed according to RefImage::takeDirty().
+
+#define SCREEN_W 320
+#define SCREEN_H 240
+#define NUM_DRAWS 20000
+#define NUM_FRAMES 2000
+
+namespace ImageMethods {
+int width(Image_ img);
+int height(Image_ img);
+void setPixel(Image_ img, int x, int y, int c);
+int getPixel(Image_ img, int x, int y);
+void fill(Image_ img, int c);
+Image_ clone(Image_ img);
+Image_ compressed(Image_ img);
+void copyFrom(Image_ img, Image_ from);
+bool drawImageCore(Image_ img, Image_ from, int x, int y, int color);
+void fillRect(Image_ img, int x, int y, int w, int h, int c);
+void drawTransparentImage(Image_ img, Image_ from, int x, int y);
+} // namespace ImageMethods
+
+static uint64_t now_us() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+static Image_ randomImg(int w, int h, int bpp, int density) {
+    auto img = mkImage(w, h, bpp);
+    ImageMethods::fill(img, 0);
+    for (int i = 0; i < w; ++i)
+        for (int j = 0; j < h; ++j)
+            if (rand() % 100 < density)
+                ImageMethods::setPixel(img, i, j, rand() & ((1 << bpp) - 1));
+    return img;
+}
+
+// transparent around an ellipse, mostly horizontal bands of color inside
+static Image_ shapeImg(int w, int h) {
+    auto img = mkImage(w, h, 4);
+    ImageMethods::fill(img, 0);
+    for (int i = 0; i < w; ++i)
+        for (int j = 0; j < h; ++j) {
+            int dx = (2 * i + 1 - w) * h, dy = (2 * j + 1 - h) * w;
+            if (dx * dx + dy * dy <= w * w * h * h)
+                ImageMethods::setPixel(img, i, j, rand() % 16 ? 1 + j * 4 / h : rand() & 15);
+        }
+    return img;
+}
+
+// color as in drawImageCore(): -2 opaque, -1 overlap test, >= 0 transparent (or icon color)
+static bool golden_drawImageCore(Image_ img, Image_ from, int x, int y, int color) {
+    for (int i = 0; i < ImageMethods::width(from); ++i)
+        for (int j = 0; j < ImageMethods::height(from); ++j) {
+            if (!img->inRange(x + i, y + j))
+                continue;
+            auto pix = ImageMethods::getPixel(from, i, j);
+            if (color == -1) {
+                if (pix && ImageMethods::getPixel(img, x + i, y + j))
+                    return true;
+            } else if (pix || color == -2) {
+                ImageMethods::setPixel(img, x + i, y + j, from->bpp() == 1 ? color : pix);
+            }
+        }
+    return false;
+}
+
+static void assertSame(Image_ a, Image_ b, const char *what) {
+    if (memcmp(a->pix(), b->pix(), a->pixLength())) {
+        printf("%s: mismatch with golden\n", what);
+        abort();
+    }
+}
+
+struct Draw {
+    int sprite, x, y;
+};
+
+static Image_ sprites[8];
+static Draw draws[NUM_DRAWS];
+
+// draws sprites from, and from goldenFrom with the golden
+static void bench(const char *what, int from, int goldenFrom, int color) {
+    auto screen = randomImg(SCREEN_W, SCREEN_H, 4, 50);
+    auto golden = ImageMethods::clone(screen);
+
+    int hits = 0;
+    auto start = now_us();
+    for (int i = 0; i < NUM_DRAWS; ++i)
+        hits += ImageMethods::drawImageCore(screen, sprites[from + draws[i].sprite], draws[i].x,
+                                            draws[i].y, color);
+    auto elapsed = now_us() - start;
+
+    int goldenHits = 0;
+    for (int i = 0; i < NUM_DRAWS; ++i)
+        goldenHits += golden_drawImageCore(golden, sprites[goldenFrom + draws[i].sprite],
+                                           draws[i].x, draws[i].y, color);
+    assertSame(screen, golden, what);
+    if (hits != goldenHits) {
+        printf("%s: %d overlaps, golden %d\n", what, hits, goldenHits);
+        abort();
+    }
+
+    printf("%-12s %6.2f us/draw\n", what, (double)elapsed / NUM_DRAWS);
+    free(screen);
+    free(golden);
+}
+
+// what screen---ext does: copy the changed columns, and convert the changed rectangle to ARGB
+static uint8_t frameBuf[SCREEN_W * SCREEN_H / 2];
+static uint32_t argb[SCREEN_W * SCREEN_H];
+static uint32_t palette[16];
+
+static void sendFrame(Image_ img, int x, int y, int w, int h) {
+    auto bh = img->byteHeight();
+    memcpy(frameBuf + x * bh, img->pix(x, 0), w * bh);
+    int y0 = y & ~1, y1 = (y + h + 1) & ~1;
+    for (int xx = x; xx < x + w; ++xx) {
+        auto sp = frameBuf + xx * bh + (y0 >> 1);
+        auto p = argb + xx + y0 * SCREEN_W;
+        for (int yy = y0; yy < y1; yy += 2) {
+            uint8_t v = *sp++;
+            *p = palette[v & 0xf];
+            p += SCREEN_W;
+            *p = palette[v >> 4];
+            p += SCREEN_W;
+        }
+    }
+}
+
+static void benchFrames(bool useDirty) {
+    for (int i = 0; i < 16; ++i)
+        palette[i] = 0xff000000 | (i * 0x111111);
+    auto screen = randomImg(SCREEN_W, SCREEN_H, 4, 100);
+    for (int i = 0; i < 50; ++i)
+        ImageMethods::drawTransparentImage(screen, sprites[0], rand() % SCREEN_W,
+                                           rand() % SCREEN_H);
+    int x, y, w, h;
+    screen->takeDirty(&x, &y, &w, &h);
+    sendFrame(screen, x, y, w, h);
+
+    uint64_t elapsed = 0;
+    for (int i = 0; i < NUM_FRAMES; ++i) {
+        // the score in the corner
+        ImageMethods::fillRect(screen, SCREEN_W - 40, 2, 36, 8, 0);
+        for (int d = 0; d < 4; ++d)
+            if ((i >> d) & 1)
+                ImageMethods::drawImageCore(screen, sprites[2], SCREEN_W - 40 + d * 9, 2, 15);
+
+        auto start = now_us();
+        if (!useDirty)
+            sendFrame(screen, 0, 0, SCREEN_W, SCREEN_H);
+        else if (screen->takeDirty(&x, &y, &w, &h))
+            sendFrame(screen, x, y, w, h);
+        elapsed += now_us() - start;
+    }
+
+    // golden: convert the final frame from scratch
+    static uint32_t last[SCREEN_W * SCREEN_H];
+    memcpy(last, argb, sizeof(argb));
+    memset(frameBuf, 0, sizeof(frameBuf));
+    sendFrame(screen, 0, 0, SCREEN_W, SCREEN_H);
+    if (memcmp(last, argb, sizeof(argb))) {
+        printf("frame: mismatch with golden\n");
+        abort();
+    }
+
+    printf("%-12s %6.2f us/frame\n", useDirty ? "frame dirty" : "frame full",
+           (double)elapsed / NUM_FRAMES);
+    free(screen);
+}
+
+extern "C" int main() {
+    // a 16x16 sprite and a 64x64 background tile, and the same as icons
+    sprites[0] = randomImg(16, 16, 4, 70);
+    sprites[1] = randomImg(64, 64, 4, 90);
+    sprites[2] = randomImg(16, 16, 1, 50);
+    sprites[3] = randomImg(64, 64, 1, 50);
+    sprites[4] = shapeImg(16, 16);
+    sprites[5] = shapeImg(64, 64);
+    sprites[6] = ImageMethods::compressed(sprites[4]);
+    sprites[7] = ImageMethods::compressed(sprites[5]);
+    printf("64x64 sprite: %d bytes, compressed %d\n", sprites[5]->length(), sprites[7]->length());
+    for (int i = 0; i < NUM_DRAWS; ++i) {
+        auto s = rand() % 2;
+        auto sz = s ? 64 : 16;
+        draws[i].sprite = s;
+        draws[i].x = rand() % (SCREEN_W + sz) - sz;
+        draws[i].y = rand() % (SCREEN_H + sz) - sz;
+    }
+
+    bench("opaque", 0, 0, -2);
+    bench("transparent", 0, 0, 0);
+    bench("overlap", 0, 0, -1);
+    bench("icon", 2, 2, 5);
+    bench("shape", 4, 4, 0);
+    bench("shape rle", 6, 4, 0);
+    bench("shape opq", 4, 4, -2);
+    bench("shape opq rle", 6, 4, -2);
+    benchFrames(false);
+    benchFrames(true);
+    return 0;
+}
+
+void *operator new(size_t sz) {
+    return malloc(sz);
+}
+void *operator new[](size_t sz) {
+    return malloc(sz);
+}
+void operator delete(void *p) {
+    free(p);
+}
+
+extern "C" void target_panic(int code) {
+    DMESG("PANIC %d", code);
+    exit(1);
+}
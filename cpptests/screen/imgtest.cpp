@@ -11,6 +11,7 @@ void fill(Image_ img, int c);
 void fillRect(Image_ img, int x, int y, int w, int h, int c);
 void _fillRect(Image_ img, int xy, int wh, int c);
 Image_ clone(Image_ img);
+Image_ compressed(Image_ img);
 void flipX(Image_ img);
 void flipY(Image_ img);
 void scroll(Image_ img, int dx, int dy);
@@ -25,8 +26,26 @@ void _drawIcon(Image_ img, Buffer icon, int xy, int c);
 void _drawLine(Image_ img, int xy, int wh, int c);
 void copyFrom(Image_ img, Image_ from);
 bool drawImageCore(Image_ img, Image_ from, int x, int y, int color);
+void drawTransformed(Image_ img, Image_ from, int x, int y, int a, int b, int c, int d);
+void _print(Image_ img, String text, Buffer font, Buffer args);
+struct BatchEntry {
+    int16_t x, y;
+    uint16_t flags;
+    uint16_t reserved;
+};
+void drawBatch(Image_ img, TValue *images, BatchEntry *entries, int n);
 } // namespace ImageMethods
 
+namespace pxt {
+bool isValidImage(Buffer buf);
+}
+
+namespace tiles {
+void drawTilemap(Image_ img, Buffer map, TValue *tiles, int numTiles, int offsetX, int offsetY,
+                 int scale);
+bool isWallInRect(Buffer map, Image_ walls, int x0, int y0, int x1, int y1);
+}
+
 int bpp = 4;
 
 void golden_drawTransparentImage(Image_ img, Image_ from, int x, int y, int col = -1) {
@@ -45,6 +64,35 @@ void golden_fillRect(Image_ img, int x, int y, int w, int h, int c) {
         }
 }
 
+// the same mapping as drawTransformed(), computed separately for every pixel of img
+void golden_drawTransformed(Image_ img, Image_ from, int x, int y, int a, int b, int c, int d) {
+    int64_t det = (int64_t)a * d - (int64_t)b * c;
+    if (det == 0)
+        return;
+    const int64_t one = 0x10000;
+    int64_t ia = d * one * one / det, ib = -b * one * one / det;
+    int64_t ic = -c * one * one / det, id = a * one * one / det;
+    // drawTransformed() doesn't draw anything scaled by more than 256x
+    const int64_t lim = 1 << 24;
+    int64_t k[] = {a, b, c, d, ia, ib, ic, id};
+    for (int i = 0; i < 8; ++i)
+        if (k[i] <= -lim || k[i] >= lim)
+            return;
+    int sw = ImageMethods::width(from), sh = ImageMethods::height(from);
+    int64_t dcx = x * one + (sw << 15), dcy = y * one + (sh << 15);
+    for (int i = 0; i < ImageMethods::width(img); ++i)
+        for (int j = 0; j < ImageMethods::height(img); ++j) {
+            int64_t dx = i * one + 0x8000 - dcx, dy = j * one + 0x8000 - dcy;
+            int64_t u = (sw << 15) + ((ia * dx + ib * dy) >> 16);
+            int64_t v = (sh << 15) + ((ic * dx + id * dy) >> 16);
+            if (u < 0 || v < 0 || (u >> 16) >= sw || (v >> 16) >= sh)
+                continue;
+            auto pix = ImageMethods::getPixel(from, u >> 16, v >> 16);
+            if (pix)
+                ImageMethods::setPixel(img, i, j, pix);
+        }
+}
+
 int randCol() {
     return rand() & ((1<<bpp)-1);
 }
@@ -65,6 +113,19 @@ Image_ randomImg(int w, int h) {
     return screen;
 }
 
+// transparent around an ellipse, mostly horizontal bands of color inside, like a typical sprite
+Image_ shapeImg(int w, int h) {
+    auto img = mkImage(w, h, 4);
+    ImageMethods::fill(img, 0);
+    for (int i = 0; i < w; ++i)
+        for (int j = 0; j < h; ++j) {
+            int dx = (2 * i + 1 - w) * h, dy = (2 * j + 1 - h) * w;
+            if (dx * dx + dy * dy <= w * w * h * h)
+                ImageMethods::setPixel(img, i, j, rand() % 16 ? 1 + j * 4 / h : rand() & 15);
+        }
+    return img;
+}
+
 void dumpBytes(const char *lbl, const uint8_t *ptr) {
     printf("%s:", lbl);
     for (int i = 0; i < 16; ++i) {
@@ -113,6 +174,263 @@ void refill() {
     ImageMethods::copyFrom(s2, s1);
 }
 
+// a font with random glyphs for ASCII and a few characters further up
+Buffer randomFont(int w, int h, int *glyphSize) {
+    static const int extra[] = {0xe9, 0x100, 0x103, 0x13f, 0x2190};
+    int numExtra = sizeof(extra) / sizeof(extra[0]);
+    int numGlyphs = 95 + numExtra;
+    *glyphSize = 2 + ((h + 7) >> 3) * w;
+    auto font = mkBuffer(NULL, numGlyphs * *glyphSize);
+    for (int g = 0; g < numGlyphs; ++g) {
+        auto p = font->data + g * *glyphSize;
+        int ch = g < 95 ? 32 + g : extra[g - 95];
+        p[0] = ch;
+        p[1] = ch >> 8;
+        for (int i = 2; i < *glyphSize; ++i)
+            p[i] = rand();
+    }
+    return font;
+}
+
+void golden_print(Image_ img, const int *text, int len, int x, int y, int c, Buffer font, int w,
+                  int h, int mult, const int16_t *offsets, int numOffsets) {
+    int byteHeight = (h + 7) >> 3;
+    int glyphSize = 2 + byteHeight * w;
+    int x0 = x;
+    for (int k = 0; k < len; ++k) {
+        int ch = text[k];
+        if (ch == 10) {
+            y += h * mult + 2;
+            x = x0;
+        }
+        if (ch < 32)
+            continue;
+        auto glyph = font->data;
+        for (int g = 0; g < font->length / glyphSize; ++g)
+            if ((font->data[g * glyphSize] | (font->data[g * glyphSize + 1] << 8)) == ch)
+                glyph = font->data + g * glyphSize;
+        int dx = k < numOffsets ? offsets[2 * k] * mult : 0;
+        int dy = k < numOffsets ? offsets[2 * k + 1] * mult : 0;
+        for (int i = 0; i < w; ++i)
+            for (int j = 0; j < h; ++j)
+                if (glyph[2 + i * byteHeight + (j >> 3)] & (1 << (j & 7)))
+                    golden_fillRect(img, x + dx + i * mult, y + dy + j * mult, mult, mult, c);
+        x += w * mult;
+    }
+}
+
+void testPrint() {
+    // "Az é\n~ā←?" with a character missing from the font at the end
+    static const char utf8[] = "Az \xc3\xa9\n~\xc4\x81\xe2\x86\x90\xe2\x86\x91";
+    static const int text[] = {'A', 'z', ' ', 0xe9, '\n', '~', 0x101, 0x2190, 0x2191};
+    int len = sizeof(text) / sizeof(text[0]);
+    auto str = mkString(utf8, sizeof(utf8) - 1);
+
+    for (int i = 0; i < 300; ++i) {
+        int w = rr(3, 13), h = rr(3, 18), mult = rr(1, 4), glyphSize;
+        auto font = randomFont(w, h, &glyphSize);
+        int numOffsets = rand() & 1 ? rr(0, len + 2) : 0;
+        auto args = mkBuffer(NULL, 8 + 4 * numOffsets);
+        auto offsets = (int16_t *)(args->data + 8);
+        for (int k = 0; k < 2 * numOffsets; ++k)
+            offsets[k] = rr(-3, 4);
+        int x = rr(-40, 180), y = rr(-40, 140), c = rr(1, 1 << bpp);
+        auto a = (int16_t *)args->data;
+        a[0] = x;
+        a[1] = y;
+        args->data[4] = c;
+        args->data[5] = w;
+        args->data[6] = h;
+        args->data[7] = mult;
+
+        refill();
+        ImageMethods::_print(s1, str, font, args);
+        golden_print(s2, text, len, x, y, c, font, w, h, mult, offsets, numOffsets);
+        assertSame(s1, s2);
+        free(font);
+        free(args);
+    }
+}
+
+void testTilemap() {
+    for (int i = 0; i < 100; ++i) {
+        int scale = rr(2, 6), size = 1 << scale;
+        int mapW = rr(1, 40), mapH = rr(1, 40);
+        auto map = mkBuffer(NULL, 4 + mapW * mapH);
+        map->data[0] = mapW;
+        map->data[2] = mapH;
+        // empty, opaque, partly transparent and missing tiles
+        TValue tiles[8];
+        int numTiles = rr(1, 8);
+        for (int k = 0; k < numTiles; ++k) {
+            auto tile = randomImg(rr(1, size + 1), rr(1, size + 1));
+            if (k % 4 == 0)
+                ImageMethods::fill(tile, 0);
+            else if (k % 4 == 1)
+                ImageMethods::fill(tile, rr(1, 16));
+            else if (k % 4 == 3)
+                ImageMethods::replace(tile, 0, 5);
+            tiles[k] = (TValue)tile;
+            if (k == 2 && rand() % 2) {
+                free(tile);
+                tiles[k] = NULL;
+            }
+        }
+        for (int k = 4; k < map->length; ++k)
+            map->data[k] = rr(0, numTiles + 1);
+        int offsetX = rr(-40, mapW * size), offsetY = rr(-40, mapH * size);
+
+        refill();
+        tiles::drawTilemap(s1, map, tiles, numTiles, offsetX, offsetY, scale);
+        int mask = size - 1;
+        int x0 = max(0, offsetX >> scale), y0 = max(0, offsetY >> scale);
+        for (int x = x0; x <= min(mapW, ((offsetX + s2->width()) >> scale) + 1); ++x)
+            for (int y = y0; y <= min(mapH, ((offsetY + s2->height()) >> scale) + 1); ++y) {
+                int index = x < mapW && y < mapH ? map->data[4 + x + y * mapW] : 0;
+                if (index < numTiles && tiles[index])
+                    golden_drawTransparentImage(s2, (Image_)tiles[index],
+                                                ((x - x0) << scale) - (offsetX & mask),
+                                                ((y - y0) << scale) - (offsetY & mask));
+            }
+        assertSame(s1, s2);
+
+        auto walls = randomImg(mapW, mapH);
+        for (int k = 0; k < 20; ++k) {
+            int wx0 = rr(-2, mapW + 2), wy0 = rr(-2, mapH + 2);
+            int wx1 = wx0 + rr(0, 4), wy1 = wy0 + rr(0, 4);
+            bool isWall = false;
+            for (int x = wx0; x <= wx1; ++x)
+                for (int y = wy0; y <= wy1; ++y)
+                    if (x < 0 || y < 0 || x >= mapW || y >= mapH ||
+                        ImageMethods::getPixel(walls, x, y) == 2)
+                        isWall = true;
+            if (tiles::isWallInRect(map, walls, wx0, wy0, wx1, wy1) != isWall) {
+                printf("Wall mismatch at %d,%d-%d,%d\n", wx0, wy0, wx1, wy1);
+                abort();
+            }
+        }
+
+        free(walls);
+        for (int k = 0; k < numTiles; ++k)
+            free(tiles[k]);
+        free(map);
+    }
+}
+
+void testBatch() {
+    for (int i = 0; i < 100; ++i) {
+        TValue images[20];
+        ImageMethods::BatchEntry entries[20];
+        int n = rr(1, 20);
+        for (int k = 0; k < n; ++k) {
+            images[k] = (TValue)randomImg(rr(1, 40), rr(1, 40));
+            entries[k].x = rr(-50, 200);
+            entries[k].y = rr(-50, 200);
+            entries[k].flags = rr(0, 8);
+        }
+
+        refill();
+        ImageMethods::drawBatch(s1, images, entries, n);
+        for (int k = 0; k < n; ++k) {
+            auto from = (Image_)images[k];
+            auto e = &entries[k];
+            int w = ImageMethods::width(from), h = ImageMethods::height(from);
+            for (int sx = 0; sx < w; ++sx)
+                for (int sy = 0; sy < h; ++sy) {
+                    int c = ImageMethods::getPixel(from, sx, sy);
+                    int dx = e->flags & 1 ? e->x + w - 1 - sx : e->x + sx;
+                    int dy = e->flags & 2 ? e->y + h - 1 - sy : e->y + sy;
+                    if (c || (e->flags & 4))
+                        ImageMethods::setPixel(s2, dx, dy, c);
+                }
+        }
+        assertSame(s1, s2);
+
+        for (int k = 0; k < n; ++k)
+            free(images[k]);
+    }
+}
+
+// a few pixels set here and there
+Image_ sparseImg(int w, int h) {
+    auto img = mkImage(w, h, bpp);
+    ImageMethods::fill(img, 0);
+    for (int i = 0; i < w; ++i)
+        for (int j = 0; j < h; ++j)
+            if (rand() % 30 == 0)
+                ImageMethods::setPixel(img, i, j, rr(1, 1 << bpp));
+    return img;
+}
+
+bool golden_overlapsWith(Image_ img, Image_ other, int x, int y) {
+    for (int i = 0; i < ImageMethods::width(other); ++i)
+        for (int j = 0; j < ImageMethods::height(other); ++j)
+            if (ImageMethods::getPixel(other, i, j) && img->inRange(x + i, y + j) &&
+                ImageMethods::getPixel(img, x + i, y + j))
+                return true;
+    return false;
+}
+
+void testOverlaps() {
+    int numOverlaps = 0;
+    for (int i = 0; i < 1000; ++i) {
+        auto a = sparseImg(rr(1, 70), rr(1, 70));
+        auto b = sparseImg(rr(1, 70), rr(1, 70));
+        // compressed images get their mask without being expanded
+        if (bpp == 4 && i % 3 == 0) {
+            auto packed = ImageMethods::compressed(b);
+            free(b);
+            b = packed;
+        }
+        int x = rr(-70, 70), y = rr(-70, 70);
+        // the second check is after a pixel change, which needs a new mask
+        for (int k = 0; k < 2; ++k) {
+            bool expected = golden_overlapsWith(a, b, x, y);
+            if (ImageMethods::overlapsWith(a, b, x, y) != expected) {
+                printf("Overlap mismatch at %d,%d\n", x, y);
+                abort();
+            }
+            numOverlaps += expected;
+            ImageMethods::setPixel(k ? b : a, rr(0, 70), rr(0, 70), 1);
+        }
+        free(a);
+        free(b);
+    }
+    if (numOverlaps < 100) {
+        printf("Only %d overlaps\n", numOverlaps);
+        abort();
+    }
+}
+
+void testRleValidation() {
+    auto img = mkImage(16, 16, 4);
+    ImageMethods::fill(img, 5);
+    auto packed = ImageMethods::compressed(img);
+    if (!packed->isCompressed() || !isValidImage(packed->buffer)) {
+        printf("Filled image not compressed\n");
+        abort();
+    }
+    // the first column is a single fill run
+    auto hd = (ImageHeader *)packed->buffer->data;
+    auto col = hd->pixels + 2 * hd->width + (hd->pixels[0] | (hd->pixels[1] << 8));
+    if (col[0] >> 6 != 2 || col[1] != 5) {
+        printf("Unexpected fill run %x %x\n", col[0], col[1]);
+        abort();
+    }
+    col[1] = 0x15;
+    if (isValidImage(packed->buffer)) {
+        printf("Fill color above 15 accepted\n");
+        abort();
+    }
+    col[1] = 15;
+    if (!isValidImage(packed->buffer)) {
+        printf("Fill color 15 rejected\n");
+        abort();
+    }
+    free(img);
+    free(packed);
+}
+
 void testBPP() {
     if (bpp == 1)
         s1 = randomImg(178, 128);
@@ -121,6 +439,7 @@ void testBPP() {
     s2 = ImageMethods::clone(s1);
     assertSame(s1, s2);
     //auto sprite = randomImg(16, 16);
+    int numCompressed = 0;
 
     for (int i = 0; i < 500; ++i) {
         refill();
@@ -157,6 +476,19 @@ void testBPP() {
         golden_fillRect(s2, x, y, w, h, col);
         assertSame(s1, s2);
 
+        // any rotation, scaling and shearing
+        int m[4];
+        for (int k = 0; k < 4; ++k)
+            m[k] = rr(-0x30000, 0x30000);
+        refill();
+        ImageMethods::drawTransformed(s1, sprite, x, y, m[0], m[1], m[2], m[3]);
+        golden_drawTransformed(s2, sprite, x, y, m[0], m[1], m[2], m[3]);
+        assertSame(s1, s2);
+        refill();
+        ImageMethods::drawTransformed(s1, sprite, x, y, 0x10000, 0, 0, 0x10000);
+        golden_drawTransparentImage(s2, sprite, x, y);
+        assertSame(s1, s2);
+
         free(sprite);
 
         if (bpp == 4) {
@@ -171,9 +503,57 @@ void testBPP() {
             golden_drawTransparentImage(s2, sprite, x, y, c);
             assertSame(s1, s2);
             free(sprite);
+
+            // drawing straight from compressed images
+            auto shape = shapeImg(w, h);
+            auto packed = ImageMethods::compressed(shape);
+            refill();
+            ImageMethods::drawTransparentImage(s1, packed, x, y);
+            golden_drawTransparentImage(s2, shape, x, y);
+            assertSame(s1, s2);
+            refill();
+            ImageMethods::drawImage(s1, packed, x, y);
+            golden_drawTransparentImage(s2, shape, x, y, -2);
+            assertSame(s1, s2);
+            ImageMethods::fill(s1, 0);
+            ImageMethods::drawTransparentImage(s1, shape, rr(-30, 200), rr(-30, 200));
+            if (ImageMethods::overlapsWith(s1, packed, x, y) !=
+                ImageMethods::overlapsWith(s1, shape, x, y)) {
+                printf("Compressed overlap mismatch\n");
+                abort();
+            }
+            if (packed->isCompressed()) {
+                numCompressed++;
+                if (!isValidImage(packed->buffer)) {
+                    printf("Invalid compressed image: %dx%d\n", w, h);
+                    abort();
+                }
+            }
+            // getPixel() expands it
+            assertSame(packed, shape);
+            if (packed->isCompressed()) {
+                printf("Not expanded\n");
+                abort();
+            }
+            free(shape);
+            free(packed);
         }
     }
 
+    // small sprites don't get any smaller
+    if (bpp == 4 && numCompressed < 100) {
+        printf("Only %d images compressed\n", numCompressed);
+        abort();
+    }
+
+    testPrint();
+    if (bpp == 4) {
+        testTilemap();
+        testRleValidation();
+    }
+    testBatch();
+    testOverlaps();
+
     printf("OK bpp=%d\n", bpp);
 
 }
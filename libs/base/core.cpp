@@ -56,6 +56,15 @@ void setBinding(int source, int value, Action act) {
     handlerBindings = curr;
 }
 
+// the list lives on the GC heap; these are for heap snapshots
+HandlerBinding *getHandlerBindings() {
+    return handlerBindings;
+}
+
+void setHandlerBindings(HandlerBinding *bindings) {
+    handlerBindings = bindings;
+}
+
 void coreReset() {
     // these are allocated on GC heap, so they will go away together with the reset
     handlerBindings = NULL;
@@ -1501,7 +1510,7 @@ int *getBootloaderConfigData() {
 //%
 int getConfig(int key, int defl) {
 #ifdef PXT_VM
-    int *cfgData = vmImg->configData;
+    int *cfgData = vmCurrent->img->configData;
 #else
     int *cfgData = bytecode ? *(int **)&bytecode[18] : NULL;
 #endif
@@ -1594,7 +1603,7 @@ TValue mapGetByString(RefMap *map, String key) {
 }
 
 #ifdef PXT_VM
-#define IFACE_MEMBER_NAMES vmImg->ifaceMemberNames
+#define IFACE_MEMBER_NAMES vmCurrent->img->ifaceMemberNames
 #else
 #define IFACE_MEMBER_NAMES *(uintptr_t **)&bytecode[22]
 #endif
@@ -1665,7 +1674,11 @@ void *getGlobalsPtr() {
     fiber_set_group(DEVICE_GROUP_ID_USER);
 #endif
 
+#ifdef PXT_VM
+    return vmCurrent->globals;
+#else
     return globals;
+#endif
 }
 
 //%
@@ -355,9 +355,12 @@ static void mark(int flags) {
     gcProcessStacks(flags);
 #endif
 
+#ifdef PXT_VM
+    auto globals = vmCurrent->globals;
+#endif
     if (globals) {
 #ifdef PXT_VM
-        auto nonPtrs = vmImg->infoHeader->nonPointerGlobals;
+        auto nonPtrs = vmCurrent->img->infoHeader->nonPointerGlobals;
 #else
         auto nonPtrs = bytecode[21];
 #endif
@@ -579,6 +582,7 @@ static void sweep(int flags) {
 }
 
 void gc(int flags) {
+    PXT_TRACE_BEGIN("gc");
     startPerfCounter(PerfCounters::GC);
     GC_CHECK(!(inGC & IN_GC_COLLECT), 40);
     inGC |= IN_GC_COLLECT;
@@ -589,6 +593,7 @@ void gc(int flags) {
     VLOG("GC done");
     stopPerfCounter(PerfCounters::GC);
     inGC &= ~IN_GC_COLLECT;
+    PXT_TRACE_END("gc");
 }
 
 #ifdef GC_GET_HEAP_SIZE
@@ -677,12 +682,14 @@ void gcReset() {
 #ifdef PXT_VM
 static uint8_t *preallocBlock;
 static uint8_t *preallocPointer;
+static uint8_t *preallocEnd;
 
 #define PREALLOC_SIZE (1024 * 1024)
 
 void gcPreStartup() {
-    xfree(preallocBlock);
-    preallocBlock = (uint8_t *)xmalloc(PREALLOC_SIZE);
+    // the same block is reused for every image, so it keeps its address
+    if (!preallocBlock)
+        preallocBlock = (uint8_t *)gcAllocPreallocBlock(PREALLOC_SIZE);
     preallocPointer = preallocBlock;
     if (!isReadOnly((TValue)preallocBlock))
         oops(40);
@@ -691,6 +698,7 @@ void gcPreStartup() {
 
 void gcStartup() {
     inGC &= ~IN_GC_PREALLOC;
+    preallocEnd = preallocPointer;
     preallocPointer = NULL;
 }
 
@@ -710,6 +718,87 @@ void *gcPrealloc(int numbytes) {
 bool inGCPrealloc() {
     return (inGC & IN_GC_PREALLOC) != 0;
 }
+
+// Heap snapshots, see vmsnapshot.cpp in core---vm
+
+void gcPreallocRange(uint8_t **start, uint8_t **end) {
+    *start = preallocBlock;
+    *end = preallocEnd;
+}
+
+int gcGetBlocks(GCBlockInfo *dst, int maxBlocks) {
+    int n = 0;
+    for (auto h = firstBlock; h; h = h->next) {
+        if (n < maxBlocks) {
+            dst[n].addr = h;
+            dst[n].size = h->blockSize + sizeof(GCBlock);
+        }
+        n++;
+    }
+    return n;
+}
+
+// Makes sure the heap has exactly the given blocks, at the given addresses. The blocks we
+// already have need to match the start of the list; the rest are allocated. The contents of
+// the new blocks are to be filled in by the caller.
+bool gcRestoreBlocks(GCBlockInfo *blocks, int numBlocks) {
+    int i = 0;
+    for (auto h = firstBlock; h; h = h->next, ++i) {
+        if (i >= numBlocks || (void *)h != blocks[i].addr ||
+            h->blockSize + sizeof(GCBlock) != blocks[i].size) {
+            DMESG("snapshot: heap block %d at %p doesn't match", i, h);
+            return false;
+        }
+    }
+    for (; i < numBlocks; ++i) {
+        auto curr = (GCBlock *)GC_ALLOC_BLOCK(blocks[i].size);
+        curr->blockSize = blocks[i].size - sizeof(GCBlock);
+        setupFreeBlock(curr);
+        linkFreeBlock(curr);
+        if ((void *)curr != blocks[i].addr) {
+            DMESG("snapshot: heap block %d at %p, not %p", i, curr, blocks[i].addr);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Called after the block contents were restored. reloc() is applied to the vtable of every
+// object, and to all other words, except in strings, buffers and numbers. The free list is
+// rebuilt by the next gc().
+void gcRestoreDone(uintptr_t (*reloc)(uintptr_t)) {
+    firstFree = NULL;
+    midPtr = (uint8_t *)firstBlock->data;
+    if (!reloc)
+        return;
+    for (auto h = firstBlock; h; h = h->next) {
+        auto d = h->data;
+        auto end = d + BYTES_TO_WORDS(h->blockSize);
+        while (d < end) {
+            auto words = (uintptr_t *)d;
+            uint32_t size;
+            bool scan = true;
+            if (IS_VAR_BLOCK(d->vtable)) {
+                size = VAR_BLOCK_WORDS(d->vtable);
+                scan = !IS_FREE(d->vtable);
+            } else {
+                d->vtable = reloc(d->vtable);
+                size = getObjectSize(d);
+                auto cls = ((VTable *)d->vtable)->classNo;
+                scan = cls != BuiltInType::BoxedString && cls != BuiltInType::BoxedNumber &&
+                       cls != BuiltInType::BoxedBuffer;
+            }
+            if (scan)
+                for (uint32_t i = 1; i < size; ++i)
+                    words[i] = reloc(words[i]);
+            d += size;
+        }
+    }
+}
+
+LLSegment *gcGetRoots() {
+    return &gcRoots;
+}
 #endif
 
 void *gcAllocate(int numbytes) {
@@ -850,6 +939,8 @@ void unregisterGCPtr(TValue ptr) {
 
 void RefImage::scan(RefImage *t) {
     gcScan((TValue)t->buffer);
+    if (t->mask)
+        gcScan((TValue)t->mask);
 }
 
 void RefCollection::scan(RefCollection *t) {
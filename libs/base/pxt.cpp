@@ -316,7 +316,7 @@ void RefAction::destroy(RefAction *t) {}
 void RefAction::print(RefAction *t) {
 #ifdef PXT_VM
     DMESG("RefAction %p pc=%X size=%d", t,
-          (const uint8_t *)t->func - (const uint8_t *)vmImg->dataStart, t->len);
+          (const uint8_t *)t->func - (const uint8_t *)vmCurrent->img->dataStart, t->len);
 #else
     DMESG("RefAction %p pc=%X size=%d", t, (const uint8_t *)t->func - (const uint8_t *)bytecode,
           t->len);
@@ -377,8 +377,8 @@ void error(PXT_PANIC code, int subcode) {
 
 #ifndef PXT_VM
 uint16_t *bytecode;
-#endif
 TValue *globals;
+#endif
 
 void checkStr(bool cond, const char *msg) {
     if (!cond) {
@@ -391,19 +391,19 @@ void checkStr(bool cond, const char *msg) {
 
 #ifdef PXT_VM
 int templateHash() {
-    return (int)vmImg->infoHeader->hexHash;
+    return (int)vmCurrent->img->infoHeader->hexHash;
 }
 
 int programHash() {
-    return (int)vmImg->infoHeader->programHash;
+    return (int)vmCurrent->img->infoHeader->programHash;
 }
 
 int getNumGlobals() {
-    return (int)vmImg->infoHeader->allocGlobals;
+    return (int)vmCurrent->img->infoHeader->allocGlobals;
 }
 
 String programName() {
-    return mkString((char *)vmImg->infoHeader->name);
+    return mkString((char *)vmCurrent->img->infoHeader->name);
 }
 #else
 int templateHash() {
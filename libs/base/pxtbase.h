@@ -59,7 +59,15 @@ void *operator new(size_t size);
 #include "pxtcore.h"
 
 #ifndef PXT_REGISTER_RESET
-#define PXT_REGISTER_RESET(fn) ((void)0)
+// reset restarts the whole program on these targets, so there is nothing to run
+#define PXT_REGISTER_RESET(fn) ((void)(fn))
+#endif
+
+#ifndef PXT_TRACE_BEGIN
+#define PXT_TRACE_BEGIN(name) ((void)0)
+#define PXT_TRACE_END(name) ((void)0)
+#define PXT_TRACE_INSTANT(name, a, b) ((void)0)
+#define PXT_TRACE_COUNTER(name, value) ((void)0)
 #endif
 
 #define PXT_REFCNT_FLASH 0xfffe
@@ -291,7 +299,9 @@ typedef enum {
 } PXT_PANIC;
 
 extern const uintptr_t functionsAndBytecode[];
+#ifndef PXT_VM
 extern TValue *globals;
+#endif
 extern uint16_t *bytecode;
 class RefRecord;
 
@@ -382,6 +392,8 @@ struct HandlerBinding {
 HandlerBinding *findBinding(int source, int value);
 HandlerBinding *nextBinding(HandlerBinding *curr, int source, int value);
 void setBinding(int source, int value, Action act);
+HandlerBinding *getHandlerBindings();
+void setHandlerBindings(HandlerBinding *bindings);
 
 // Legacy stuff; should no longer be used
 //%
@@ -808,7 +820,17 @@ class BoxedBuffer : public RefObject {
 // that is: 0x87, 0x01 or 0x04 - bpp, width in little endian, height, 0x00, 0x00 followed by data
 // for 4 bpp images, rows are word-aligned (as in legacy)
 
+// Compressed format (4 bpp only):
+// 88 04 WW WW HH HH 00 00, then a little endian uint16 offset of each column's data (counted
+// from the first one), then the columns - runs of pixels from the top, adding up to the height:
+//   00nnnnnn        - n+1 transparent pixels
+//   01nnnnnn DATA   - n+1 pixels, two per byte, the upper one in the low nibble
+//   10nnnnnn CC     - n+1 pixels of color CC
+// Compressed images are drawn directly; anything else expands them first (see
+// RefImage::expand()).
+
 #define IMAGE_HEADER_MAGIC 0x87
+#define IMAGE_HEADER_MAGIC_RLE 0x88
 
 struct ImageHeader {
     uint8_t magic;
@@ -822,6 +844,12 @@ struct ImageHeader {
 class RefImage : public RefObject {
   public:
     BoxedBuffer *buffer;
+    // Bounding box of the pixels changed since the last takeDirty(); only kept once a display
+    // backend calls takeDirty() (dirtyY1 is -1 before that). Nothing changed if dirtyX0 >= dirtyX1.
+    int16_t dirtyX0, dirtyY0, dirtyX1, dirtyY1;
+    // Collision mask built by overlapsWith(); makeWritable() drops it, as the pixels are about to
+    // change.
+    BoxedBuffer *mask;
 
     RefImage(BoxedBuffer *buf);
     RefImage(uint32_t sz);
@@ -832,7 +860,13 @@ class RefImage : public RefObject {
     int length() { return (int)buffer->length; }
 
     ImageHeader *header() { return (ImageHeader *)buffer->data; }
-    int pixLength() { return length() - sizeof(ImageHeader); }
+    bool isCompressed() { return header()->magic == IMAGE_HEADER_MAGIC_RLE; }
+    void expand();
+    int pixLength() {
+        if (isCompressed())
+            expand();
+        return length() - sizeof(ImageHeader);
+    }
 
     int width() { return header()->width; }
     int height() { return header()->height; }
@@ -841,7 +875,11 @@ class RefImage : public RefObject {
 
     bool hasPadding() { return (height() & 0x7) != 0; }
 
-    uint8_t *pix() { return header()->pixels; }
+    uint8_t *pix() {
+        if (isCompressed())
+            expand();
+        return header()->pixels;
+    }
 
     int byteHeight() {
         if (bpp() == 1)
@@ -870,6 +908,14 @@ class RefImage : public RefObject {
     void clamp(int *x, int *y);
     void makeWritable();
 
+    void markDirty(int x, int y, int w, int h) {
+        if (dirtyY1 >= 0)
+            markDirtyCore(x, y, w, h);
+    }
+    void markAllDirty() { markDirty(0, 0, width(), height()); }
+    void markDirtyCore(int x, int y, int w, int h);
+    bool takeDirty(int *x, int *y, int *w, int *h);
+
     static void destroy(RefImage *t);
     static void scan(RefImage *t);
     static unsigned gcsize(RefImage *t);
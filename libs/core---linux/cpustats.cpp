@@ -0,0 +1,207 @@
+#include "pxt.h"
+
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+// CPU time per event handler, and a watchdog for handlers that don't yield.
+//
+// The scheduler calls cpuRunStart() when it switches to a fiber and cpuRunStop() when the
+// fiber yields (or finishes). Runs are attributed to the function of the action the fiber was
+// started with - a VM function section index, or the address of the native function on Linux.
+// The table is only touched on the executor, so it needs no locking.
+//
+// The watchdog thread looks at the run in progress every quarter of the limit, and logs (and
+// optionally raises an event) when one goes on for longer than the limit. It's off by default;
+// set PXT_WATCHDOG_MS=<ms> in the environment or call control.setCpuWatchdog().
+
+#define CPU_STATS_INITIAL_CAPACITY 64
+
+#ifndef DLLEXPORT
+#define DLLEXPORT extern "C"
+#endif
+
+namespace pxt {
+
+// keep in sync with cpustats.ts, function handlerCpuStats()
+struct HandlerCpuStats {
+    uint32_t handler;
+    uint32_t runs;
+    uint32_t maxRunUs;
+    uint32_t slowRuns;
+    double cpuUs;
+    double instructions;
+};
+
+static HandlerCpuStats *cpuEntries;
+static uint32_t cpuCapacity, cpuSize;
+
+static HandlerCpuStats *cpuCurrent;
+static uint64_t cpuRunStartUs;
+
+// read by the watchdog
+static volatile uint64_t watchdogRunStartUs; // 0 when no fiber is running
+static volatile uint32_t watchdogRunHandler;
+static volatile uint32_t watchdogRunSeq;
+static volatile uint32_t watchdogFlaggedSeq;
+static volatile int watchdogMs;
+static volatile int watchdogEventSource;
+static pthread_once_t watchdogOnce = PTHREAD_ONCE_INIT;
+
+static inline uint32_t hashHandler(uint32_t handler) {
+    return (handler * 2654435761U) >> 8;
+}
+
+static HandlerCpuStats *insertEntry(uint32_t handler) {
+    auto mask = cpuCapacity - 1;
+    for (auto i = hashHandler(handler) & mask;; i = (i + 1) & mask) {
+        auto e = &cpuEntries[i];
+        if (e->runs == 0) {
+            e->handler = handler;
+            cpuSize++;
+            return e;
+        }
+        if (e->handler == handler)
+            return e;
+    }
+}
+
+static void growTable() {
+    auto oldEntries = cpuEntries;
+    auto oldCapacity = cpuCapacity;
+    cpuCapacity = cpuCapacity ? cpuCapacity * 2 : CPU_STATS_INITIAL_CAPACITY;
+    cpuEntries = (HandlerCpuStats *)xmalloc(cpuCapacity * sizeof(HandlerCpuStats));
+    memset(cpuEntries, 0, cpuCapacity * sizeof(HandlerCpuStats));
+    cpuSize = 0;
+    for (uint32_t i = 0; i < oldCapacity; ++i) {
+        if (oldEntries[i].runs)
+            *insertEntry(oldEntries[i].handler) = oldEntries[i];
+    }
+    if (oldEntries)
+        xfree(oldEntries);
+}
+
+static HandlerCpuStats *findEntry(uint32_t handler) {
+    if (cpuSize * 4 >= cpuCapacity * 3)
+        growTable();
+    auto e = insertEntry(handler);
+    e->runs++;
+    return e;
+}
+
+void cpuRunStop(uint32_t instructions) {
+    auto e = cpuCurrent;
+    if (!e)
+        return;
+    cpuCurrent = NULL;
+    watchdogRunStartUs = 0;
+    auto elapsed = (uint32_t)(current_time_us() - cpuRunStartUs);
+    e->cpuUs += elapsed;
+    e->instructions += instructions;
+    if (elapsed > e->maxRunUs)
+        e->maxRunUs = elapsed;
+    if (watchdogFlaggedSeq == watchdogRunSeq)
+        e->slowRuns++;
+}
+
+void cpuRunStart(uint32_t handler) {
+    if (cpuCurrent)
+        cpuRunStop(0);
+    cpuCurrent = findEntry(handler);
+    cpuRunStartUs = current_time_us();
+    watchdogRunHandler = handler;
+    watchdogRunSeq = watchdogRunSeq + 1;
+    watchdogRunStartUs = cpuRunStartUs;
+}
+
+// Called when the program is reset; handler ids don't carry over to the next program.
+void cpuStatsReset() {
+    cpuCurrent = NULL;
+    watchdogRunStartUs = 0;
+    if (cpuEntries)
+        memset(cpuEntries, 0, cpuCapacity * sizeof(HandlerCpuStats));
+    cpuSize = 0;
+}
+
+static void *watchdogThread(void *) {
+    for (;;) {
+        int limit = watchdogMs;
+        int intervalMs = limit >= 8 ? limit / 4 : limit > 0 ? 2 : 100;
+        struct timespec ts;
+        ts.tv_sec = intervalMs / 1000;
+        ts.tv_nsec = (intervalMs % 1000) * 1000000;
+        nanosleep(&ts, NULL);
+
+        if (limit <= 0)
+            continue;
+        uint32_t seq = watchdogRunSeq;
+        uint64_t start = watchdogRunStartUs;
+        uint32_t handler = watchdogRunHandler;
+        if (!start || seq == watchdogFlaggedSeq || seq != watchdogRunSeq)
+            continue;
+        int elapsedMs = (int)((current_time_us() - start) / 1000);
+        if (elapsedMs < limit)
+            continue;
+        watchdogFlaggedSeq = seq;
+        DMESG_ERROR("handler %d running for %dms without yielding", handler, elapsedMs);
+        int source = watchdogEventSource;
+        if (source)
+            raiseEvent(source, handler);
+    }
+    return NULL;
+}
+
+static void startWatchdog() {
+    pthread_t pid;
+    pthread_create(&pid, NULL, watchdogThread, NULL);
+    pthread_detach(pid);
+}
+
+// Log runs longer than ms without yielding, and raise (eventSource, handler) if eventSource
+// is non-zero; ms <= 0 disables the watchdog.
+void cpuWatchdogSetup(int ms, int eventSource) {
+    watchdogEventSource = eventSource;
+    watchdogMs = ms;
+    if (ms > 0)
+        pthread_once(&watchdogOnce, startWatchdog);
+}
+
+// Called when the runtime starts.
+void cpuStatsInit() {
+    auto ms = getenv("PXT_WATCHDOG_MS");
+    if (ms)
+        cpuWatchdogSetup(atoi(ms), 0);
+}
+
+static int cmpCpuUs(const void *a, const void *b) {
+    auto ea = (const HandlerCpuStats *)a;
+    auto eb = (const HandlerCpuStats *)b;
+    return ea->cpuUs > eb->cpuUs ? -1 : ea->cpuUs < eb->cpuUs;
+}
+
+//%
+void setCpuWatchdog(int ms, int eventSource) {
+    cpuWatchdogSetup(ms, eventSource);
+}
+
+// Returns stats of up to maxEntries handlers, most CPU time first.
+//%
+Buffer getHandlerCpuStats(int maxEntries) {
+    if (maxEntries <= 0 || maxEntries > (int)cpuSize)
+        maxEntries = cpuSize;
+    auto sorted = (HandlerCpuStats *)xmalloc(cpuSize * sizeof(HandlerCpuStats) + 1);
+    int n = 0;
+    for (uint32_t i = 0; i < cpuCapacity; ++i)
+        if (cpuEntries[i].runs)
+            sorted[n++] = cpuEntries[i];
+    qsort(sorted, n, sizeof(HandlerCpuStats), cmpCpuUs);
+    auto res = mkBuffer((uint8_t *)sorted, maxEntries * sizeof(HandlerCpuStats));
+    xfree(sorted);
+    return res;
+}
+
+DLLEXPORT void pxt_set_watchdog(int ms, int eventSource) {
+    cpuWatchdogSetup(ms, eventSource);
+}
+
+} // namespace pxt
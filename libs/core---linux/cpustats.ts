@@ -0,0 +1,52 @@
+namespace control {
+    //% shim=pxt::getHandlerCpuStats
+    function getHandlerCpuStats(maxEntries: number): Buffer {
+        return null
+    }
+
+    //% shim=pxt::setCpuWatchdog
+    function setCpuWatchdogCore(ms: number, eventSource: number): void { }
+
+    export interface HandlerCpuStats {
+        // function the fiber was started with; 0 is the main program on Linux
+        handler: number;
+        runs: number;
+        maxRunUs: number;
+        slowRuns: number;
+        cpuUs: number;
+        instructions: number;
+    }
+
+    /**
+     * Get CPU time used by the event handlers (and other fibers) of the program, grouped by the
+     * function they run, most CPU time first
+     * @param maxEntries maximum number of handlers to return, eg: 10
+     */
+    export function handlerCpuStats(maxEntries = 10): HandlerCpuStats[] {
+        const buf = getHandlerCpuStats(maxEntries)
+        if (!buf)
+            return null
+        const res: HandlerCpuStats[] = []
+        for (let off = 0; off < buf.length; off += 32) {
+            res.push({
+                handler: buf.getNumber(NumberFormat.UInt32LE, off),
+                runs: buf.getNumber(NumberFormat.UInt32LE, off + 4),
+                maxRunUs: buf.getNumber(NumberFormat.UInt32LE, off + 8),
+                slowRuns: buf.getNumber(NumberFormat.UInt32LE, off + 12),
+                cpuUs: buf.getNumber(NumberFormat.Float64LE, off + 16),
+                instructions: buf.getNumber(NumberFormat.Float64LE, off + 24),
+            })
+        }
+        return res
+    }
+
+    /**
+     * Log handlers that run for longer than the given time without yielding, and optionally
+     * raise an event with the handler as the value
+     * @param ms time limit in milliseconds, 0 to disable
+     * @param eventSource event source to raise, or 0 to only log
+     */
+    export function setCpuWatchdog(ms: number, eventSource = 0) {
+        setCpuWatchdogCore(ms, eventSource)
+    }
+}
@@ -5,63 +5,226 @@
 #include <signal.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+// DMESG() only formats the message into a slot of a lock-free ring; a background thread
+// writes the messages out in batches to /tmp/dmesg.txt and stderr.
+//
+// PXT_DMESG_SYNC=never|periodic|panic|always selects when the file is fdatasync()ed:
+// never, about once a second, when the program panics (default), or after every message
+// (which also writes every message synchronously, the way it used to be).
+// PXT_DMESG_LEVEL=0..3 sets the runtime log level (see DMESG_LEVEL_* in pxtcore.h).
+
+#define DMESG_SLOT_SIZE 512
+#define DMESG_NUM_SLOTS 1024
+#define DMESG_SLOT_MASK (DMESG_NUM_SLOTS - 1)
+#define DMESG_FLUSH_INTERVAL_MS 50
+#define DMESG_SYNC_INTERVAL_MS 1000
 
 namespace pxt {
 
-static FILE *dmesgFile;
+enum DmesgSync { SYNC_NEVER, SYNC_PERIODIC, SYNC_ON_PANIC, SYNC_ALWAYS };
+
+int dmesgLevel = DMESG_LEVEL_INFO;
+
+struct DmesgSlot {
+    // sequence number relative to slot index, as in eventqueue.cpp
+    uint32_t seq;
+    uint32_t len;
+    char data[DMESG_SLOT_SIZE - 8];
+};
+
+static DmesgSlot dmesgSlots[DMESG_NUM_SLOTS];
+static uint32_t dmesgEnqueuePos;
+static uint32_t dmesgDequeuePos;
+static uint32_t dmesgDropped;
+
+static int dmesgFd = -1;
+static DmesgSync dmesgSync = SYNC_ON_PANIC;
+static pthread_once_t dmesgOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t flushMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t flusherMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusherCond = PTHREAD_COND_INITIALIZER;
 
+// last messages, for dumpDmesg(); protected by flushMutex
 static int dmesgPtr;
 static int dmesgSerialPtr;
 static char dmesgBuf[4096];
 
-void dumpDmesg() {
-    auto len = dmesgPtr - dmesgSerialPtr;
-    if (len == 0)
-        return;
-    sendSerial(dmesgBuf + dmesgSerialPtr, len);
-    dmesgSerialPtr = dmesgPtr;
-}
-
-
-static void dmesgRaw(const char *buf, uint32_t len) {
-    if (!dmesgFile) {
-        dmesgFile = fopen("/tmp/dmesg.txt", "w");
-        if (!dmesgFile)
-            dmesgFile = stderr;
+static void writeAll(int fd, const char *buf, int len) {
+    while (len > 0) {
+        int n = write(fd, buf, len);
+        if (n <= 0)
+            return;
+        buf += n;
+        len -= n;
     }
+}
 
-    if (len > sizeof(dmesgBuf) / 2)
+static void keepForSerial(const char *buf, int len) {
+    if (len > (int)sizeof(dmesgBuf) / 2)
         return;
-    if (dmesgPtr + len > sizeof(dmesgBuf)) {
+    if (dmesgPtr + len > (int)sizeof(dmesgBuf)) {
         dmesgPtr = 0;
         dmesgSerialPtr = 0;
     }
     memcpy(dmesgBuf + dmesgPtr, buf, len);
     dmesgPtr += len;
-    fwrite(buf, 1, len, dmesgFile);
+}
 
-    fwrite(buf, 1, len, stderr);
+static void writeBatch(const char *buf, int len) {
+    if (len == 0)
+        return;
+    if (dmesgFd >= 0)
+        writeAll(dmesgFd, buf, len);
+    writeAll(2, buf, len);
 }
 
-static void dmesgFlushRaw() {
-    fflush(dmesgFile);
+// write out all queued messages
+static void flushCore(bool sync) {
+    static char batch[16 * 1024];
+    int len = 0;
+
+    pthread_mutex_lock(&flushMutex);
+
+    uint32_t dropped = __atomic_exchange_n(&dmesgDropped, 0, __ATOMIC_ACQ_REL);
+    if (dropped)
+        len = snprintf(batch, sizeof(batch), "[dmesg: %d messages dropped]\n", dropped);
+
+    for (;;) {
+        uint32_t pos = dmesgDequeuePos;
+        auto slot = &dmesgSlots[pos & DMESG_SLOT_MASK];
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) + (pos & DMESG_SLOT_MASK);
+        if ((int)(seq - (pos + 1)) < 0)
+            break;
+        int n = slot->len;
+        if (len + n > (int)sizeof(batch)) {
+            writeBatch(batch, len);
+            len = 0;
+        }
+        memcpy(batch + len, slot->data, n);
+        keepForSerial(slot->data, n);
+        len += n;
+        __atomic_store_n(&slot->seq, pos + DMESG_NUM_SLOTS - (pos & DMESG_SLOT_MASK),
+                         __ATOMIC_RELEASE);
+        __atomic_store_n(&dmesgDequeuePos, pos + 1, __ATOMIC_RELEASE);
+    }
+    writeBatch(batch, len);
+
+    if (sync && dmesgFd >= 0) {
 #ifdef __linux__
-    fdatasync(fileno(dmesgFile));
+        fdatasync(dmesgFd);
 #else
-    fsync(fileno(dmesgFile));
+        fsync(dmesgFd);
 #endif
+    }
+
+    pthread_mutex_unlock(&flushMutex);
+}
+
+static void *dmesgFlusher(void *) {
+    int lastSync = current_time_ms();
+    for (;;) {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        uint64_t deadline = tv.tv_sec * 1000000ULL + tv.tv_usec + DMESG_FLUSH_INTERVAL_MS * 1000;
+        struct timespec ts;
+        ts.tv_sec = deadline / 1000000;
+        ts.tv_nsec = (deadline % 1000000) * 1000;
+        pthread_mutex_lock(&flusherMutex);
+        pthread_cond_timedwait(&flusherCond, &flusherMutex, &ts);
+        pthread_mutex_unlock(&flusherMutex);
+
+        int now = current_time_ms();
+        bool sync = dmesgSync == SYNC_PERIODIC && now - lastSync >= DMESG_SYNC_INTERVAL_MS;
+        if (sync)
+            lastSync = now;
+        flushCore(sync);
+    }
+    return NULL;
+}
+
+void dmesgInitLevel() {
+    auto level = getenv("PXT_DMESG_LEVEL");
+    if (level)
+        dmesgLevel = atoi(level);
+}
+
+static void dmesgInit() {
+    dmesgFd = open("/tmp/dmesg.txt", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    auto sync = getenv("PXT_DMESG_SYNC");
+    if (sync) {
+        if (!strcmp(sync, "never"))
+            dmesgSync = SYNC_NEVER;
+        else if (!strcmp(sync, "periodic"))
+            dmesgSync = SYNC_PERIODIC;
+        else if (!strcmp(sync, "always"))
+            dmesgSync = SYNC_ALWAYS;
+    }
+    if (dmesgSync != SYNC_ALWAYS) {
+        pthread_t pid;
+        pthread_create(&pid, NULL, dmesgFlusher, NULL);
+        pthread_detach(pid);
+    }
+}
+
+// Write out pending messages now. Called on exit.
+void dmesg_flush() {
+    flushCore(dmesgSync == SYNC_ALWAYS);
+}
+
+// Called from target_panic(); the messages need to hit the disk before we're killed.
+void dmesg_flush_panic() {
+    flushCore(dmesgSync != SYNC_NEVER);
+}
+
+void dumpDmesg() {
+    dmesg_flush();
+    pthread_mutex_lock(&flushMutex);
+    auto len = dmesgPtr - dmesgSerialPtr;
+    if (len)
+        sendSerial(dmesgBuf + dmesgSerialPtr, len);
+    dmesgSerialPtr = dmesgPtr;
+    pthread_mutex_unlock(&flushMutex);
 }
 
 void vdmesg(const char *format, va_list arg) {
-    char buf[500];
+    pthread_once(&dmesgOnce, dmesgInit);
+
+    uint32_t pos = __atomic_load_n(&dmesgEnqueuePos, __ATOMIC_ACQUIRE);
+    DmesgSlot *slot;
+    for (;;) {
+        slot = &dmesgSlots[pos & DMESG_SLOT_MASK];
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) + (pos & DMESG_SLOT_MASK);
+        int diff = (int)(seq - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&dmesgEnqueuePos, &pos, pos + 1, false,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                break;
+        } else if (diff < 0) {
+            // full; the flusher is behind
+            __atomic_fetch_add(&dmesgDropped, 1, __ATOMIC_ACQ_REL);
+            pthread_cond_signal(&flusherCond);
+            return;
+        } else {
+            pos = __atomic_load_n(&dmesgEnqueuePos, __ATOMIC_ACQUIRE);
+        }
+    }
 
-    snprintf(buf, sizeof(buf), "[%8d] ", current_time_ms());
-    dmesgRaw(buf, strlen(buf));
-    vsnprintf(buf, sizeof(buf), format, arg);
-    dmesgRaw(buf, strlen(buf));
-    dmesgRaw("\n", 1);
+    int maxLen = sizeof(slot->data) - 1; // leave space for \n
+    int len = snprintf(slot->data, maxLen, "[%8d] ", current_time_ms());
+    int n = vsnprintf(slot->data + len, maxLen - len, format, arg);
+    len += n < 0 ? 0 : n >= maxLen - len ? maxLen - len - 1 : n;
+    slot->data[len++] = '\n';
+    slot->len = len;
+    __atomic_store_n(&slot->seq, pos + 1 - (pos & DMESG_SLOT_MASK), __ATOMIC_RELEASE);
 
-    dmesgFlushRaw();
+    if (dmesgSync == SYNC_ALWAYS)
+        flushCore(true);
+    else if (pos - __atomic_load_n(&dmesgDequeuePos, __ATOMIC_ACQUIRE) > DMESG_NUM_SLOTS / 2)
+        pthread_cond_signal(&flusherCond);
 }
 
 void dmesg(const char *format, ...) {
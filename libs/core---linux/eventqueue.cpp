@@ -0,0 +1,264 @@
+#include "pxt.h"
+
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#endif
+
+// Bounded multi-producer, single-consumer queue of (source, value) events.
+//
+// raiseEvent() is called from the audio, display, serial and host threads; pushing an event
+// only claims a slot with a compare-and-swap. The consumer (the scheduler) is only signaled
+// when the queue goes from empty to non-empty, using an eventfd on Linux and a condition
+// variable elsewhere.
+//
+// When the queue is full, new events are dropped and counted; the consumer logs the count
+// and it's available from control.eventQueueStats() on the VM.
+
+#define EVQ_SIZE 1024
+#define EVQ_MASK (EVQ_SIZE - 1)
+#define EVQ_COALESCE_SLOTS 64
+#define EVQ_MAX_COALESCED 8
+
+#define ATOMIC_LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define ATOMIC_ADD(p, v) __atomic_fetch_add(p, v, __ATOMIC_ACQ_REL)
+#define ATOMIC_CAS(p, oldv, newv)                                                                  \
+    __atomic_compare_exchange_n(p, oldv, newv, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+
+namespace pxt {
+
+struct EventCell {
+    // sequence number, stored relative to the cell index, so that a zeroed array is a valid
+    // empty queue
+    uint32_t seq;
+    int source;
+    int value;
+};
+
+static EventCell evqCells[EVQ_SIZE];
+static uint32_t evqEnqueuePos;
+static uint32_t evqDequeuePos;
+// number of claimed slots, including ones still being written to
+static uint32_t evqPending;
+
+// keep in sync with core---vm/stats.ts, function eventQueueStats()
+struct EventQueueStats {
+    uint32_t raised;
+    uint32_t coalesced;
+    uint32_t overflows;
+    uint32_t maxPending;
+};
+static EventQueueStats evqStats;
+static uint32_t evqReportedOverflows;
+static int evqLastReport;
+
+// keys of the coalesced (source, value) pairs; entries are only ever added, with a CAS, so that
+// producers can scan the list without a lock
+static uint64_t evqCoalesced[EVQ_MAX_COALESCED];
+static uint64_t evqCoalesceSlots[EVQ_COALESCE_SLOTS];
+
+#ifdef __linux__
+static int evqFd = -1;
+static pthread_once_t evqOnce = PTHREAD_ONCE_INIT;
+
+static void evqInit() {
+    evqFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (evqFd < 0)
+        DMESG("eventfd() failed");
+}
+#else
+static pthread_mutex_t evqMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t evqCond = PTHREAD_COND_INITIALIZER;
+static bool evqSignaled;
+#endif
+
+static void evqSignal() {
+#ifdef __linux__
+    pthread_once(&evqOnce, evqInit);
+    uint64_t one = 1;
+    if (write(evqFd, &one, sizeof(one)) < 0) {
+        // counter overflow is the only possible error and the consumer is awake then anyway
+    }
+#else
+    pthread_mutex_lock(&evqMutex);
+    evqSignaled = true;
+    pthread_cond_signal(&evqCond);
+    pthread_mutex_unlock(&evqMutex);
+#endif
+}
+
+static inline uint64_t coalesceKey(int source, int value) {
+    // +1 so that a used slot is never 0
+    return (((uint64_t)(uint32_t)source << 32) | (uint32_t)value) + 1;
+}
+
+static inline uint64_t *coalesceSlot(uint64_t key) {
+    return &evqCoalesceSlots[(key * 0x9E3779B97F4A7C15ULL) >> 58];
+}
+
+static bool isCoalesced(uint64_t key) {
+    for (int i = 0; i < EVQ_MAX_COALESCED; ++i) {
+        uint64_t k = ATOMIC_LOAD(&evqCoalesced[i]);
+        if (k == key)
+            return true;
+        if (k == 0)
+            break;
+    }
+    return false;
+}
+
+// An event with this source and value is dropped while an identical one is still in the
+// queue. Only use it for events where the handler doesn't care how many times it was raised,
+// like the per-frame notification of the display thread. Can be called from any thread.
+void eventQueueCoalesce(int source, int value) {
+    uint64_t key = coalesceKey(source, value);
+    for (int i = 0; i < EVQ_MAX_COALESCED; ++i) {
+        uint64_t prev = 0;
+        if (ATOMIC_CAS(&evqCoalesced[i], &prev, key) || prev == key)
+            return;
+    }
+    DMESG("too many coalesced events");
+}
+
+static bool evqPushCore(int source, int value) {
+    uint32_t pos = ATOMIC_LOAD(&evqEnqueuePos);
+    EventCell *cell;
+    for (;;) {
+        cell = &evqCells[pos & EVQ_MASK];
+        uint32_t seq = ATOMIC_LOAD(&cell->seq) + (pos & EVQ_MASK);
+        int diff = (int)(seq - pos);
+        if (diff == 0) {
+            if (ATOMIC_CAS(&evqEnqueuePos, &pos, pos + 1))
+                break; // slot claimed
+            // pos was updated by failed CAS
+        } else if (diff < 0) {
+            return false; // full
+        } else {
+            pos = ATOMIC_LOAD(&evqEnqueuePos);
+        }
+    }
+
+    uint32_t pending = ATOMIC_ADD(&evqPending, 1);
+    cell->source = source;
+    cell->value = value;
+    ATOMIC_STORE(&cell->seq, pos + 1 - (pos & EVQ_MASK));
+
+    if (pending + 1 > evqStats.maxPending)
+        evqStats.maxPending = pending + 1; // racy, but it's only statistics
+    if (pending == 0)
+        evqSignal();
+    return true;
+}
+
+// Can be called from any thread.
+void eventQueuePush(int source, int value) {
+    ATOMIC_ADD(&evqStats.raised, 1);
+    PXT_TRACE_INSTANT("raiseEvent", source, value);
+
+    uint64_t *slot = NULL;
+    uint64_t key = coalesceKey(source, value);
+    if (ATOMIC_LOAD(&evqCoalesced[0]) && isCoalesced(key)) {
+        slot = coalesceSlot(key);
+        uint64_t prev = 0;
+        if (!ATOMIC_CAS(slot, &prev, key)) {
+            if (prev == key) {
+                ATOMIC_ADD(&evqStats.coalesced, 1);
+                return;
+            }
+            slot = NULL; // hash collision - just queue it
+        }
+    }
+
+    if (!evqPushCore(source, value)) {
+        if (slot)
+            ATOMIC_STORE(slot, (uint64_t)0);
+        ATOMIC_ADD(&evqStats.overflows, 1);
+    }
+}
+
+// Consumer only. Returns false when the queue is empty.
+bool eventQueuePop(int *source, int *value) {
+    uint32_t overflows = ATOMIC_LOAD(&evqStats.overflows);
+    if (overflows != evqReportedOverflows) {
+        // at most once a second
+        int now = current_time_ms();
+        if (now - evqLastReport >= 1000 || !evqReportedOverflows) {
+            DMESG("event queue full; %d events dropped", overflows - evqReportedOverflows);
+            evqReportedOverflows = overflows;
+            evqLastReport = now;
+        }
+    }
+
+    uint32_t pos = evqDequeuePos;
+    auto cell = &evqCells[pos & EVQ_MASK];
+    uint32_t seq = ATOMIC_LOAD(&cell->seq) + (pos & EVQ_MASK);
+    if ((int)(seq - (pos + 1)) < 0)
+        return false;
+
+    *source = cell->source;
+    *value = cell->value;
+    ATOMIC_STORE(&cell->seq, pos + EVQ_SIZE - (pos & EVQ_MASK));
+    evqDequeuePos = pos + 1;
+    ATOMIC_ADD(&evqPending, (uint32_t)-1);
+
+    uint64_t key = coalesceKey(*source, *value);
+    if (ATOMIC_LOAD(&evqCoalesced[0]) && isCoalesced(key)) {
+        uint64_t expected = key;
+        // from now on, an identical event is no longer a duplicate
+        ATOMIC_CAS(coalesceSlot(key), &expected, (uint64_t)0);
+    }
+
+    return true;
+}
+
+// Consumer only. Waits until an event is queued; timeoutMs < 0 means forever.
+void eventQueueWait(int timeoutMs) {
+    // there are events, or a producer is just about to publish one (and it may not signal,
+    // since it didn't see an empty queue)
+    if (ATOMIC_LOAD(&evqPending))
+        return;
+
+#ifdef __linux__
+    pthread_once(&evqOnce, evqInit);
+    struct pollfd pfd;
+    pfd.fd = evqFd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, timeoutMs) > 0) {
+        uint64_t cnt;
+        if (read(evqFd, &cnt, sizeof(cnt)) < 0) {
+            // already cleared
+        }
+    }
+#else
+    pthread_mutex_lock(&evqMutex);
+    if (!evqSignaled) {
+        if (timeoutMs < 0) {
+            pthread_cond_wait(&evqCond, &evqMutex);
+        } else {
+            struct timeval tv;
+            gettimeofday(&tv, NULL);
+            uint64_t deadline = tv.tv_sec * 1000000ULL + tv.tv_usec + timeoutMs * 1000ULL;
+            struct timespec ts;
+            ts.tv_sec = deadline / 1000000;
+            ts.tv_nsec = (deadline % 1000000) * 1000;
+            pthread_cond_timedwait(&evqCond, &evqMutex, &ts);
+        }
+    }
+    evqSignaled = false;
+    pthread_mutex_unlock(&evqMutex);
+#endif
+}
+
+//%
+Buffer getEventQueueStats() {
+    return mkBuffer((uint8_t *)&evqStats, sizeof(evqStats));
+}
+
+} // namespace pxt
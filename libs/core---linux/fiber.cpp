@@ -0,0 +1,115 @@
+#include "pxt.h"
+
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <errno.h>
+
+// User-space execution contexts for the scheduler in linux.cpp.
+//
+// Each fiber gets its own mmap()ed stack with a guard page at the bottom; the kernel only
+// backs the pages that are actually touched. Stacks of finished fibers are kept for reuse,
+// since a fiber is started for every event handler.
+//
+// Handlers used to run on pthreads, so by default fibers get the same 8MB of stack; only the
+// address space is reserved. PXT_FIBER_STACK_KB overrides it, e.g. for many thousands of fibers.
+
+#define FIBER_DEFAULT_STACK_SIZE (8 * 1024 * 1024)
+#define FIBER_MIN_STACK_SIZE (64 * 1024)
+#define FIBER_GUARD_SIZE 4096
+#define FIBER_STACK_POOL_SIZE 32
+
+namespace pxt {
+
+struct FiberCtx {
+    ucontext_t uctx;
+    // NULL when running on the stack of the pthread
+    uint8_t *stack;
+    void (*entry)(void *);
+    void *arg;
+};
+
+static uint8_t *stackPool[FIBER_STACK_POOL_SIZE];
+static int stackPoolSize;
+static size_t stackSize;
+
+static size_t fiberStackSize() {
+    if (!stackSize) {
+        size_t size = FIBER_DEFAULT_STACK_SIZE;
+        auto kb = getenv("PXT_FIBER_STACK_KB");
+        if (kb && atoi(kb) > 0)
+            size = (size_t)atoi(kb) * 1024;
+        if (size < FIBER_MIN_STACK_SIZE)
+            size = FIBER_MIN_STACK_SIZE;
+        // whole pages
+        stackSize = (size + FIBER_GUARD_SIZE - 1) & ~(size_t)(FIBER_GUARD_SIZE - 1);
+    }
+    return stackSize;
+}
+
+static uint8_t *allocStack() {
+    if (stackPoolSize)
+        return stackPool[--stackPoolSize];
+    auto r = (uint8_t *)mmap(NULL, fiberStackSize() + FIBER_GUARD_SIZE, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+    if (r == MAP_FAILED) {
+        DMESG("fiber stack mmap failed; err=%d", errno);
+        return NULL;
+    }
+    // stacks grow down
+    mprotect(r, FIBER_GUARD_SIZE, PROT_NONE);
+    return r;
+}
+
+static void freeStack(uint8_t *stack) {
+    if (stackPoolSize < FIBER_STACK_POOL_SIZE)
+        stackPool[stackPoolSize++] = stack;
+    else
+        munmap(stack, fiberStackSize() + FIBER_GUARD_SIZE);
+}
+
+static void fiberStart(unsigned lo, unsigned hi) {
+    // makecontext() only passes int arguments
+    auto f = (FiberCtx *)(((uintptr_t)hi << 16 << 16) | (uintptr_t)lo);
+    f->entry(f->arg);
+    // entry functions switch away and never return
+    target_panic(PANIC_INTERNAL_ERROR);
+}
+
+// Context of the calling pthread, to be switched away from (and back to).
+FiberCtx *fiberCreateMain() {
+    auto f = new FiberCtx();
+    memset(f, 0, sizeof(*f));
+    return f;
+}
+
+// Returns NULL when out of memory (or address space).
+FiberCtx *fiberCreate(void (*entry)(void *), void *arg) {
+    auto stack = allocStack();
+    if (!stack)
+        return NULL;
+    auto f = new FiberCtx();
+    memset(f, 0, sizeof(*f));
+    f->stack = stack;
+    f->entry = entry;
+    f->arg = arg;
+    getcontext(&f->uctx);
+    f->uctx.uc_stack.ss_sp = stack + FIBER_GUARD_SIZE;
+    f->uctx.uc_stack.ss_size = fiberStackSize();
+    f->uctx.uc_link = NULL;
+    uintptr_t p = (uintptr_t)f;
+    makecontext(&f->uctx, (void (*)())fiberStart, 2, (unsigned)p, (unsigned)(p >> 16 >> 16));
+    return f;
+}
+
+void fiberSwitch(FiberCtx *from, FiberCtx *to) {
+    swapcontext(&from->uctx, &to->uctx);
+}
+
+// Must not be called on the fiber being destroyed.
+void fiberDestroy(FiberCtx *f) {
+    if (f->stack)
+        freeStack(f->stack);
+    delete f;
+}
+
+} // namespace pxt
@@ -66,39 +66,43 @@ namespace pxt {
 static uint64_t startTime;
 static pthread_mutex_t execMutex;
 static pthread_mutex_t eventMutex;
-static pthread_cond_t newEventBroadcast;
 
+// User code runs in fibers (see fiber.cpp), which are all scheduled cooperatively on the
+// main pthread (the executor). A fiber only gives up control in sleep_ms(), waitForEvent()
+// or when it finishes. Events are raised from any thread into the event queue and dispatched
+// by the executor whenever it schedules.
 struct Thread {
     struct Thread *next;
     Action act;
     TValue arg0;
     TValue data0;
     TValue data1;
-    pthread_t pid;
-    pthread_cond_t waitCond;
+    void (*runner)(Thread *);
+    FiberCtx *fiber;
+    ThreadContext *threadCtx;
+    // ready or sleep queue
+    struct Thread *nextQueued;
+    int wakeTime;
     int waitSource;
     int waitValue;
+    // for cpustats.cpp
+    uint32_t handler;
 };
 
 static struct Thread *allThreads;
-static struct Event *eventHead, *eventTail;
+static struct Thread *currentThread;
+static struct Thread *readyHead, *readyTail;
+static struct Thread *sleepers; // sorted by wakeTime
+static struct Thread *deadThread;
+static pthread_t executorPid;
 
 struct Event {
-    struct Event *next;
     int source;
     int value;
 };
 
 Event lastEvent;
 
-Event *mkEvent(int source, int value) {
-    auto res = new Event();
-    memset(res, 0, sizeof(Event));
-    res->source = source;
-    res->value = value;
-    return res;
-}
-
 volatile bool paniced;
 extern "C" void drawPanic(int code);
 
@@ -118,6 +122,7 @@ extern "C" void target_panic(int error_code) {
     drawPanic(error_code);
     DMESG("PANIC %d", error_code);
     DMESG("errno=%d %s", prevErr, strerror(prevErr));
+    dmesg_flush_panic();
 
     for (int i = 0; i < 10; ++i) {
         sendSerial(buf, strlen(buf));
@@ -143,10 +148,19 @@ void sleep_core_us(uint64_t us) {
         ;
 }
 
+static void schedule();
+static void addSleeper(Thread *t);
+void setupThread(Action a, TValue arg = 0, void (*runner)(Thread *) = NULL, TValue d0 = 0,
+                 TValue d1 = 0);
+
 void sleep_ms(uint32_t ms) {
-    stopUser();
-    sleep_core_us(ms * 1000);
-    startUser();
+    if (!currentThread || !pthread_equal(pthread_self(), executorPid)) {
+        sleep_core_us(ms * 1000);
+        return;
+    }
+    currentThread->wakeTime = current_time_ms() + ms;
+    addSleeper(currentThread);
+    schedule();
 }
 
 void sleep_us(uint64_t us) {
@@ -171,7 +185,132 @@ int current_time_ms() {
     return current_time_us() / 1000;
 }
 
-void disposeThread(Thread *t) {
+static void makeReady(Thread *t) {
+    t->nextQueued = NULL;
+    if (readyTail)
+        readyTail->nextQueued = t;
+    else
+        readyHead = t;
+    readyTail = t;
+}
+
+static Thread *popReady() {
+    auto t = readyHead;
+    if (t) {
+        readyHead = t->nextQueued;
+        if (!readyHead)
+            readyTail = NULL;
+        t->nextQueued = NULL;
+    }
+    return t;
+}
+
+static void addSleeper(Thread *t) {
+    auto pp = &sleepers;
+    while (*pp && (*pp)->wakeTime - t->wakeTime <= 0)
+        pp = &(*pp)->nextQueued;
+    t->nextQueued = *pp;
+    *pp = t;
+}
+
+static void wakeSleepers() {
+    int now = current_time_ms();
+    while (sleepers && sleepers->wakeTime - now <= 0) {
+        auto t = sleepers;
+        sleepers = t->nextQueued;
+        makeReady(t);
+    }
+}
+
+static void dispatchEvent(Event &e) {
+    lastEvent = e;
+
+    auto curr = findBinding(e.source, e.value);
+    while (curr) {
+        setupThread(curr->action, fromInt(e.value));
+        curr = nextBinding(curr->next, e.source, e.value);
+    }
+}
+
+static void processEvents() {
+    Event ev;
+    while (!paniced && eventQueuePop(&ev.source, &ev.value)) {
+        for (auto thr = allThreads; thr; thr = thr->next) {
+            if (thr->waitSource == 0)
+                continue;
+            if (thr->waitValue != ev.value && thr->waitValue != DEVICE_EVT_ANY)
+                continue;
+            if (thr->waitSource == ev.source) {
+                thr->waitSource = 0; // once!
+                makeReady(thr);
+            } else if (thr->waitSource == DEVICE_ID_NOTIFY && ev.source == DEVICE_ID_NOTIFY_ONE) {
+                thr->waitSource = 0; // once!
+                makeReady(thr);
+                break; // do not wake up any other threads
+            }
+        }
+
+        dispatchEvent(ev);
+    }
+}
+
+// Wait for an event or the first sleeper, without holding the exec mutex.
+static void idleWait() {
+    int timeout = -1;
+    if (sleepers) {
+        timeout = sleepers->wakeTime - current_time_ms();
+        if (timeout <= 0)
+            return;
+    }
+    PXT_TRACE_BEGIN("idle");
+    stopUser();
+    eventQueueWait(timeout);
+    startUser();
+    PXT_TRACE_END("idle");
+}
+
+// the stack of a finished thread can only be freed once we're off it
+static void reapDeadThread() {
+    auto t = deadThread;
+    if (t) {
+        deadThread = NULL;
+        fiberDestroy(t->fiber);
+        delete t;
+    }
+}
+
+// The current thread has been put on a queue (or is finished); switch to the next one.
+static void schedule() {
+    auto curr = currentThread;
+    Thread *next;
+    cpuRunStop(0);
+    PXT_TRACE_END("fiber");
+    for (;;) {
+        processEvents();
+        wakeSleepers();
+        next = popReady();
+        if (next)
+            break;
+        idleWait();
+    }
+
+    if (next == curr) {
+        PXT_TRACE_BEGIN("fiber");
+        cpuRunStart(curr->handler);
+        return;
+    }
+
+    curr->threadCtx = getThreadContext();
+    currentThread = next;
+    setThreadContext(next->threadCtx);
+    fiberSwitch(curr->fiber, next->fiber);
+    // we're back in curr
+    reapDeadThread();
+    PXT_TRACE_BEGIN("fiber");
+    cpuRunStart(curr->handler);
+}
+
+static void disposeThread(Thread *t) {
     if (allThreads == t) {
         allThreads = t->next;
     } else {
@@ -183,21 +322,27 @@ void disposeThread(Thread *t) {
         }
     }
     unregisterGC(&t->act, 4);
-    pthread_cond_destroy(&t->waitCond);
-    delete t;
+    deadThread = t;
+    schedule();
+    // not reached
+}
+
+static void threadEntry(void *arg) {
+    reapDeadThread();
+    PXT_TRACE_BEGIN("fiber");
+    auto t = (Thread *)arg;
+    cpuRunStart(t->handler);
+    t->runner(t);
+    disposeThread(t);
 }
 
 static void runAct(Thread *thr) {
-    startUser();
     pxt::runAction1(thr->act, thr->arg0);
-    stopUser();
-    disposeThread(thr);
 }
 
 static void mainThread(Thread *) {}
 
-void setupThread(Action a, TValue arg = 0, void (*runner)(Thread *) = NULL, TValue d0 = 0,
-                 TValue d1 = 0) {
+void setupThread(Action a, TValue arg, void (*runner)(Thread *), TValue d0, TValue d1) {
     if (runner == NULL)
         runner = runAct;
     auto thr = new Thread();
@@ -209,19 +354,25 @@ void setupThread(Action a, TValue arg = 0, void (*runner)(Thread *) = NULL, TVal
     thr->arg0 = arg;
     thr->data0 = d0;
     thr->data1 = d1;
-    pthread_cond_init(&thr->waitCond, NULL);
+    thr->runner = runner;
+    // the native function, to tell handlers apart in the CPU stats; 0 is the main program
+    thr->handler = a ? (uint32_t)(uintptr_t)((RefAction *)a)->func : 0;
     if (runner == mainThread) {
-        thr->pid = pthread_self();
+        // the program itself runs on the executor's own stack
+        executorPid = pthread_self();
+        thr->fiber = fiberCreateMain();
+        currentThread = thr;
     } else {
-        pthread_create(&thr->pid, NULL, (void *(*)(void *))runner, thr);
-        THREAD_DBG("setup thread: %p (pid %p)", thr, thr->pid);
-        pthread_detach(thr->pid);
+        thr->fiber = fiberCreate(threadEntry, thr);
+        if (!thr->fiber)
+            target_panic(PANIC_MEMORY_LIMIT_EXCEEDED);
+        THREAD_DBG("setup thread: %p", thr);
+        makeReady(thr);
     }
 }
 
 void releaseFiber() {
-    stopUser();
-    pthread_exit(NULL);
+    disposeThread(currentThread);
 }
 
 void runInParallel(Action a) {
@@ -229,7 +380,6 @@ void runInParallel(Action a) {
 }
 
 static void runFor(Thread *t) {
-    startUser();
     while (true) {
         pxt::runAction0(t->act);
         sleep_ms(20);
@@ -242,71 +392,14 @@ void runForever(Action a) {
 
 void waitForEvent(int source, int value) {
     THREAD_DBG("waitForEv: %d %d", source, value);
-    auto self = pthread_self();
-    for (auto t = allThreads; t; t = t->next) {
-        THREAD_DBG("t: %p", t);
-        if (t->pid == self) {
-            pthread_mutex_lock(&eventMutex);
-            t->waitSource = source;
-            t->waitValue = value;
-            stopUser();
-            // spourious wake ups may occur they say
-            while (t->waitSource) {
-                pthread_cond_wait(&t->waitCond, &eventMutex);
-            }
-            pthread_mutex_unlock(&eventMutex);
-            startUser();
-            return;
-        }
-    }
-    DMESG("current thread not registered!");
-    oops(52);
-}
-
-static void dispatchEvent(Event &e) {
-    lastEvent = e;
-
-    auto curr = findBinding(e.source, e.value);
-    while(curr) {
-        setupThread(curr->action, fromInt(e.value));
-        curr = nextBinding(curr->next, e.source, e.value);
-    }
-}
-
-static void *evtDispatcher(void *dummy) {
-    pthread_mutex_lock(&eventMutex);
-    while (true) {
-        pthread_cond_wait(&newEventBroadcast, &eventMutex);
-        while (eventHead != NULL) {
-            if (paniced)
-                return 0;
-            Event *ev = eventHead;
-            eventHead = ev->next;
-            if (eventHead == NULL)
-                eventTail = NULL;
-
-            for (auto thr = allThreads; thr; thr = thr->next) {
-                if (paniced)
-                    return 0;
-                if (thr->waitSource == 0)
-                    continue;
-                if (thr->waitValue != ev->value && thr->waitValue != DEVICE_EVT_ANY)
-                    continue;
-                if (thr->waitSource == ev->source) {
-                    thr->waitSource = 0; // once!
-                    pthread_cond_broadcast(&thr->waitCond);
-                } else if (thr->waitSource == DEVICE_ID_NOTIFY &&
-                           ev->source == DEVICE_ID_NOTIFY_ONE) {
-                    thr->waitSource = 0; // once!
-                    pthread_cond_broadcast(&thr->waitCond);
-                    break; // do not wake up any other threads
-                }
-            }
-
-            dispatchEvent(*ev);
-            delete ev;
-        }
+    auto t = currentThread;
+    if (!t || !pthread_equal(pthread_self(), executorPid)) {
+        DMESG("waitForEvent() outside of the executor");
+        oops(52);
     }
+    t->waitSource = source;
+    t->waitValue = value;
+    schedule();
 }
 
 int allocateNotifyEvent() {
@@ -318,18 +411,7 @@ int allocateNotifyEvent() {
 }
 
 void raiseEvent(int id, int event) {
-    auto e = mkEvent(id, event);
-    pthread_mutex_lock(&eventMutex);
-    if (eventTail == NULL) {
-        if (eventHead != NULL)
-            oops(51);
-        eventHead = eventTail = e;
-    } else {
-        eventTail->next = e;
-        eventTail = e;
-    }
-    pthread_cond_broadcast(&newEventBroadcast);
-    pthread_mutex_unlock(&eventMutex);
+    eventQueuePush(id, event);
 }
 
 void registerWithDal(int id, int event, Action a, int flags) {
@@ -352,11 +434,12 @@ void initRuntime() {
     startTime = currTime();
 
     target_startup();
+    traceInit();
+    cpuStatsInit();
 
-    pthread_t disp;
-    pthread_create(&disp, NULL, evtDispatcher, NULL);
-    pthread_detach(disp);
     setupThread(0, 0, mainThread);
+    PXT_TRACE_BEGIN("fiber");
+    cpuRunStart(0);
     target_init();
     screen_init();
     initKeys();
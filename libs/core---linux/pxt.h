@@ -49,6 +49,7 @@ typedef Buffer Sound;
 #undef PXT_MAIN
 #define PXT_MAIN                                                                                   \
     int main(int argc, char **argv) {                                                              \
+        pxt::dmesgInitLevel();                                                                     \
         pxt::initialArgv = argv;                                                                   \
         pxt::start();                                                                              \
         return 0;                                                                                  \
@@ -5,13 +5,73 @@
 #include <stdlib.h>
 #include <stdarg.h>
 
+// Messages above PXT_DMESG_LEVEL are compiled out; ones above dmesgLevel are skipped at runtime
+// before any formatting. DMESG() logs at DMESG_LEVEL_INFO.
+#define DMESG_LEVEL_OFF 0
+#define DMESG_LEVEL_ERROR 1
+#define DMESG_LEVEL_INFO 2
+#define DMESG_LEVEL_DEBUG 3
+
+#ifndef PXT_DMESG_LEVEL
+#define PXT_DMESG_LEVEL DMESG_LEVEL_DEBUG
+#endif
+
 namespace pxt {
 void dmesg(const char *fmt, ...);
 void vdmesg(const char *format, va_list arg);
-#define DMESG pxt::dmesg
+void dmesg_flush();
+void dmesg_flush_panic();
+extern int dmesgLevel;
+// sets dmesgLevel from PXT_DMESG_LEVEL; called at startup, before anything is logged
+void dmesgInitLevel();
+#define DMESG_AT(level, ...)                                                                       \
+    (((level) <= PXT_DMESG_LEVEL && (level) <= pxt::dmesgLevel) ? pxt::dmesg(__VA_ARGS__)        \
+                                                                : (void)0)
+#define DMESG(...) DMESG_AT(DMESG_LEVEL_INFO, __VA_ARGS__)
+#define DMESG_ERROR(...) DMESG_AT(DMESG_LEVEL_ERROR, __VA_ARGS__)
+#define DMESG_DEBUG(...) DMESG_AT(DMESG_LEVEL_DEBUG, __VA_ARGS__)
 void *gcAllocBlock(size_t sz);
+
+// eventqueue.cpp
+void eventQueuePush(int source, int value);
+bool eventQueuePop(int *source, int *value);
+void eventQueueWait(int timeoutMs);
+void eventQueueCoalesce(int source, int value);
+
+// fiber.cpp
+struct FiberCtx;
+FiberCtx *fiberCreateMain();
+FiberCtx *fiberCreate(void (*entry)(void *), void *arg);
+void fiberSwitch(FiberCtx *from, FiberCtx *to);
+void fiberDestroy(FiberCtx *f);
+
+// trace.cpp
+extern volatile int traceEnabled;
+void traceRecord(char phase, const char *name, int a, int b);
+void traceInit();
+void traceExit();
+void traceStart();
+void traceStop();
+int traceSave(const char *filename);
+
+// cpustats.cpp
+void cpuRunStart(uint32_t handler);
+void cpuRunStop(uint32_t instructions);
+void cpuStatsInit();
+void cpuStatsReset();
+void cpuWatchdogSetup(int ms, int eventSource);
 }
 
+#define PXT_TRACE_RECORD(phase, name, a, b)                                                        \
+    do {                                                                                           \
+        if (pxt::traceEnabled)                                                                     \
+            pxt::traceRecord(phase, name, a, b);                                                   \
+    } while (0)
+#define PXT_TRACE_BEGIN(name) PXT_TRACE_RECORD('B', name, 0, 0)
+#define PXT_TRACE_END(name) PXT_TRACE_RECORD('E', name, 0, 0)
+#define PXT_TRACE_INSTANT(name, a, b) PXT_TRACE_RECORD('i', name, a, b)
+#define PXT_TRACE_COUNTER(name, value) PXT_TRACE_RECORD('C', name, value, 0)
+
 static inline void itoa(int v, char *dst) {
     snprintf(dst, 30, "%d", v);
 }
@@ -9,10 +9,13 @@
 namespace pxt {
 
 void target_exit() {
+    traceExit();
+    dmesg_flush();
     kill(getpid(), SIGTERM);
 }
 
 extern "C" void target_reset() {
+    dmesg_flush();
     for (int i = 3; i < 1000; ++i)
         close(i);
     if (!fork()) {
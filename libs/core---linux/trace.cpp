@@ -0,0 +1,159 @@
+#include "pxt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+// Timeline trace recorder.
+//
+// Every thread records begin/end/instant/counter events into its own ring buffer (so recording
+// takes no locks), keeping the last TRACE_BUFFER_SIZE events. traceSave() writes the events
+// since traceStart() in the Chrome trace JSON format, which can be loaded in chrome://tracing
+// or https://ui.perfetto.dev.
+//
+// Setting PXT_TRACE=<file.json> in the environment traces the whole run and saves the trace
+// when the program exits (or the VM is reset).
+
+#define TRACE_BUFFER_SIZE (16 * 1024)
+
+#ifndef DLLEXPORT
+#define DLLEXPORT extern "C"
+#endif
+
+namespace pxt {
+
+volatile int traceEnabled;
+
+struct TraceEntry {
+    uint64_t ts;
+    const char *name;
+    int32_t a, b;
+    char phase;
+};
+
+struct TraceBuffer {
+    TraceBuffer *next;
+    int tid;
+    uint32_t head;
+    TraceEntry entries[TRACE_BUFFER_SIZE];
+};
+
+static pthread_mutex_t traceMutex = PTHREAD_MUTEX_INITIALIZER;
+static TraceBuffer *traceBuffers;
+static __thread TraceBuffer *threadTraceBuffer;
+static uint64_t traceStartTime;
+static int traceNumThreads;
+
+static TraceBuffer *allocTraceBuffer() {
+    auto buf = (TraceBuffer *)xmalloc(sizeof(TraceBuffer));
+    memset(buf, 0, sizeof(TraceBuffer));
+    pthread_mutex_lock(&traceMutex);
+    buf->tid = ++traceNumThreads;
+    buf->next = traceBuffers;
+    traceBuffers = buf;
+    pthread_mutex_unlock(&traceMutex);
+    threadTraceBuffer = buf;
+    return buf;
+}
+
+void traceRecord(char phase, const char *name, int a, int b) {
+    auto buf = threadTraceBuffer;
+    if (!buf)
+        buf = allocTraceBuffer();
+    auto e = &buf->entries[buf->head & (TRACE_BUFFER_SIZE - 1)];
+    e->ts = current_time_us();
+    e->name = name;
+    e->a = a;
+    e->b = b;
+    e->phase = phase;
+    __atomic_store_n(&buf->head, buf->head + 1, __ATOMIC_RELEASE);
+}
+
+void traceStart() {
+    if (traceEnabled)
+        return;
+    traceStartTime = current_time_us();
+    traceEnabled = 1;
+    DMESG("trace started");
+}
+
+void traceStop() {
+    traceEnabled = 0;
+}
+
+static void writeEntry(FILE *f, TraceBuffer *buf, TraceEntry *e, bool &first) {
+    fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu,\"pid\":1,\"tid\":%d",
+            first ? "" : ",", e->name, e->phase, (unsigned long long)e->ts, buf->tid);
+    first = false;
+    switch (e->phase) {
+    case 'C':
+        fprintf(f, ",\"args\":{\"value\":%d}}", e->a);
+        break;
+    case 'i':
+        fprintf(f, ",\"s\":\"t\",\"args\":{\"a\":%d,\"b\":%d}}", e->a, e->b);
+        break;
+    default:
+        fprintf(f, "}");
+        break;
+    }
+}
+
+// Stops recording and writes the trace to a file; returns 0 on success.
+int traceSave(const char *filename) {
+    traceStop();
+
+    auto f = fopen(filename, "w");
+    if (!f) {
+        DMESG("cannot write trace to %s", filename);
+        return -1;
+    }
+
+    int numEvents = 0;
+    bool first = true;
+    fprintf(f, "{\"traceEvents\":[");
+    pthread_mutex_lock(&traceMutex);
+    for (auto buf = traceBuffers; buf; buf = buf->next) {
+        uint32_t head = __atomic_load_n(&buf->head, __ATOMIC_ACQUIRE);
+        uint32_t start = head > TRACE_BUFFER_SIZE ? head - TRACE_BUFFER_SIZE : 0;
+        for (uint32_t i = start; i != head; ++i) {
+            auto e = &buf->entries[i & (TRACE_BUFFER_SIZE - 1)];
+            if (e->ts < traceStartTime)
+                continue;
+            writeEntry(f, buf, e, first);
+            numEvents++;
+        }
+    }
+    pthread_mutex_unlock(&traceMutex);
+    fprintf(f, "\n]}\n");
+    fclose(f);
+
+    DMESG("trace with %d events saved to %s", numEvents, filename);
+    return 0;
+}
+
+// Called when the runtime starts.
+void traceInit() {
+    if (getenv("PXT_TRACE"))
+        traceStart();
+}
+
+// Called when the program exits.
+void traceExit() {
+    auto fn = getenv("PXT_TRACE");
+    if (fn && traceEnabled)
+        traceSave(fn);
+}
+
+DLLEXPORT void pxt_trace_start() {
+    traceStart();
+}
+
+DLLEXPORT void pxt_trace_stop() {
+    traceStop();
+}
+
+DLLEXPORT int pxt_trace_save(const char *filename) {
+    return traceSave(filename);
+}
+
+} // namespace pxt
@@ -0,0 +1,299 @@
+#include "pxt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Sampling profiler for the VM.
+//
+// A timer thread periodically requests a sample; exec_loop() then records the current
+// function and walks the return addresses (pushed with VM_ENCODE_PC()) on the fiber stack.
+// Samples are kept in a histogram of call stacks, which can be exported in the collapsed-stack
+// format understood by flamegraph.pl, speedscope etc.
+//
+// Function sections do not carry names, so frames are labeled with the offset of the section in
+// the image (fn@0x1234), which can be mapped back using the compiler output.
+
+#define PROF_MAX_DEPTH 64
+#define PROF_DEFAULT_INTERVAL_US 1000
+
+namespace pxt {
+
+volatile int profileSampleRequested;
+
+struct ProfileEntry {
+    uint32_t hash;
+    uint32_t count;
+    uint32_t depth;
+    uint32_t *frames; // section indices, caller first
+};
+
+static pthread_mutex_t profMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t profThread;
+static volatile int profRunning;
+static int profIntervalUs;
+
+static ProfileEntry *profEntries;
+static uint32_t profCapacity, profSize;
+static uint32_t profIdleSamples, profTotalSamples;
+static VMImage *profImg;
+
+static void *profTimer(void *) {
+    struct timespec ts;
+    ts.tv_sec = profIntervalUs / 1000000;
+    ts.tv_nsec = (profIntervalUs % 1000000) * 1000;
+    while (profRunning) {
+        nanosleep(&ts, NULL);
+        // nobody picked up the previous request - VM is waiting for events or sleeping
+        if (profileSampleRequested)
+            profIdleSamples++;
+        profileSampleRequested = 1;
+    }
+    return NULL;
+}
+
+// returns index of the Function section containing given address or -1
+static int findFunction(VMImage *img, void *addr) {
+    int idx = vmFindSection(img, addr);
+    if (idx < 0 || img->sectionTypes[idx] != SectionType::Function)
+        return -1;
+    return idx;
+}
+
+static uint32_t hashFrames(uint32_t *frames, uint32_t depth) {
+    uint32_t h = 2166136261;
+    for (uint32_t i = 0; i < depth; ++i) {
+        h ^= frames[i];
+        h *= 16777619;
+    }
+    return h;
+}
+
+static void growTable() {
+    auto oldEntries = profEntries;
+    auto oldCapacity = profCapacity;
+    profCapacity = profCapacity ? profCapacity * 2 : 256;
+    profEntries = (ProfileEntry *)xmalloc(profCapacity * sizeof(ProfileEntry));
+    memset(profEntries, 0, profCapacity * sizeof(ProfileEntry));
+    for (uint32_t i = 0; i < oldCapacity; ++i) {
+        auto e = &oldEntries[i];
+        if (!e->frames)
+            continue;
+        auto idx = e->hash & (profCapacity - 1);
+        while (profEntries[idx].frames)
+            idx = (idx + 1) & (profCapacity - 1);
+        profEntries[idx] = *e;
+    }
+    if (oldEntries)
+        xfree(oldEntries);
+}
+
+static void recordStack(uint32_t *frames, uint32_t depth) {
+    if (profSize * 2 >= profCapacity)
+        growTable();
+    auto h = hashFrames(frames, depth);
+    auto idx = h & (profCapacity - 1);
+    for (;;) {
+        auto e = &profEntries[idx];
+        if (!e->frames) {
+            e->hash = h;
+            e->count = 1;
+            e->depth = depth;
+            e->frames = (uint32_t *)xmalloc(depth * sizeof(uint32_t));
+            memcpy(e->frames, frames, depth * sizeof(uint32_t));
+            profSize++;
+            return;
+        }
+        if (e->hash == h && e->depth == depth &&
+            memcmp(e->frames, frames, depth * sizeof(uint32_t)) == 0) {
+            e->count++;
+            return;
+        }
+        idx = (idx + 1) & (profCapacity - 1);
+    }
+}
+
+static void clearTable() {
+    for (uint32_t i = 0; i < profCapacity; ++i)
+        if (profEntries[i].frames)
+            xfree(profEntries[i].frames);
+    if (profEntries)
+        xfree(profEntries);
+    profEntries = NULL;
+    profCapacity = profSize = 0;
+    profIdleSamples = profTotalSamples = 0;
+}
+
+void profileSample(FiberContext *ctx) {
+    profileSampleRequested = 0;
+
+    auto img = ctx->img;
+    if (!profRunning || img != profImg)
+        return;
+
+    uint32_t stack[PROF_MAX_DEPTH];
+    uint32_t depth = 0;
+
+    int fn = findFunction(img, ctx->pc);
+    if (fn >= 0)
+        stack[depth++] = fn;
+
+    // walk return addresses; these are the only words on the stack with this tag pattern
+    auto sp = ctx->sp;
+    for (auto seg = ctx->stack; seg; seg = seg->prev) {
+        auto end = seg->data + seg->size;
+        for (auto p = sp; p < end && depth < PROF_MAX_DEPTH; ++p) {
+            auto v = (uintptr_t)*p;
+            if ((v & 0x1ff) != 2 || (TValue)v == TAG_STACK_BOTTOM)
+                continue;
+            if ((TValue)v == TAG_SEGMENT_RETURN)
+                v = (uintptr_t)seg->retAddr;
+            fn = findFunction(img, ctx->imgbase + VM_DECODE_PC(v));
+            if (fn >= 0)
+                stack[depth++] = fn;
+        }
+        sp = seg->prevSP;
+    }
+
+    if (depth == 0)
+        return;
+
+    // collapsed stacks list the root first
+    for (uint32_t i = 0; i < depth / 2; ++i) {
+        auto tmp = stack[i];
+        stack[i] = stack[depth - 1 - i];
+        stack[depth - 1 - i] = tmp;
+    }
+
+    pthread_mutex_lock(&profMutex);
+    profTotalSamples++;
+    recordStack(stack, depth);
+    pthread_mutex_unlock(&profMutex);
+}
+
+static int frameName(VMImage *img, uint32_t idx, char *dst, int size) {
+    auto sect = img->sections[idx];
+    if ((RefAction *)sect == img->entryPoint)
+        return snprintf(dst, size, "main");
+    return snprintf(dst, size, "fn@0x%x",
+                    (unsigned)((uint8_t *)sect - (uint8_t *)img->dataStart));
+}
+
+static void appendOutput(char *dst, int maxSize, int &total, const char *s, int len) {
+    if (dst && total < maxSize)
+        memcpy(dst + total, s, total + len <= maxSize ? len : maxSize - total);
+    total += len;
+}
+
+// Writes up to maxSize bytes to dst; returns number of bytes the full output takes.
+static int writeCollapsed(char *dst, int maxSize) {
+    char line[PROF_MAX_DEPTH * 20 + 32];
+    int total = 0;
+
+    for (uint32_t i = 0; i < profCapacity; ++i) {
+        auto e = &profEntries[i];
+        if (!e->frames)
+            continue;
+        int len = 0;
+        for (uint32_t j = 0; j < e->depth; ++j) {
+            if (j)
+                line[len++] = ';';
+            len += frameName(profImg, e->frames[j], line + len, 20);
+        }
+        len += snprintf(line + len, 32, " %u\n", e->count);
+        appendOutput(dst, maxSize, total, line, len);
+    }
+
+    if (profIdleSamples) {
+        int len = snprintf(line, sizeof(line), "(idle) %u\n", profIdleSamples);
+        appendOutput(dst, maxSize, total, line, len);
+    }
+
+    return total;
+}
+
+void profileStart(int intervalUs) {
+    if (profRunning || !vmCurrent->img)
+        return;
+    pthread_mutex_lock(&profMutex);
+    clearTable();
+    pthread_mutex_unlock(&profMutex);
+    profImg = vmCurrent->img;
+    profIntervalUs = intervalUs > 0 ? intervalUs : PROF_DEFAULT_INTERVAL_US;
+    profileSampleRequested = 0;
+    profRunning = 1;
+    pthread_create(&profThread, NULL, profTimer, NULL);
+    DMESG("profiler started, %dus interval", profIntervalUs);
+}
+
+void profileStop() {
+    if (!profRunning)
+        return;
+    profRunning = 0;
+    void *dummy;
+    pthread_join(profThread, &dummy);
+    profileSampleRequested = 0;
+    DMESG("profiler stopped; %d samples, %d idle, %d stacks", profTotalSamples, profIdleSamples,
+          profSize);
+}
+
+DLLEXPORT void pxt_vm_profile_start(int intervalUs) {
+    profileStart(intervalUs);
+}
+
+DLLEXPORT void pxt_vm_profile_stop() {
+    profileStop();
+}
+
+// Collapsed-stack output ("main;fn@0x1a0;fn@0x2c8 42" lines), ready for flame-graph tools.
+// Returns the size of the full output, which may exceed maxSize; dst can be NULL.
+DLLEXPORT int pxt_vm_profile_get(char *dst, int maxSize) {
+    pthread_mutex_lock(&profMutex);
+    int r = profImg ? writeCollapsed(dst, maxSize) : 0;
+    pthread_mutex_unlock(&profMutex);
+    return r;
+}
+
+DLLEXPORT int pxt_vm_profile_save(const char *filename) {
+    int len = pxt_vm_profile_get(NULL, 0);
+    auto buf = (char *)xmalloc(len + 1);
+    len = pxt_vm_profile_get(buf, len);
+    auto f = fopen(filename, "w");
+    if (!f) {
+        DMESG("cannot write profile to %s", filename);
+        xfree(buf);
+        return -1;
+    }
+    fwrite(buf, 1, len, f);
+    fclose(f);
+    xfree(buf);
+    DMESG("profile saved to %s", filename);
+    return 0;
+}
+
+static void profileReset() {
+    profileStop();
+    auto fn = getenv("PXT_VM_PROFILE");
+    if (fn && profImg)
+        pxt_vm_profile_save(fn);
+    pthread_mutex_lock(&profMutex);
+    clearTable();
+    profImg = NULL;
+    pthread_mutex_unlock(&profMutex);
+}
+
+// Called when the VM starts running an image. Setting PXT_VM_PROFILE=<file> in the environment
+// profiles the whole run and saves the result when the program exits or is reset.
+void profileInit() {
+    static bool registered;
+    if (!registered) {
+        registered = true;
+        registerResetFunction(profileReset);
+    }
+    if (getenv("PXT_VM_PROFILE")) {
+        auto interval = getenv("PXT_VM_PROFILE_INTERVAL");
+        profileStart(interval ? atoi(interval) : 0);
+    }
+}
+
+} // namespace pxt
@@ -27,7 +27,6 @@ extern "C" void target_init();
 extern volatile bool paniced;
 extern char **initialArgv;
 void target_exit();
-extern volatile int panicCode;
 
 // Buffer, Sound, and Image share representation.
 typedef Buffer Sound;
@@ -37,6 +36,7 @@ typedef Buffer Sound;
 #undef PXT_MAIN
 #define PXT_MAIN                                                                                   \
     int main(int argc, char **argv) {                                                              \
+        pxt::dmesgInitLevel();                                                                     \
         pxt::initialArgv = argv;                                                                   \
         pxt::vmStart();                                                                            \
         return 0;                                                                                  \
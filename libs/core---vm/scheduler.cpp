@@ -45,46 +45,28 @@ namespace pxt {
 
 static uint64_t startTime;
 
-FiberContext *allFibers;
-FiberContext *currentFiber;
-static pthread_mutex_t eventMutex;
-static pthread_cond_t newEventBroadcast;
-
-static struct Event *eventHead, *eventTail;
 
 struct Event {
-    struct Event *next;
     int source;
     int value;
 };
 
 Event lastEvent;
 
-Event *mkEvent(int source, int value) {
-    auto res = new Event();
-    memset(res, 0, sizeof(Event));
-    res->source = source;
-    res->value = value;
-    return res;
-}
-
-volatile int panicCode;
 extern "C" void drawPanic(int code);
 
 void schedule() {
-    auto f = currentFiber;
+    auto f = vmCurrent->currentFiber;
     if (!f->wakeTime && !f->waitSource)
         oops(55);
     f->resumePC = f->pc;
     f->pc = NULL; // this will break the exec_loop()
 }
 
-void dmesg_flush();
-
 static void panic_core(int error_code) {
     int prevErr = errno;
 
-    panicCode = error_code;
+    vmCurrent->panicCode = error_code;
 
     drawPanic(error_code);
 
@@ -102,7 +84,7 @@ extern "C" void target_panic(int error_code) {
 }
 
 DLLEXPORT int pxt_get_panic_code() {
-    return panicCode;
+    return vmCurrent->panicCode;
 }
 
 void soft_panic(int errorCode) {
@@ -123,7 +105,7 @@ void sleep_core_us(uint64_t us) {
 }
 
 void sleep_ms(uint32_t ms) {
-    currentFiber->wakeTime = current_time_ms() + ms;
+    vmCurrent->currentFiber->wakeTime = current_time_ms() + ms;
     schedule();
 }
 
@@ -151,29 +133,202 @@ int current_time_ms() {
     return (int)(current_time_us() / 1000);
 }
 
-void disposeFiber(FiberContext *t) {
-    if (allFibers == t) {
-        allFibers = t->next;
-    } else {
-        for (auto tt = allFibers; tt; tt = tt->next) {
-            if (tt->next == t) {
-                tt->next = t->next;
+//
+// Scheduler; its state is in VMInstance.
+//
+
+static void makeReady(VMInstance *inst, FiberContext *f) {
+    f->nextQueued = NULL;
+    if (inst->readyTail)
+        inst->readyTail->nextQueued = f;
+    else
+        inst->readyHead = f;
+    inst->readyTail = f;
+}
+
+static FiberContext *popReady(VMInstance *inst) {
+    auto f = inst->readyHead;
+    if (f) {
+        inst->readyHead = f->nextQueued;
+        if (!inst->readyHead)
+            inst->readyTail = NULL;
+        f->nextQueued = NULL;
+    }
+    return f;
+}
+
+static inline bool wakesBefore(FiberContext *a, FiberContext *b) {
+    return (int)a->wakeTime < (int)b->wakeTime;
+}
+
+static void addSleeper(VMInstance *inst, FiberContext *f) {
+    if (inst->sleepHeapSize == inst->sleepHeapCapacity) {
+        auto capacity = inst->sleepHeapCapacity ? inst->sleepHeapCapacity * 2 : 32;
+        auto n = (FiberContext **)xmalloc(capacity * sizeof(FiberContext *));
+        if (inst->sleepHeap) {
+            memcpy(n, inst->sleepHeap, inst->sleepHeapSize * sizeof(FiberContext *));
+            xfree(inst->sleepHeap);
+        }
+        inst->sleepHeap = n;
+        inst->sleepHeapCapacity = capacity;
+    }
+    auto sleepHeap = inst->sleepHeap;
+    int i = inst->sleepHeapSize++;
+    while (i > 0) {
+        int parent = (i - 1) >> 1;
+        if (!wakesBefore(f, sleepHeap[parent]))
+            break;
+        sleepHeap[i] = sleepHeap[parent];
+        i = parent;
+    }
+    sleepHeap[i] = f;
+}
+
+static FiberContext *popSleeper(VMInstance *inst) {
+    auto sleepHeap = inst->sleepHeap;
+    auto sleepHeapSize = --inst->sleepHeapSize;
+    auto res = sleepHeap[0];
+    auto last = sleepHeap[sleepHeapSize];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= sleepHeapSize)
+            break;
+        if (child + 1 < sleepHeapSize && wakesBefore(sleepHeap[child + 1], sleepHeap[child]))
+            child++;
+        if (!wakesBefore(sleepHeap[child], last))
+            break;
+        sleepHeap[i] = sleepHeap[child];
+        i = child;
+    }
+    if (sleepHeapSize)
+        sleepHeap[i] = last;
+    return res;
+}
+
+static void wakeSleepers(VMInstance *inst, int now) {
+    while (inst->sleepHeapSize && now >= (int)inst->sleepHeap[0]->wakeTime) {
+        auto f = popSleeper(inst);
+        f->wakeTime = 0;
+        makeReady(inst, f);
+    }
+}
+
+static inline FiberContext **waitBucket(VMInstance *inst, int source, int value) {
+    return &inst->waiters[(unsigned)(source * 31 + value) % VM_WAIT_BUCKETS];
+}
+
+static void addWaiter(VMInstance *inst, FiberContext *f) {
+    // append, so that fibers are woken in the order they started waiting
+    auto p = waitBucket(inst, f->waitSource, f->waitValue);
+    while (*p)
+        p = &(*p)->nextQueued;
+    f->nextQueued = NULL;
+    *p = f;
+}
+
+// wake fibers waiting for exactly (source, value); returns number of fibers woken
+static int wakeWaiters(VMInstance *inst, int source, int value, bool onlyOne) {
+    int n = 0;
+    auto p = waitBucket(inst, source, value);
+    while (*p) {
+        auto f = *p;
+        if (f->waitSource == source && f->waitValue == value) {
+            *p = f->nextQueued;
+            f->waitSource = 0;
+            makeReady(inst, f);
+            n++;
+            if (onlyOne)
                 break;
-            }
+        } else {
+            p = &f->nextQueued;
         }
     }
+    return n;
+}
+
+static void resetScheduler(VMInstance *inst) {
+    inst->readyHead = inst->readyTail = NULL;
+    inst->sleepHeapSize = 0;
+    memset(inst->waiters, 0, sizeof(inst->waiters));
+}
+
+// Disposed fibers are kept (with their bottom stack segment) for reuse by setupThread(),
+// which runs for every event handler.
+#define FIBER_POOL_SIZE 32
+
+static FiberContext *fiberPool;
+static int fiberPoolSize;
+
+// keep in sync with core---vm/stats.ts, function fiberStats()
+struct FiberStats {
+    uint32_t created;
+    uint32_t reused;
+    uint32_t live;
+    uint32_t peakLive;
+};
+static FiberStats fiberStats;
+
+//%
+Buffer getFiberStats() {
+    return mkBuffer((uint8_t *)&fiberStats, sizeof(fiberStats));
+}
+
+void disposeFiber(FiberContext *t) {
+    auto inst = t->instance;
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        inst->allFibers = t->next;
+    if (t->next)
+        t->next->prev = t->prev;
+    else
+        inst->allFibersTail = t->prev;
+    fiberStats.live--;
+
+    if (fiberPoolSize < FIBER_POOL_SIZE) {
+        vmTrimStack(t);
+        t->next = fiberPool;
+        fiberPool = t;
+        fiberPoolSize++;
+    } else {
+        vmFreeStack(t);
+        xfree(t);
+    }
+}
 
-    xfree(t->stackBase);
-    xfree(t);
+static FiberContext *allocFiber() {
+    auto t = fiberPool;
+    if (t) {
+        fiberPool = t->next;
+        fiberPoolSize--;
+        fiberStats.reused++;
+        auto stack = t->stack;
+        auto stackWords = t->stackWords;
+        memset(t, 0, sizeof(*t));
+        t->stack = stack;
+        t->stackWords = stackWords;
+    } else {
+        t = (FiberContext *)xmalloc(sizeof(FiberContext));
+        memset(t, 0, sizeof(*t));
+        fiberStats.created++;
+    }
+    if (++fiberStats.live > fiberStats.peakLive)
+        fiberStats.peakLive = fiberStats.live;
+    return t;
 }
 
-FiberContext *setupThread(Action a, TValue arg = 0) {
+static FiberContext *setupFiber(VMInstance *inst, Action a, TValue arg) {
     //DMESG("setup thread: %p", a);
-    auto t = (FiberContext *)xmalloc(sizeof(FiberContext));
-    memset(t, 0, sizeof(*t));
-    t->stackBase = (TValue *)xmalloc(VM_STACK_SIZE * sizeof(TValue));
-    t->stackLimit = t->stackBase + VM_MAX_FUNCTION_STACK + 5;
-    t->sp = t->stackBase + VM_STACK_SIZE;
+    auto img = inst->img;
+    auto ra = (RefAction *)a;
+    auto fn = (RefAction *)((uint8_t *)ra->func - VM_FUNCTION_CODE_OFFSET);
+    if (!(fn->reserved & VM_FUNCTION_VERIFIED))
+        vmVerifyFunction(img, fn);
+
+    auto t = allocFiber();
+    // 7 words pushed below, and whatever the function needs
+    vmInitStack(t, 7 + (fn->reserved & VM_FUNCTION_STACK_MASK) + VM_STACK_MARGIN);
     *--t->sp = (TValue)0xf00df00df00df00d;
     *--t->sp = 0;
     *--t->sp = 0;
@@ -181,30 +336,34 @@ FiberContext *setupThread(Action a, TValue arg = 0) {
     *--t->sp = arg;
     *--t->sp = 0;
     *--t->sp = TAG_STACK_BOTTOM;
-    auto ra = (RefAction *)a;
     // we only pass 1 argument, but can in fact handle up to 4
     if (ra->numArgs > 2)
         target_panic(PANIC_INVALID_IMAGE);
     t->currAction = ra;
     t->resumePC = (uint16_t *)ra->func;
+    t->handler = vmFindSection(img, fn);
 
-    t->img = vmImg;
-    t->imgbase = (uint16_t *)vmImg->dataStart;
+    t->img = img;
+    t->instance = inst;
+    t->imgbase = (uint16_t *)img->dataStart;
 
     // add at the end
-    if (allFibers)
-        for (auto p = allFibers; p; p = p->next) {
-            if (!p->next) {
-                p->next = t;
-                break;
-            }
-        }
+    t->prev = inst->allFibersTail;
+    if (inst->allFibersTail)
+        inst->allFibersTail->next = t;
     else
-        allFibers = t;
+        inst->allFibers = t;
+    inst->allFibersTail = t;
+
+    makeReady(inst, t);
 
     return t;
 }
 
+FiberContext *setupThread(Action a, TValue arg) {
+    return setupFiber(vmCurrent, a, arg);
+}
+
 void runInParallel(Action a) {
     setupThread(a);
 }
@@ -215,99 +374,101 @@ void runForever(Action a) {
 }
 
 void waitForEvent(int source, int value) {
-    currentFiber->waitSource = source;
-    currentFiber->waitValue = value;
+    vmCurrent->currentFiber->waitSource = source;
+    vmCurrent->currentFiber->waitValue = value;
     schedule();
 }
 
-static void dispatchEvent(Event &e) {
+static void dispatchEvent(VMInstance *inst, Event &e) {
     lastEvent = e;
 
     auto curr = findBinding(e.source, e.value);
     if (curr)
-        setupThread(curr->action, fromInt(e.value));
+        setupFiber(inst, curr->action, fromInt(e.value));
 
     curr = findBinding(e.source, DEVICE_EVT_ANY);
     if (curr)
-        setupThread(curr->action, fromInt(e.value));
-}
-
-static void wakeFibers() {
-    for (;;) {
-        pthread_mutex_lock(&eventMutex);
-        if (eventHead == NULL) {
-            pthread_mutex_unlock(&eventMutex);
-            return;
-        }
-        Event *ev = eventHead;
-        eventHead = ev->next;
-        if (eventHead == NULL)
-            eventTail = NULL;
-        pthread_mutex_unlock(&eventMutex);
-
-        for (auto thr = allFibers; thr; thr = thr->next) {
-            if (thr->waitSource == 0)
-                continue;
-            if (thr->waitValue != ev->value && thr->waitValue != DEVICE_EVT_ANY)
-                continue;
-            if (thr->waitSource == ev->source) {
-                thr->waitSource = 0;
-            } else if (thr->waitSource == DEVICE_ID_NOTIFY && ev->source == DEVICE_ID_NOTIFY_ONE) {
-                thr->waitSource = 0;
-                break; // do not wake up any other threads
-            }
+        setupFiber(inst, curr->action, fromInt(e.value));
+}
+
+static void wakeFibers(VMInstance *inst) {
+    Event ev;
+    while (eventQueuePop(&ev.source, &ev.value)) {
+        wakeWaiters(inst, ev.source, ev.value, false);
+        if (ev.value != DEVICE_EVT_ANY)
+            wakeWaiters(inst, ev.source, DEVICE_EVT_ANY, false);
+        if (ev.source == DEVICE_ID_NOTIFY_ONE) {
+            // only wake up one thread
+            if (!wakeWaiters(inst, DEVICE_ID_NOTIFY, ev.value, true) && ev.value != DEVICE_EVT_ANY)
+                wakeWaiters(inst, DEVICE_ID_NOTIFY, DEVICE_EVT_ANY, true);
         }
 
-        dispatchEvent(*ev);
-        delete ev;
+        dispatchEvent(inst, ev);
     }
 }
 
-static void mainRunLoop() {
-    FiberContext *f = NULL;
+// Wait for an event or the next timer, whichever comes first. Also returns periodically,
+// so that panicCode is checked.
+static void idleWait(VMInstance *inst) {
+    int timeout = 100;
+    if (inst->sleepHeapSize) {
+        int delta = (int)inst->sleepHeap[0]->wakeTime - current_time_ms();
+        if (delta < timeout)
+            timeout = delta;
+    }
+    if (timeout <= 0)
+        return;
+    PXT_TRACE_BEGIN("idle");
+    eventQueueWait(timeout);
+    PXT_TRACE_END("idle");
+}
+
+static void mainRunLoop(VMInstance *inst) {
     for (;;) {
-        if (panicCode)
+        if (inst->panicCode)
             return;
-        wakeFibers();
-        auto now = current_time_ms();
-        auto fromBeg = false;
+        wakeFibers(inst);
+        wakeSleepers(inst, current_time_ms());
+        auto f = popReady(inst);
         if (!f) {
-            f = allFibers;
-            fromBeg = true;
+            idleWait(inst);
+            continue;
         }
-        while (f) {
-            if (f->wakeTime && now >= (int)f->wakeTime)
-                f->wakeTime = 0;
-            if (!f->wakeTime && !f->waitSource)
-                break;
-            f = f->next;
-        }
-        if (f) {
-            currentFiber = f;
-            f->pc = f->resumePC;
-            f->resumePC = NULL;
-            exec_loop(f);
-            if (panicCode)
-                return;
-            auto n = f->next;
-            if (f->resumePC == NULL) {
-                if (f->foreverPC) {
-                    f->resumePC = f->foreverPC;
-                    f->wakeTime = current_time_ms() + 20;
-                    // restore stack, as setupThread() does it
-                    for (int i = 0; i < 5; ++i) {
-                        if (*--f->sp == TAG_STACK_BOTTOM)
-                            break;
-                    }
-                    if (*f->sp != TAG_STACK_BOTTOM)
-                        target_panic(PANIC_INVALID_IMAGE);
-                } else {
-                    disposeFiber(f);
+
+        inst->currentFiber = f;
+        f->pc = f->resumePC;
+        f->resumePC = NULL;
+        PXT_TRACE_BEGIN("fiber");
+        cpuRunStart(f->handler);
+        auto instructions = f->instructions;
+        exec_loop(f);
+        cpuRunStop(f->instructions - instructions);
+        PXT_TRACE_END("fiber");
+        if (inst->panicCode)
+            return;
+        if (f->resumePC == NULL) {
+            if (f->foreverPC) {
+                f->resumePC = f->foreverPC;
+                f->wakeTime = current_time_ms() + 20;
+                // restore stack, as setupThread() does it
+                for (int i = 0; i < 5; ++i) {
+                    if (*--f->sp == TAG_STACK_BOTTOM)
+                        break;
+                }
+                if (*f->sp != TAG_STACK_BOTTOM)
+                    target_panic(PANIC_INVALID_IMAGE);
+                addSleeper(inst, f);
+            } else {
+                disposeFiber(f);
+                if (f == inst->mainFiber) {
+                    inst->mainFiber = NULL;
+                    vmSnapshotSave();
                 }
             }
-            f = n;
-        } else if (fromBeg) {
-            sleep_core_us(1000);
+        } else if (f->waitSource) {
+            addWaiter(inst, f);
+        } else {
+            addSleeper(inst, f);
         }
     }
 }
@@ -318,18 +479,7 @@ int allocateNotifyEvent() {
 }
 
 void raiseEvent(int id, int event) {
-    auto e = mkEvent(id, event);
-    pthread_mutex_lock(&eventMutex);
-    if (eventTail == NULL) {
-        if (eventHead != NULL)
-            oops(51);
-        eventHead = eventTail = e;
-    } else {
-        eventTail->next = e;
-        eventTail = e;
-    }
-    pthread_cond_broadcast(&newEventBroadcast);
-    pthread_mutex_unlock(&eventMutex);
+    eventQueuePush(id, event);
 }
 
 DLLEXPORT void pxt_raise_event(int id, int event) {
@@ -352,18 +502,23 @@ void initKeys();
 void target_startup();
 
 void initRuntime() {
+    auto inst = vmCurrent;
     current_time_ms();
     target_startup();
 
-    setupThread((TValue)vmImg->entryPoint);
+    if (!vmSnapshotRestore())
+        inst->mainFiber = setupFiber(inst, (TValue)inst->img->entryPoint, 0);
 
     target_init();
     screen_init();
     initKeys();
+    profileInit();
+    traceInit();
+    cpuStatsInit();
 
     DMESG("start main loop");
 
-    mainRunLoop();
+    mainRunLoop(inst);
     systemReset();
 }
 
@@ -412,20 +567,68 @@ void *gcAllocBlock(size_t sz) {
     return r;
 }
 
+// The loader's literals. Like the heap, they go at a fixed address when possible, so that
+// heap snapshots can refer to them.
+void *gcAllocPreallocBlock(size_t sz) {
+#if defined(__MINGW32__) || defined(PXT_IOS)
+    return xmalloc(sz);
+#else
+    void *r = mmap((void *)VM_PREALLOC_BASE, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON,
+                   -1, 0);
+    if (r == MAP_FAILED) {
+        DMESG("mmap %p failed; err=%d", (void *)VM_PREALLOC_BASE, errno);
+        target_panic(PANIC_INTERNAL_ERROR);
+    }
+    return r;
+#endif
+}
+
 void gcProcessStacks(int flags) {
     int cnt = 0;
-    for (auto f = allFibers; f; f = f->next) {
-        auto end = f->stackBase + VM_STACK_SIZE - 1;
-        auto ptr = f->sp;
+    for (auto f = vmCurrent->allFibers; f; f = f->next) {
         gcProcess((TValue)f->currAction);
         gcProcess((TValue)f->r0);
-        if (flags & 2)
-            DMESG("RS%d:%p/%d", cnt++, ptr, end - ptr);
-        // VLOG("mark: %p - %p", ptr, end);
-        while (ptr <= end) {
-            gcProcess(*ptr++);
+        auto ptr = f->sp;
+        for (auto seg = f->stack; seg; seg = seg->prev) {
+            auto end = seg->data + seg->size - 1;
+            if (flags & 2)
+                DMESG("RS%d:%p/%d", cnt++, ptr, end - ptr);
+            // VLOG("mark: %p - %p", ptr, end);
+            while (ptr <= end) {
+                gcProcess(*ptr++);
+            }
+            ptr = seg->prevSP;
+        }
+    }
+}
+
+// keep in sync with core---vm/stats.ts, function fiberStackStats()
+struct FiberStackStats {
+    uint32_t allocatedBytes;
+    uint32_t usedBytes;
+    uint32_t numSegments;
+};
+
+//%
+Buffer getFiberStackStats() {
+    int n = 0;
+    for (auto f = vmCurrent->allFibers; f; f = f->next)
+        n++;
+    auto res = mkBuffer(NULL, n * sizeof(FiberStackStats));
+    auto st = (FiberStackStats *)res->data;
+    for (auto f = vmCurrent->allFibers; f; f = f->next) {
+        st->allocatedBytes = f->stackWords * sizeof(TValue);
+        st->usedBytes = 0;
+        st->numSegments = 0;
+        auto ptr = f->sp;
+        for (auto seg = f->stack; seg; seg = seg->prev) {
+            st->usedBytes += (uint32_t)((uint8_t *)(seg->data + seg->size) - (uint8_t *)ptr);
+            st->numSegments++;
+            ptr = seg->prevSP;
         }
+        st++;
     }
+    return res;
 }
 
 
@@ -444,11 +647,15 @@ void registerResetFunction(reset_fn_t fn) {
 }
 
 void systemReset() {
-    if (!panicCode)
-        panicCode = -1;
+    auto inst = vmCurrent;
+    if (!inst->panicCode)
+        inst->panicCode = -1;
 
     dmesg("TARGET RESET");
 
+    traceExit();
+    vmcache::flushIndex();
+
     gcFreeze();
 
     for (int i = 0; i < MAX_RESET_FN; ++i) {
@@ -459,13 +666,17 @@ void systemReset() {
 
     coreReset(); // clears handler bindings
 
-    currentFiber = NULL;
-    while (allFibers) {
-        disposeFiber(allFibers);
+    inst->currentFiber = NULL;
+    inst->mainFiber = NULL;
+    resetScheduler(inst);
+    while (inst->allFibers) {
+        disposeFiber(inst->allFibers);
     }
+    memset(&fiberStats, 0, sizeof(fiberStats));
+    cpuStatsReset();
 
     // this will consume all events, but won't dispatch anything, since all listener maps are empty
-    wakeFibers();
+    wakeFibers(inst);
 
     // mark all GC memory as free
     gcReset();
@@ -0,0 +1,86 @@
+namespace control {
+    //% shim=pxt::getFiberStackStats
+    function getFiberStackStats(): Buffer {
+        return null
+    }
+
+    export interface FiberStackStats {
+        allocatedBytes: number;
+        usedBytes: number;
+        numSegments: number;
+    }
+
+    /**
+     * Get stack memory usage of all fibers (threads) of the program
+     */
+    export function fiberStackStats(): FiberStackStats[] {
+        const buf = getFiberStackStats()
+        if (!buf)
+            return null
+        const res: FiberStackStats[] = []
+        for (let off = 0; off < buf.length; off += 12) {
+            res.push({
+                allocatedBytes: buf.getNumber(NumberFormat.UInt32LE, off),
+                usedBytes: buf.getNumber(NumberFormat.UInt32LE, off + 4),
+                numSegments: buf.getNumber(NumberFormat.UInt32LE, off + 8),
+            })
+        }
+        return res
+    }
+
+    //% shim=pxt::getFiberStats
+    function getFiberStats(): Buffer {
+        return null
+    }
+
+    export interface FiberStats {
+        created: number;
+        reused: number;
+        live: number;
+        peakLive: number;
+    }
+
+    /**
+     * Get the number of fibers (threads) created, reused from the pool, currently live and
+     * the peak number live at once since the program started
+     */
+    export function fiberStats(): FiberStats {
+        const buf = getFiberStats()
+        if (!buf)
+            return null
+        return {
+            created: buf.getNumber(NumberFormat.UInt32LE, 0),
+            reused: buf.getNumber(NumberFormat.UInt32LE, 4),
+            live: buf.getNumber(NumberFormat.UInt32LE, 8),
+            peakLive: buf.getNumber(NumberFormat.UInt32LE, 12),
+        }
+    }
+
+    //% shim=pxt::getEventQueueStats
+    function getEventQueueStats(): Buffer {
+        return null
+    }
+
+    export interface EventQueueStats {
+        raised: number;
+        coalesced: number;
+        overflows: number;
+        maxPending: number;
+    }
+
+    /**
+     * Get the number of events raised, dropped as duplicates, dropped because the event queue
+     * was full, and the maximum number of events waiting to be dispatched
+     */
+    export function eventQueueStats(): EventQueueStats {
+        const buf = getEventQueueStats()
+        if (!buf)
+            return null
+        return {
+            raised: buf.getNumber(NumberFormat.UInt32LE, 0),
+            coalesced: buf.getNumber(NumberFormat.UInt32LE, 4),
+            overflows: buf.getNumber(NumberFormat.UInt32LE, 8),
+            maxPending: buf.getNumber(NumberFormat.UInt32LE, 12),
+        }
+    }
+}
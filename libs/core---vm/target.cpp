@@ -152,6 +152,14 @@ static void dmesgRaw(const char *buf, uint32_t len) {
 #endif
 }
 
+int dmesgLevel = DMESG_LEVEL_INFO;
+
+void dmesgInitLevel() {
+    auto level = getenv("PXT_DMESG_LEVEL");
+    if (level)
+        dmesgLevel = atoi(level);
+}
+
 void deepSleep() {
     // nothing to do
 }
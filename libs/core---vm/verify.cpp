@@ -1,5 +1,11 @@
 #include "pxt.h"
 
+#include <stddef.h>
+
+#ifndef __MINGW32__
+#include <sys/mman.h>
+#endif
+
 namespace pxt {
 
 VMImage *setVMImgError(VMImage *img, int code, void *pos) {
@@ -8,7 +14,7 @@ VMImage *setVMImgError(VMImage *img, int code, void *pos) {
     return img;
 }
 
-// next free error 1057
+// next free error 1059
 #define ERROR(code, pos) return setVMImgError(img, code, pos)
 #define CHECK(cond, code)                                                                          \
     do {                                                                                           \
@@ -41,6 +47,7 @@ static VMImage *countSections(VMImage *img) {
     CHECK_AT(p == img->dataEnd, 1003, p);
     img->pointerLiterals = ALLOC_ARRAY(TValue, img->numSections);
     img->sections = ALLOC_ARRAY(VMImageSection *, img->numSections);
+    img->sectionTypes = ALLOC_ARRAY(SectionType, img->numSections);
 
     return NULL;
 }
@@ -148,6 +155,7 @@ static VMImage *loadSections(VMImage *img) {
         }
 
         img->sections[idx] = sect;
+        img->sectionTypes[idx] = sect->type;
 
         if (sect->type == SectionType::Literal) {
             if (sect->aux == (int)BuiltInType::BoxedString ||
@@ -162,7 +170,13 @@ static VMImage *loadSections(VMImage *img) {
             } else {
                 CHECK(0, 1050);
             }
-        } else if (sect->type == SectionType::Function || sect->type == SectionType::VTable) {
+        } else if (sect->type == SectionType::Function) {
+            // the code itself is checked in validateFunction(), possibly only on first call
+            CHECK(sect->size > VM_FUNCTION_CODE_OFFSET, 1057);
+            // set by vmcache in verified images only
+            CHECK(img->preVerified || ((RefAction *)sect)->reserved == 0, 1058);
+            img->pointerLiterals[idx] = (TValue)sect;
+        } else if (sect->type == SectionType::VTable) {
             img->pointerLiterals[idx] = (TValue)sect;
         } else {
             img->pointerLiterals[idx] = nullptr;
@@ -207,7 +221,48 @@ static VMImage *loadIfaceNames(VMImage *img) {
     return NULL;
 }
 
-void validateFunction(VMImage *img, VMImageSection *sect, int debug);
+unsigned validateFunction(VMImage *img, VMImageSection *sect, uint32_t size, int debug);
+
+// index of the section containing addr, or -1
+int vmFindSection(VMImage *img, void *addr) {
+    if ((uint64_t *)addr < img->dataStart || (uint64_t *)addr >= img->dataEnd)
+        return -1;
+    int l = 0, r = (int)img->numSections - 1;
+    while (l < r) {
+        int m = (l + r + 1) >> 1;
+        if ((uint8_t *)img->sections[m] <= (uint8_t *)addr)
+            l = m;
+        else
+            r = m - 1;
+    }
+    return l;
+}
+
+// sections are contiguous, so this works even after their headers are gone
+uint32_t vmSectionSize(VMImage *img, unsigned idx) {
+    auto endp = idx + 1 < img->numSections ? (uint8_t *)img->sections[idx + 1]
+                                           : (uint8_t *)img->dataEnd;
+    return (uint32_t)(endp - (uint8_t *)img->sections[idx]);
+}
+
+// called on first call of a function, unless the image was verified eagerly
+void vmVerifyFunction(VMImage *img, RefAction *fn) {
+    int idx = vmFindSection(img, fn);
+    if (idx < 0 || img->sectionTypes[idx] != SectionType::Function ||
+        (RefAction *)img->sections[idx] != fn) {
+        DMESG("invalid function %p", fn);
+        target_panic(PANIC_INVALID_IMAGE);
+    }
+    auto sect = img->sections[idx];
+    auto size = vmSectionSize(img, idx);
+    auto depth = validateFunction(img, sect, size, 0);
+    if (img->errorCode) {
+        validateFunction(img, sect, size, 1);
+        DMESG("validation error %d at 0x%x", img->errorCode, img->errorOffset);
+        target_panic(PANIC_INVALID_IMAGE);
+    }
+    fn->reserved |= VM_FUNCTION_VERIFIED | depth;
+}
 
 static VMImage *validateFunctions(VMImage *img) {
     FOR_SECTIONS() {
@@ -269,13 +324,19 @@ static VMImage *validateFunctions(VMImage *img) {
                 CHECK(*p++ == 0, 1040);
         }
 
-        if (sect->type == SectionType::Function) {
-            validateFunction(img, sect, 0);
+        if (sect->type == SectionType::Function && img->preVerified) {
+            // vmcache recorded the stack depth along with the verified flag; a function without
+            // the flag is verified on its first call, as usual
+            CHECK((((RefAction *)sect)->reserved & VM_FUNCTION_STACK_MASK) <= VM_MAX_FUNCTION_STACK,
+                  1058);
+        } else if (sect->type == SectionType::Function && img->eagerVerify) {
+            auto depth = validateFunction(img, sect, sect->size, 0);
             if (img->errorCode) {
                 // try again with debug
-                validateFunction(img, sect, 1);
+                validateFunction(img, sect, sect->size, 1);
                 return img;
             }
+            ((RefAction *)sect)->reserved |= VM_FUNCTION_VERIFIED | depth;
         }
     }
     return NULL;
@@ -309,11 +370,87 @@ static VMImage *injectVTables(VMImage *img) {
     return NULL;
 }
 
-VMImage *loadVMImage(void *data, unsigned length) {
+// Verify code of all functions on load, instead of on their first call.
+// This catches invalid code before anything runs, at the cost of longer startup.
+static int eagerVerify = -1;
+
+DLLEXPORT void pxt_vm_set_eager_verify(int enabled) {
+    eagerVerify = enabled;
+}
+
+// bump when verification rules change
+#define VM_VERIFIER_VERSION 1
+
+static uint64_t hashWord(uint64_t h, uint64_t v) {
+    for (int i = 0; i < 8; ++i) {
+        h ^= (v >> (i * 8)) & 0xff;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static uint64_t runtimeHash() {
+    static uint64_t h;
+    if (!h) {
+        h = hashWord(0xcbf29ce484222325ULL, VM_VERIFIER_VERSION);
+        for (auto st = staticOpcodes; st->name; st++) {
+            for (auto p = st->name; *p; p++)
+                h = hashWord(h, *p);
+            h = hashWord(h, st->numArgs);
+        }
+    }
+    return h;
+}
+
+// word of the file holding VMImageHeader::verifiedStamp, the header being the first section
+#define VERIFIED_STAMP_WORD                                                                        \
+    ((sizeof(VMImageSection) + offsetof(VMImageHeader, verifiedStamp)) >> 3)
+// RefAction::reserved is the top 16 bits of the second word of a function section
+#define FUNCTION_RESERVED_WORD 1
+#define FUNCTION_RESERVED_SHIFT 48
+
+// Hashes an image as it is in the file, before loading. contentStamp covers the code and data as
+// compiled, and the opcodes of the runtime, so a different runtime version will verify again.
+// verifiedStamp also covers what vmcache records in the file once the image passed
+// verification: the verified flag and stack depth in the reserved field of every function.
+// The verifiedStamp field of the header is left out of both.
+void vmImageStamps(const void *data, unsigned length, uint64_t *contentStamp,
+                   uint64_t *verifiedStamp) {
+    auto words = (const uint64_t *)data;
+    unsigned n = length >> 3;
+    uint64_t h = runtimeHash(), r = 0xcbf29ce484222325ULL;
+    unsigned nextSect = 0, sectStart = 0;
+    bool isFunction = false;
+    for (unsigned i = 0; i < n; ++i) {
+        uint64_t w = words[i];
+        if (i == nextSect) {
+            // a broken size fails to load anyway; just hash the rest
+            auto size = (uint32_t)(w >> 32);
+            nextSect = size >= 8 && (size & 7) == 0 ? i + (size >> 3) : n;
+            sectStart = i;
+            isFunction = (SectionType)(w & 0xff) == SectionType::Function;
+        } else if (isFunction && i == sectStart + FUNCTION_RESERVED_WORD) {
+            r = hashWord(r, w >> FUNCTION_RESERVED_SHIFT);
+            w &= (1ULL << FUNCTION_RESERVED_SHIFT) - 1;
+        } else if (i == VERIFIED_STAMP_WORD) {
+            w = 0;
+        }
+        h = (h ^ w) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    h = hashWord(h, length);
+    *contentStamp = h ? h : 1;
+    r = hashWord(r, h);
+    *verifiedStamp = r ? r : 1;
+}
+
+VMImage *loadVMImage(void *data, unsigned length, int flags) {
     auto img = new VMImage();
     memset(img, 0, sizeof(*img));
 
-    DMESG("loading image at %p (%d bytes)", data, length);
+    if (eagerVerify == -1)
+        eagerVerify = getenv("PXT_VM_EAGER_VERIFY") != NULL;
+    img->eagerVerify = eagerVerify;
 
     CHECK_AT(ALIGNED((uintptr_t)data), 1000, 0);
     CHECK_AT(ALIGNED(length), 1001, 0);
@@ -321,6 +458,26 @@ VMImage *loadVMImage(void *data, unsigned length) {
     img->dataStart = (uint64_t *)data;
     img->dataEnd = (uint64_t *)((uint8_t *)data + length);
 
+    // the loader patches the image, so this is the only chance to hash it
+    uint64_t verifiedStamp;
+    vmImageStamps(data, length, &img->contentStamp, &verifiedStamp);
+
+    if (flags & VM_LOAD_FROM_CACHE) {
+        auto fh = (VMImageSection *)data;
+        if (length >= sizeof(VMImageSection) + sizeof(VMImageHeader) &&
+            fh->type == SectionType::InfoHeader) {
+            auto hd = (VMImageHeader *)fh->data;
+            if (hd->verifiedStamp && hd->verifiedStamp == verifiedStamp)
+                img->preVerified = 1;
+            else
+                // verify everything, so that the cache can record it
+                img->eagerVerify = 1;
+        }
+    }
+
+    DMESG("loading image at %p (%d bytes)%s", data, length,
+          img->preVerified ? " pre-verified" : img->eagerVerify ? " eager" : "");
+
     if (countSections(img) || loadSections(img) || loadIfaceNames(img) || validateFunctions(img) ||
         injectVTables(img)) {
         // error!
@@ -335,7 +492,12 @@ VMImage *loadVMImage(void *data, unsigned length) {
 void unloadVMImage(VMImage *img) {
     if (!img)
         return;
-    free(img->dataStart);
+#ifndef __MINGW32__
+    if (img->mappedLength)
+        munmap(img->dataStart, img->mappedLength);
+    else
+#endif
+        free(img->dataStart);
     memset(img, 0, sizeof(*img));
     delete img;
 }
@@ -33,12 +33,12 @@ void op_ldcap(FiberContext *ctx, unsigned arg) {
 
 //%
 void op_stglb(FiberContext *ctx, unsigned arg) {
-    globals[arg] = ctx->r0;
+    ctx->instance->globals[arg] = ctx->r0;
 }
 
 //%
 void op_ldglb(FiberContext *ctx, unsigned arg) {
-    ctx->r0 = globals[arg];
+    ctx->r0 = ctx->instance->globals[arg];
 }
 
 //%
@@ -108,40 +108,181 @@ void op_stfld(FiberContext *ctx, unsigned arg) {
     ((RefRecord *)obj)->fields[fldId] = ctx->r0;
 }
 
-static inline void runAction(FiberContext *ctx, RefAction *ra) {
-    if (ctx->sp < ctx->stackLimit)
+//
+// Stack segments
+//
+
+static VMStackSegment *allocSegment(FiberContext *ctx, uint32_t size) {
+    if (ctx->stackWords + size > VM_MAX_STACK_SIZE)
         error(PANIC_STACK_OVERFLOW);
+    auto seg = (VMStackSegment *)xmalloc(sizeof(VMStackSegment) + size * sizeof(TValue));
+    memset(seg, 0, sizeof(VMStackSegment));
+    seg->size = size;
+    ctx->stackWords += size;
+    return seg;
+}
+
+static void freeSegment(FiberContext *ctx, VMStackSegment *seg) {
+    ctx->stackWords -= seg->size;
+    xfree(seg);
+}
+
+static void enterSegment(FiberContext *ctx, VMStackSegment *seg) {
+    ctx->stack = seg;
+    ctx->stackLimit = seg->data + VM_STACK_MARGIN;
+}
+
+// keep the bigger of the spare and released segments
+static void releaseSegment(FiberContext *ctx, VMStackSegment *seg) {
+    auto spare = ctx->spareStack;
+    if (spare && spare->size >= seg->size) {
+        freeSegment(ctx, seg);
+    } else {
+        if (spare)
+            freeSegment(ctx, spare);
+        ctx->spareStack = seg;
+    }
+}
+
+// set up an empty stack of at least size words, reusing the current one if it fits
+void vmInitStack(FiberContext *ctx, uint32_t size) {
+    if (size < VM_INITIAL_STACK_SIZE)
+        size = VM_INITIAL_STACK_SIZE;
+    vmTrimStack(ctx);
+    auto seg = ctx->stack;
+    if (seg && seg->size < size) {
+        vmFreeStack(ctx);
+        seg = NULL;
+    }
+    if (!seg)
+        seg = allocSegment(ctx, size);
+    enterSegment(ctx, seg);
+    ctx->sp = seg->data + seg->size;
+}
+
+// Called when the function about to be called needs more than what's left in the current
+// segment. Moves the numArgs arguments to a new segment and returns the return address to push.
+TValue vmGrowStack(FiberContext *ctx, unsigned numArgs, unsigned needed, TValue retAddr) {
+    uint32_t size = numArgs + needed + VM_STACK_MARGIN;
+    if (size < VM_STACK_SEGMENT_SIZE)
+        size = VM_STACK_SEGMENT_SIZE;
+
+    auto seg = ctx->spareStack;
+    if (seg && seg->size >= size) {
+        ctx->spareStack = NULL;
+    } else {
+        if (seg) {
+            ctx->spareStack = NULL;
+            freeSegment(ctx, seg);
+        }
+        seg = allocSegment(ctx, size);
+    }
+
+    seg->prev = ctx->stack;
+    seg->prevSP = ctx->sp;
+    seg->retAddr = retAddr;
+    seg->padding = 0;
+    auto top = seg->data + seg->size;
+    memcpy(top - numArgs, ctx->sp, numArgs * sizeof(TValue));
+    enterSegment(ctx, seg);
+    ctx->sp = top - numArgs;
+
+    return TAG_SEGMENT_RETURN;
+}
+
+// Called on return through TAG_SEGMENT_RETURN; returns the real return address.
+TValue vmPopVMStackSegment(FiberContext *ctx, unsigned numArgs) {
+    auto seg = ctx->stack;
+    auto retAddr = seg->retAddr;
+    if (!seg->prev)
+        target_panic(PANIC_VM_ERROR);
+    enterSegment(ctx, seg->prev);
+    ctx->sp = seg->prevSP + numArgs - seg->padding; // pop the original arguments
+    releaseSegment(ctx, seg);
+    return retAddr;
+}
+
+// drop segments above sp, after it was reset by an exception
+static void unwindStack(FiberContext *ctx) {
+    for (;;) {
+        auto seg = ctx->stack;
+        if (seg->data <= ctx->sp && ctx->sp <= seg->data + seg->size)
+            break;
+        if (!seg->prev)
+            target_panic(PANIC_VM_ERROR);
+        enterSegment(ctx, seg->prev);
+        releaseSegment(ctx, seg);
+    }
+}
+
+// free all segments except for the bottom one
+void vmTrimStack(FiberContext *ctx) {
+    while (ctx->stack && ctx->stack->prev) {
+        auto seg = ctx->stack;
+        ctx->stack = seg->prev;
+        freeSegment(ctx, seg);
+    }
+    if (ctx->spareStack)
+        freeSegment(ctx, ctx->spareStack);
+    ctx->spareStack = NULL;
+}
+
+void vmFreeStack(FiberContext *ctx) {
+    while (ctx->stack) {
+        auto seg = ctx->stack;
+        ctx->stack = seg->prev;
+        freeSegment(ctx, seg);
+    }
+    if (ctx->spareStack)
+        freeSegment(ctx, ctx->spareStack);
+    ctx->spareStack = NULL;
+    ctx->stackLimit = NULL;
+}
+
+// numArgs is what the caller pushed; callind() can pass fewer than ra->numArgs
+static inline void runAction(FiberContext *ctx, RefAction *ra, unsigned numArgs) {
+    auto fn = (RefAction *)((uint8_t *)ra->func - VM_FUNCTION_CODE_OFFSET);
+    if (!(fn->reserved & VM_FUNCTION_VERIFIED))
+        vmVerifyFunction(ctx->img, fn);
+
+    auto retAddr = VM_ENCODE_PC(ctx->pc - ctx->imgbase);
+    unsigned missing = ra->numArgs - numArgs;
+    // 2 for the pushes below
+    unsigned needed = (fn->reserved & VM_FUNCTION_STACK_MASK) + 2 + missing;
+    if (ctx->sp - needed < ctx->stackLimit) {
+        retAddr = vmGrowStack(ctx, numArgs, needed, retAddr);
+        ctx->stack->padding = missing;
+    }
+
+    // add some undefineds
+    while (missing--)
+        PUSH(TAG_UNDEFINED);
 
     PUSH((TValue)ctx->currAction);
-    PUSH(VM_ENCODE_PC(ctx->pc - ctx->imgbase));
+    PUSH(retAddr);
     ctx->currAction = ra;
     ctx->pc = (uint16_t *)ra->func;
 }
 
 //%
 void op_callproc(FiberContext *ctx, unsigned arg) {
-    runAction(ctx, (RefAction *)ctx->img->pointerLiterals[arg]);
+    auto ra = (RefAction *)ctx->img->pointerLiterals[arg];
+    runAction(ctx, ra, ra->numArgs);
 }
 
 static void callind(FiberContext *ctx, RefAction *ra, unsigned numArgs) {
-    if (numArgs != ra->numArgs) {
-        int missing = ra->numArgs - numArgs;
-        TRACE("callind missing=%d", missing);
-        if (missing < 0) {
-            // just drop the ones on top
-            POP(-missing);
-        } else {
-            // add some undefineds
-            while (missing--)
-                PUSH(TAG_UNDEFINED);
-        }
+    if (numArgs > ra->numArgs) {
+        TRACE("callind extra=%d", numArgs - ra->numArgs);
+        // just drop the ones on top
+        POP(numArgs - ra->numArgs);
+        numArgs = ra->numArgs;
     }
 
     if (ra->initialLen != ra->len)
         // trying to call function template
         error(PANIC_INVALID_VTABLE);
 
-    runAction(ctx, ra);
+    runAction(ctx, ra, numArgs);
 }
 
 //%
@@ -172,6 +313,9 @@ void op_ret(FiberContext *ctx, unsigned arg) {
     ctx->currAction = (RefAction *)POPVAL();
     POP(retNumArgs);
 
+    if (retaddr == (intptr_t)TAG_SEGMENT_RETURN)
+        retaddr = (intptr_t)vmPopVMStackSegment(ctx, retNumArgs);
+
     if (retaddr == (intptr_t)TAG_STACK_BOTTOM) {
         ctx->pc = NULL;
     } else {
@@ -231,10 +375,11 @@ void restoreVMExceptionState(TryFrame *tf, FiberContext *ctx) {
     ctx->currAction = (RefAction *)tf->registers[0];
     ctx->pc = (uint16_t *)tf->registers[1];
     ctx->sp = (TValue *)tf->registers[2];
+    unwindStack(ctx);
     longjmp(ctx->loopjmp, 1);
 }
 
-static TValue lookupIfaceMember(TValue obj, VTable *vt, unsigned ifaceIdx) {
+static TValue lookupIfaceMember(VMImage *img, TValue obj, VTable *vt, unsigned ifaceIdx) {
     uint32_t mult = vt->ifaceHashMult;
     uint32_t off = (ifaceIdx * mult) >> (mult & 0xff);
 
@@ -246,7 +391,7 @@ static TValue lookupIfaceMember(TValue obj, VTable *vt, unsigned ifaceIdx) {
 
         if (ent->memberId == ifaceIdx) {
             if (ent->aux == 0) {
-                return vmImg->pointerLiterals[ent->method];
+                return img->pointerLiterals[ent->method];
             } else {
                 return ((RefRecord *)obj)->fields[ent->aux - 1];
             }
@@ -430,7 +575,7 @@ String convertToString(FiberContext *ctx, TValue v) {
                     img->toStringKey = -1;
             }
             if (img->toStringKey > 0) {
-                auto fn = lookupIfaceMember(v, vt, img->toStringKey);
+                auto fn = lookupIfaceMember(img, v, vt, img->toStringKey);
                 if (fn && isPointer(fn) &&
                     getVTable((RefObject *)fn)->objectType == ValType::Function) {
                     PUSH(v);
@@ -449,19 +594,23 @@ String convertToString(FiberContext *ctx, TValue v) {
 }
 
 void exec_loop(FiberContext *ctx) {
-    if (ctx->img->execLock) {
-        DMESG("image locked!");
+    auto inst = ctx->instance;
+    if (inst->execLock) {
+        DMESG("instance locked!");
         target_panic(PANIC_VM_ERROR);
     }
-    ctx->img->execLock = 1;
+    inst->execLock = 1;
     auto opcodes = ctx->img->opcodes;
     setjmp(ctx->loopjmp);
     while (ctx->pc) {
-        if (panicCode)
+        if (inst->panicCode)
             break;
+        if (profileSampleRequested)
+            profileSample(ctx);
+        ctx->instructions++;
         uint16_t opcode = *ctx->pc++;
         TRACE("0x%x: %04x %d", (uint8_t *)ctx->pc - 2 - (uint8_t *)ctx->img->dataStart, opcode,
-              (int)(ctx->stackBase + VM_STACK_SIZE - ctx->sp));
+              (int)(ctx->stack->data + ctx->stack->size - ctx->sp));
         if (opcode >> 15 == 0) {
             opcodes[opcode & VM_OPCODE_BASE_MASK](ctx, opcode >> VM_OPCODE_ARG_POS);
             if (opcode & VM_OPCODE_PUSH_MASK)
@@ -478,7 +627,7 @@ void exec_loop(FiberContext *ctx) {
                 PUSH(ctx->r0);
         }
     }
-    ctx->img->execLock = 0;
+    inst->execLock = 0;
 }
 
 } // namespace pxt
@@ -493,7 +642,7 @@ namespace pxt {
 #define FNERR(errcode)                                                                             \
     do {                                                                                           \
         setVMImgError(img, errcode, &code[pc]);                                                    \
-        return;                                                                                    \
+        return 0;                                                                                  \
     } while (0)
 #define FORCE_STACK(v, errcode, pc)                                                                \
     do {                                                                                           \
@@ -502,14 +651,16 @@ namespace pxt {
         stackDepth[pc] = v;                                                                        \
     } while (0)
 
-void validateFunction(VMImage *img, VMImageSection *sect, int debug) {
-    uint16_t stackDepth[sect->size / 2];
+// returns max stack depth of the function in words, or 0 on error
+unsigned validateFunction(VMImage *img, VMImageSection *sect, uint32_t size, int debug) {
+    uint16_t stackDepth[size / 2];
     memset(stackDepth, 0, sizeof(stackDepth));
     int baseStack = 1; // 1 is the return address; also zero in the array above means unknown yet
     int currStack = baseStack;
+    int maxStack = baseStack;
     unsigned pc = 0;
     auto code = (uint16_t *)((uint8_t *)sect + VM_FUNCTION_CODE_OFFSET);
-    auto lastPC = (sect->size - VM_FUNCTION_CODE_OFFSET) >> 1;
+    auto lastPC = (size - VM_FUNCTION_CODE_OFFSET) >> 1;
     auto atEnd = false;
 
     RefAction *ra = (RefAction *)sect;
@@ -523,6 +674,8 @@ void validateFunction(VMImage *img, VMImageSection *sect, int debug) {
     while (pc < lastPC) {
         if (currStack > VM_MAX_FUNCTION_STACK)
             FNERR(1204);
+        if (currStack > maxStack)
+            maxStack = currStack;
 
         FORCE_STACK(currStack, 1201, pc);
 
@@ -632,8 +785,7 @@ void validateFunction(VMImage *img, VMImageSection *sect, int debug) {
 
             if (classId >= img->numSections)
                 FNERR(1236);
-            auto fsec = img->sections[classId];
-            if (fsec->type != SectionType::VTable)
+            if (img->sectionTypes[classId] != SectionType::VTable)
                 FNERR(1234);
 
             auto vt = getStaticVTable(img, classId);
@@ -648,14 +800,13 @@ void validateFunction(VMImage *img, VMImageSection *sect, int debug) {
         } else if (fn == op_ldlit) {
             if (arg >= img->numSections)
                 FNERR(1215);
-            auto fsec = img->sections[arg];
-            if (fsec->type != SectionType::Literal && fsec->type != SectionType::Function)
+            auto tp = img->sectionTypes[arg];
+            if (tp != SectionType::Literal && tp != SectionType::Function)
                 FNERR(1237);
         } else if (fn == op_newobj || fn == op_checkinst) {
             if (arg >= img->numSections)
                 FNERR(1219);
-            auto fsec = img->sections[arg];
-            if (fsec->type != SectionType::VTable)
+            if (img->sectionTypes[arg] != SectionType::VTable)
                 FNERR(1238);
         } else if (fn == op_ldnumber) {
             if (arg >= img->numNumberLiterals)
@@ -663,10 +814,9 @@ void validateFunction(VMImage *img, VMImageSection *sect, int debug) {
         } else if (fn == op_callproc) {
             if (arg >= img->numSections)
                 FNERR(1218);
-            auto fsec = img->sections[arg];
-            if (fsec->type != SectionType::Function)
+            if (img->sectionTypes[arg] != SectionType::Function)
                 FNERR(1220);
-            unsigned calledArgs = ((RefAction *)fsec)->numArgs;
+            unsigned calledArgs = ((RefAction *)img->sections[arg])->numArgs;
             currStack -= calledArgs;
             if (currStack < baseStack)
                 FNERR(1221);
@@ -729,6 +879,8 @@ void validateFunction(VMImage *img, VMImageSection *sect, int debug) {
         pc--;
         FNERR(1210);
     }
+
+    return maxStack;
 }
 
 } // namespace pxt
\ No newline at end of file
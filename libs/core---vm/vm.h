@@ -15,6 +15,10 @@
 #define VM_RTCALL_PUSH_MASK 0x2000
 
 #define VM_FUNCTION_CODE_OFFSET 24
+// set in RefAction::reserved of a function section once validateFunction() accepted it
+#define VM_FUNCTION_VERIFIED 0x8000
+// the remaining bits of RefAction::reserved hold max stack depth of the function, in words
+#define VM_FUNCTION_STACK_MASK 0x7fff
 
 // The binary has space for 4 64 bit pointers, so on 32 bit machines we pretend there is 8 of them
 #ifdef PXT32
@@ -25,11 +29,21 @@
 
 // maximum size (in words) of stack in a single function
 #define VM_MAX_FUNCTION_STACK 200
-#define VM_STACK_SIZE 1000
+
+// Fiber stacks start small, and when a call doesn't fit, a new segment is chained,
+// with the arguments copied over. All sizes in words.
+#define VM_INITIAL_STACK_SIZE 128
+#define VM_STACK_SEGMENT_SIZE 512
+// kept free at the bottom of each segment for pushes not accounted for by validateFunction()
+#define VM_STACK_MARGIN 32
+// total for a single fiber
+#define VM_MAX_STACK_SIZE (64 * 1024)
 
 #define VM_ENCODE_PC(pc) ((TValue)(((pc) << 9) | 2))
 #define VM_DECODE_PC(pc) (((uintptr_t)pc) >> 9)
 #define TAG_STACK_BOTTOM VM_ENCODE_PC(1)
+// return address of a call that started a new stack segment; real one is in the segment
+#define TAG_SEGMENT_RETURN VM_ENCODE_PC(2)
 
 #define PXTEXT extern
 #ifdef __MINGW32__
@@ -41,6 +55,7 @@
 namespace pxt {
 
 struct FiberContext;
+struct VMInstance;
 typedef void (*OpFun)(FiberContext *ctx, unsigned arg);
 typedef void (*ApiFun)(FiberContext *ctx);
 
@@ -101,7 +116,8 @@ struct VMImageHeader {
     uint64_t lastUsageTime;
     uint64_t installationTime;
     uint64_t publicationTime;
-    uint8_t reserved[64];
+    uint64_t verifiedStamp; // set by vmcache once the image passed verification
+    uint8_t reserved[56];
     uint8_t name[128];
 };
 
@@ -114,6 +130,7 @@ struct VMImage {
 
     uint64_t *dataStart, *dataEnd;
     VMImageSection **sections;
+    SectionType *sectionTypes; // section headers of functions are overwritten on load
     VMImageHeader *infoHeader;
     const OpcodeDesc **opcodeDescs;
     RefAction *entryPoint;
@@ -126,8 +143,10 @@ struct VMImage {
     uint32_t errorCode;
     uint32_t errorOffset;
     int toStringKey;
-
-    int execLock;
+    int eagerVerify;
+    int preVerified;
+    uint64_t contentStamp; // see vmImageStamps()
+    uint32_t mappedLength; // non-zero when data is mmap()ed rather than malloc()ed
 };
 
 // not doing this, likely
@@ -138,11 +157,23 @@ struct StackFrame {
     uint32_t *fnbase;
 };
 
+struct VMStackSegment {
+    VMStackSegment *prev; // segment of the caller
+    TValue *prevSP;     // sp in prev segment when this one was started; arguments are there
+    TValue retAddr;     // return address of the call that started this segment
+    uint32_t size;      // in words
+    uint32_t padding;   // undefineds callind pushed for missing arguments; not in prev segment
+    TValue data[0];
+};
+
 struct FiberContext {
     FiberContext *next;
+    FiberContext *prev;
+    FiberContext *nextQueued; // in ready queue or list of waiters
 
     uint16_t *imgbase;
     VMImage *img;
+    VMInstance *instance;
     uint16_t *pc;
     uint16_t *resumePC;
     uint16_t *foreverPC;
@@ -154,8 +185,10 @@ struct FiberContext {
     TValue thrownValue;
     jmp_buf loopjmp;
 
-    TValue *stackBase;
+    VMStackSegment *stack;      // current segment
+    VMStackSegment *spareStack; // most recently released segment, kept to avoid thrashing
     TValue *stackLimit;
+    uint32_t stackWords; // allocated in all segments, including spare
 
     // wait_for_event
     int waitSource;
@@ -163,24 +196,95 @@ struct FiberContext {
 
     // for sleep
     uint64_t wakeTime;
+
+    // CPU accounting; handler is the section index of the function the fiber was started with
+    uint32_t handler;
+    uint32_t instructions;
+};
+
+
+#define VM_WAIT_BUCKETS 64
+
+// Runtime state of one program. The GC heap, the event queue and native libraries are still
+// process-global, so only one instance runs at a time - the one in vmCurrent. Code that has a
+// FiberContext should use its instance instead.
+struct VMInstance {
+    VMImage *img;
+    TValue *globals;
+    volatile int panicCode;
+    int execLock; // exec_loop() is running
+
+    FiberContext *allFibers, *allFibersTail;
+    FiberContext *currentFiber;
+    // runs the top-level code of the program; a heap snapshot can be taken once it's done
+    FiberContext *mainFiber;
+
+    // Scheduler state: every fiber other than the current one is either in the ready queue,
+    // in the sleep heap (keyed on wakeTime), or in the waiters table (keyed on waitSource and
+    // waitValue).
+    FiberContext *readyHead, *readyTail;
+    FiberContext **sleepHeap;
+    int sleepHeapSize, sleepHeapCapacity;
+    FiberContext *waiters[VM_WAIT_BUCKETS];
 };
 
+extern VMInstance *vmCurrent;
 
-#define PXT_EXN_CTX() currentFiber
+#define PXT_EXN_CTX() (vmCurrent->currentFiber)
 
 void restoreVMExceptionState(TryFrame *tf, FiberContext *ctx);
 #define pxt_restore_exception_state restoreVMExceptionState
 
-extern VMImage *vmImg;
-extern FiberContext *currentFiber;
-extern volatile int panicCode;
-
 void vmStart();
-VMImage *loadVMImage(void *data, unsigned length);
+// flags for loadVMImage()
+#define VM_LOAD_FROM_CACHE 0x01 // honor verifiedStamp in header
+
+VMImage *loadVMImage(void *data, unsigned length, int flags = 0);
+void vmImageStamps(const void *data, unsigned length, uint64_t *contentStamp,
+                   uint64_t *verifiedStamp);
 void unloadVMImage(VMImage *img);
 VMImage *setVMImgError(VMImage *img, int code, void *pos);
+int vmFindSection(VMImage *img, void *addr);
+uint32_t vmSectionSize(VMImage *img, unsigned idx);
+void vmVerifyFunction(VMImage *img, RefAction *fn);
 void exec_loop(FiberContext *ctx);
+void vmInitStack(FiberContext *ctx, uint32_t size);
+void vmTrimStack(FiberContext *ctx);
+TValue vmGrowStack(FiberContext *ctx, unsigned numArgs, unsigned needed, TValue retAddr);
+TValue vmPopVMStackSegment(FiberContext *ctx, unsigned numArgs);
+void vmFreeStack(FiberContext *ctx);
 void vmStartFromUser(const char *fn);
+FiberContext *setupThread(Action a, TValue arg = 0);
+void vmFrameDone();
+
+extern volatile int profileSampleRequested;
+void profileSample(FiberContext *ctx);
+void profileInit();
+
+// fixed addresses (hints) for the image and the loader's literals, below GC_BASE, so that they
+// are the same on every launch, as heap snapshots require
+#ifdef PXT64
+#define VM_IMAGE_BASE 0x1000000000
+#define VM_PREALLOC_BASE 0x1f00000000
+#else
+#define VM_IMAGE_BASE 0x10000000
+#define VM_PREALLOC_BASE 0x1f000000
+#endif
+void *gcAllocPreallocBlock(size_t sz);
+
+// heap snapshots; vmsnapshot.cpp and gc.cpp
+struct GCBlockInfo {
+    void *addr;
+    uint32_t size;
+};
+void gcPreallocRange(uint8_t **start, uint8_t **end);
+int gcGetBlocks(GCBlockInfo *dst, int maxBlocks);
+bool gcRestoreBlocks(GCBlockInfo *blocks, int numBlocks);
+void gcRestoreDone(uintptr_t (*reloc)(uintptr_t));
+LLSegment *gcGetRoots();
+bool vmSnapshotRestore();
+void vmSnapshotSave();
+void registerSnapshotState(const char *name, void *data, uint32_t size, bool *restored = NULL);
 
 #define DEF_CONVERSION(retp, tp, btp)                                                              \
     static inline retp tp(TValue v) {                                                              \
@@ -203,4 +307,12 @@ String convertToString(FiberContext *ctx, TValue v);
 
 } // namespace pxt
 
+namespace vmcache {
+bool isCacheFile(const char *fn);
+void saveVerifiedImage(const char *fn, VMImage *img);
+char *snapshotPath(uint64_t programHash);
+void snapshotSaved(uint64_t programHash);
+void flushIndex();
+} // namespace vmcache
+
 #endif
\ No newline at end of file
@@ -5,6 +5,18 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <pthread.h>
+
+// The cache directory holds one file per script, named by script id, plus an index file with
+// the header fields of all scripts. The index is loaded once, so listing and lookups don't need
+// to touch the scripts, and is rewritten (via a temp file and rename) on every change.
+// Least recently used scripts are evicted when the total size exceeds cacheBudget. Heap
+// snapshots of a script (see vmsnapshot.cpp) count towards its size and go with it.
+
+#define INDEX_MAGIC 0x30584449 // IDX0
+#define INDEX_FILE "/.index"
+#define MAX_ID_LENGTH 63
+#define DEFAULT_CACHE_BUDGET (128 * 1024 * 1024)
 
 namespace vmcache {
 
@@ -17,6 +29,32 @@ struct FullHeader {
     VMImageHeader header;
 };
 
+struct IndexHeader {
+    uint32_t magic;
+    uint32_t entrySize;
+    uint32_t numEntries;
+    uint32_t reserved;
+};
+
+struct IndexEntry {
+    char id[MAX_ID_LENGTH + 1];
+    char name[128];
+    uint64_t size;
+    uint64_t publicationTime;
+    uint64_t installationTime;
+    uint64_t lastUsageTime;
+    uint64_t hexHash;
+    uint64_t programHash;
+};
+
+static pthread_mutex_t indexMutex = PTHREAD_MUTEX_INITIALIZER;
+static IndexEntry *entries;
+static int numEntries, maxEntries;
+static bool indexLoaded;
+// lastUsageTime was updated, but the index wasn't written out yet
+static bool indexDirty;
+static uint64_t cacheBudget = DEFAULT_CACHE_BUDGET;
+
 
 static char *scriptPath(const char *scriptId) {
     for (auto p = scriptId; *p; ++p)
@@ -36,33 +74,116 @@ static char *scriptPath(const char *scriptId) {
     return pathBuf;
 }
 
+// A temp file next to path, for writing a new version and rename()ing it over path. The leading
+// dot keeps readEntry() away from it.
+static char *tempPath(const char *path) {
+    auto slash = strrchr(path, '/');
+    auto dirLen = slash ? slash + 1 - path : 0;
+    auto res = (char *)malloc(strlen(path) + 10);
+    memcpy(res, path, dirLen);
+    sprintf(res + dirLen, ".%s.tmp", path + dirLen);
+    return res;
+}
+
+bool isCacheFile(const char *fn) {
+    if (!dataPath || !fn)
+        return false;
+    auto dir = scriptPath("");
+    auto len = strlen(dir);
+    auto res = strncmp(fn, dir, len) == 0 && fn[len] == '/';
+    free(dir);
+    return res;
+}
+
+static char *snapshotFile(uint64_t programHash, bool createDir) {
+    auto pathBuf = (char *)malloc(strlen(dataPath) + 50);
+    sprintf(pathBuf, "%s/snapshots-v0", dataPath);
+    if (createDir) {
+#ifdef __WIN32__
+        mkdir(pathBuf);
+#else
+        mkdir(pathBuf, 0777);
+#endif
+    }
+    sprintf(pathBuf + strlen(pathBuf), "/%016llx", (unsigned long long)programHash);
+    return pathBuf;
+}
+
+// NULL when there's no data directory
+char *snapshotPath(uint64_t programHash) {
+    if (!dataPath)
+        return NULL;
+    return snapshotFile(programHash, true);
+}
+
+static uint64_t snapshotSize(uint64_t programHash) {
+    auto path = snapshotFile(programHash, false);
+    struct stat st;
+    uint64_t size = stat(path, &st) == 0 ? st.st_size : 0;
+    free(path);
+    return size;
+}
+
+// Records in the cached file that img passed verification, along with the stack depth of every
+// function, so that the next start can skip verification without giving up on small fiber
+// stacks. The file is rewritten via a temp file; the running program has it mapped.
+void saveVerifiedImage(const char *fn, VMImage *img) {
+    auto len = (unsigned)((uint8_t *)img->dataEnd - (uint8_t *)img->dataStart);
+    auto fh = fopen(fn, "rb");
+    if (!fh)
+        return;
+    auto data = (uint8_t *)malloc(len + 8);
+    auto n = fread(data, 1, len + 8, fh);
+    fclose(fh);
+
+    uint64_t contentStamp, verifiedStamp;
+    if (n == len)
+        vmImageStamps(data, len, &contentStamp, &verifiedStamp);
+    if (n != len || contentStamp != img->contentStamp) {
+        dmesg("%s changed since it was loaded", fn);
+        free(data);
+        return;
+    }
+
+    for (unsigned i = 0; i < img->numSections; ++i) {
+        if (img->sectionTypes[i] != SectionType::Function)
+            continue;
+        auto off = (uint8_t *)img->sections[i] - (uint8_t *)img->dataStart;
+        ((RefAction *)(data + off))->reserved = ((RefAction *)img->sections[i])->reserved;
+    }
+    vmImageStamps(data, len, &contentStamp, &verifiedStamp);
+    ((FullHeader *)data)->header.verifiedStamp = verifiedStamp;
+
+    auto tmpPath = tempPath(fn);
+    fh = fopen(tmpPath, "wb");
+    int ok = fh && fwrite(data, len, 1, fh) == 1;
+    ok = fh && fclose(fh) == 0 && ok;
+    if (ok && rename(tmpPath, fn) == 0) {
+        dmesg("marked %s as verified", fn);
+    } else {
+        dmesg("cannot write %s", tmpPath);
+        if (fh)
+            remove(tmpPath);
+    }
+    free(tmpPath);
+    free(data);
+}
+
 DLLEXPORT void pxt_vm_set_data_directory(const char *path) {
+    flushIndex();
+    pthread_mutex_lock(&indexMutex);
     free(dataPath);
     dataPath = strdup(path);
+    free(entries);
+    entries = NULL;
+    numEntries = maxEntries = 0;
+    indexLoaded = false;
+    pthread_mutex_unlock(&indexMutex);
     dmesg("set vm cached dir %s", dataPath);
 }
 
-int checkCache(const char *scriptId, bool updateTimestamp = true) {
-    auto pathBuf = scriptPath(scriptId);
-    if (!pathBuf)
-        return 0;
-    auto fh = fopen(pathBuf, updateTimestamp ? "r+b" : "rb");
-    free(pathBuf);
-    dmesg("cache %s for %s", fh ? "hit" : "miss", scriptId);
-    if (fh) {
-        if (updateTimestamp) {
-            fseek(fh, OFFSET_OF(FullHeader, header.lastUsageTime), SEEK_SET);
-            int64_t now = time(NULL);
-            fwrite(&now, 1, 8, fh);
-        }
-        fclose(fh);
-        return 1;
-    }
-    return 0;
-}
-
-DLLEXPORT int pxt_vm_cache_hit(const char *scriptId) {
-    return checkCache(scriptId, false);
+DLLEXPORT void pxt_vm_set_cache_budget(uint64_t bytes) {
+    cacheBudget = bytes;
 }
 
 static int isValidHeader(FullHeader *fh) {
@@ -121,15 +242,214 @@ static DIR *openCacheDir() {
     return dp;
 }
 
-static bool nameExists(const char *name) {
+static char *indexPath(const char *suffix) {
+    auto dir = scriptPath("");
+    auto res = (char *)malloc(strlen(dir) + strlen(INDEX_FILE) + strlen(suffix) + 1);
+    strcpy(res, dir);
+    strcat(res, INDEX_FILE);
+    strcat(res, suffix);
+    free(dir);
+    return res;
+}
+
+static void saveIndex() {
+    indexDirty = false;
+    auto tmpPath = indexPath(".tmp");
+    auto fp = fopen(tmpPath, "wb");
+    if (!fp) {
+        dmesg("cannot write %s", tmpPath);
+        free(tmpPath);
+        return;
+    }
+    IndexHeader hd;
+    memset(&hd, 0, sizeof(hd));
+    hd.magic = INDEX_MAGIC;
+    hd.entrySize = sizeof(IndexEntry);
+    hd.numEntries = numEntries;
+    int ok = fwrite(&hd, sizeof(hd), 1, fp) == 1 &&
+             (int)fwrite(entries, sizeof(IndexEntry), numEntries, fp) == numEntries;
+    ok = fclose(fp) == 0 && ok;
+    auto path = indexPath("");
+    // rename() replaces the old index atomically, so a crash leaves either the old or new one
+    if (!ok || rename(tmpPath, path) != 0) {
+        dmesg("failed to save cache index");
+        remove(tmpPath);
+    }
+    free(path);
+    free(tmpPath);
+}
+
+static IndexEntry *addEntry(const char *id) {
+    if (numEntries == maxEntries) {
+        maxEntries = maxEntries ? maxEntries * 2 : 32;
+        entries = (IndexEntry *)realloc(entries, maxEntries * sizeof(IndexEntry));
+    }
+    auto e = &entries[numEntries++];
+    memset(e, 0, sizeof(*e));
+    strncpy(e->id, id, MAX_ID_LENGTH);
+    return e;
+}
+
+static void fillEntry(IndexEntry *e, FullHeader *fh, uint64_t size) {
+    auto hd = &fh->header;
+    memcpy(e->name, hd->name, sizeof(e->name));
+    e->name[sizeof(e->name) - 1] = 0;
+    e->size = size;
+    e->publicationTime = hd->publicationTime;
+    e->installationTime = hd->installationTime;
+    e->lastUsageTime = hd->lastUsageTime;
+    e->hexHash = hd->hexHash;
+    e->programHash = hd->programHash;
+}
+
+// re-create the index from script headers, when it's missing or corrupt
+static void rebuildIndex() {
+    dmesg("rebuilding cache index");
+    numEntries = 0;
     auto dp = openCacheDir();
     FullHeader fh;
     for (;;) {
-        if (!readEntry(dp, &fh))
+        auto id = readEntry(dp, &fh);
+        if (!id)
             break;
-        if (strcmp(name, (char*)fh.header.name) == 0)
+        if (strlen(id) > MAX_ID_LENGTH)
+            continue;
+        struct stat st;
+        auto filepath = scriptPath(id);
+        if (filepath && stat(filepath, &st) == 0)
+            fillEntry(addEntry(id), &fh, st.st_size);
+        free(filepath);
+    }
+    saveIndex();
+}
+
+static void loadIndex() {
+    if (indexLoaded || !dataPath)
+        return;
+    indexLoaded = true;
+    numEntries = 0;
+
+    static bool exitHook;
+    if (!exitHook) {
+        exitHook = true;
+        atexit(flushIndex);
+    }
+
+    auto path = indexPath("");
+    auto fp = fopen(path, "rb");
+    free(path);
+    if (fp) {
+        IndexHeader hd;
+        if (fread(&hd, sizeof(hd), 1, fp) == 1 && hd.magic == INDEX_MAGIC &&
+            hd.entrySize == sizeof(IndexEntry) && hd.numEntries < 100000) {
+            while (numEntries < (int)hd.numEntries) {
+                auto e = addEntry("");
+                if (fread(e, sizeof(*e), 1, fp) != 1) {
+                    numEntries = -1;
+                    break;
+                }
+                e->id[MAX_ID_LENGTH] = 0;
+                e->name[sizeof(e->name) - 1] = 0;
+            }
+        } else {
+            numEntries = -1;
+        }
+        fclose(fp);
+    }
+
+    if (!fp || numEntries < 0)
+        rebuildIndex();
+}
+
+static int findEntry(const char *scriptId) {
+    for (int i = 0; i < numEntries; ++i)
+        if (strcmp(entries[i].id, scriptId) == 0)
+            return i;
+    return -1;
+}
+
+// other scripts can have the same program, and share its snapshot
+static bool programShared(int idx) {
+    for (int i = 0; i < numEntries; ++i)
+        if (i != idx && entries[i].programHash == entries[idx].programHash)
             return true;
+    return false;
+}
+
+// size of the script, and of its snapshot unless another script keeps it
+static uint64_t entrySize(int idx) {
+    if (programShared(idx))
+        return entries[idx].size;
+    return entries[idx].size + snapshotSize(entries[idx].programHash);
+}
+
+static void removeEntry(int idx) {
+    numEntries--;
+    memmove(&entries[idx], &entries[idx + 1], (numEntries - idx) * sizeof(IndexEntry));
+}
+
+// removes the script's entry, and its snapshot if no other script has the same program
+static void removeEntryAndSnapshot(int idx) {
+    if (!programShared(idx)) {
+        auto path = snapshotFile(entries[idx].programHash, false);
+        remove(path);
+        free(path);
+    }
+    removeEntry(idx);
+}
+
+// delete least recently used scripts, other than keepId or the ones running keepProgram, until
+// we fit in cacheBudget
+static void evict(const char *keepId, const uint64_t *keepProgram) {
+    uint64_t total = 0;
+    for (int i = 0; i < numEntries; ++i)
+        total += entrySize(i);
+    while (total > cacheBudget) {
+        int oldest = -1;
+        for (int i = 0; i < numEntries; ++i) {
+            if ((keepId && strcmp(entries[i].id, keepId) == 0) ||
+                (keepProgram && entries[i].programHash == *keepProgram))
+                continue;
+            if (oldest < 0 || entries[i].lastUsageTime < entries[oldest].lastUsageTime)
+                oldest = i;
+        }
+        if (oldest < 0)
+            break;
+        auto size = entrySize(oldest);
+        auto pathBuf = scriptPath(entries[oldest].id);
+        dmesg("evicting %s from cache, %d bytes", pathBuf, (int)size);
+        if (pathBuf)
+            remove(pathBuf);
+        free(pathBuf);
+        total -= size;
+        removeEntryAndSnapshot(oldest);
     }
+}
+
+int checkCache(const char *scriptId, bool updateTimestamp = true) {
+    if (!dataPath)
+        return 0;
+    pthread_mutex_lock(&indexMutex);
+    loadIndex();
+    int idx = findEntry(scriptId);
+    dmesg("cache %s for %s", idx >= 0 ? "hit" : "miss", scriptId);
+    if (idx >= 0 && updateTimestamp) {
+        // written out with the next change to the index, on reset, or on exit
+        entries[idx].lastUsageTime = (int64_t)time(NULL);
+        indexDirty = true;
+    }
+    pthread_mutex_unlock(&indexMutex);
+    return idx >= 0;
+}
+
+DLLEXPORT int pxt_vm_cache_hit(const char *scriptId) {
+    return checkCache(scriptId, false);
+}
+
+static bool nameExists(const char *name) {
+    for (int i = 0; i < numEntries; ++i)
+        if (strcmp(name, entries[i].name) == 0)
+            return true;
     return false;
 }
 
@@ -138,27 +458,28 @@ RefCollection *list() {
     auto res = Array_::mk();
     registerGCObj(res);
 
-    auto dp = openCacheDir();
-    FullHeader fh;
-    for (;;) {
-        auto id = readEntry(dp, &fh);
-        if (!id)
-            break;
+    pthread_mutex_lock(&indexMutex);
+    loadIndex();
+    for (int i = 0; i < numEntries; ++i) {
+        auto e = &entries[i];
         char buf[1024];
-        for (auto p = fh.header.name; *p; p++) {
-            if (*p == '\"' || *p < 32)
+        char name[sizeof(e->name)];
+        strcpy(name, e->name);
+        for (auto p = name; *p; p++) {
+            if (*p == '\"' || (uint8_t)*p < 32)
                 *p = '_';
         }
         snprintf(buf, 1023,
                  "{ \"id\": \"%s\", \"pubTime\": %lld, \"installTime\": %lld, \"usageTime\": %lld, "
                  "\"name\": \"%s\" }",
-                 id, fh.header.publicationTime, fh.header.installationTime, fh.header.lastUsageTime,
-                 fh.header.name);
+                 e->id, (long long)e->publicationTime, (long long)e->installationTime,
+                 (long long)e->lastUsageTime, name);
         auto str = mkString(buf, -1);
         registerGCObj(str);
         Array_::push(res, (TValue)str);
         unregisterGCObj(str);
     }
+    pthread_mutex_unlock(&indexMutex);
 
     unregisterGCObj(res);
     return res;
@@ -171,6 +492,7 @@ static int renameImage(uint8_t *data, int len) {
     if (!isValidHeader(fh))
         return -2;
     fh->header.installationTime = (int64_t)time(NULL);
+    fh->header.verifiedStamp = 0; // only we get to say it's verified
     auto name = (char*)fh->header.name;
     name[101] = 0; // make sure we have space at the end
     dmesg("rename image from '%s'", name);
@@ -199,21 +521,72 @@ DLLEXPORT int pxt_vm_save_in_cache(const char *scriptId, uint8_t *data, int len)
 #endif
     free(dp);
     auto pathBuf = scriptPath(scriptId);
-    if (!pathBuf)
+    if (!pathBuf || strlen(scriptId) > MAX_ID_LENGTH) {
+        free(pathBuf);
         return -3;
-    if (renameImage(data, len))
+    }
+    pthread_mutex_lock(&indexMutex);
+    loadIndex();
+    int idx = findEntry(scriptId);
+    if (idx >= 0) {
+        // don't conflict with our own old name; the old snapshot is only good for the same program
+        if (entries[idx].programHash == ((FullHeader *)data)->header.programHash)
+            removeEntry(idx);
+        else
+            removeEntryAndSnapshot(idx);
+    }
+    if (renameImage(data, len)) {
+        pthread_mutex_unlock(&indexMutex);
+        free(pathBuf);
         return -4;
-    auto fh = fopen(pathBuf, "wb");
+    }
+    // The script might be running from a mapping of the current file; writing over it would
+    // change (or cut off) the pages the program hasn't read yet. Write a new file and rename() it
+    // into place, so the mapping keeps the old one.
+    auto tmpPath = tempPath(pathBuf);
     dmesg("saving %s in cache, %d bytes", pathBuf, len);
-    free(pathBuf);
-    if (!fh)
+    auto fh = fopen(tmpPath, "wb");
+    int ok = fh && fwrite(data, len, 1, fh) == 1;
+    ok = fh && fclose(fh) == 0 && ok;
+    if (!ok || rename(tmpPath, pathBuf) != 0) {
+        if (fh)
+            remove(tmpPath);
+        free(tmpPath);
+        free(pathBuf);
+        pthread_mutex_unlock(&indexMutex);
         return -2;
-    fwrite(data, len, 1, fh);
-    fclose(fh);
+    }
+    free(tmpPath);
+    free(pathBuf);
+    auto e = addEntry(scriptId);
+    fillEntry(e, (FullHeader *)data, len);
+    e->lastUsageTime = e->installationTime;
+    evict(scriptId, NULL);
+    saveIndex();
+    pthread_mutex_unlock(&indexMutex);
     dmesg("saved.");
     return 0;
 }
 
+// Called after a snapshot of programHash was written.
+void snapshotSaved(uint64_t programHash) {
+    pthread_mutex_lock(&indexMutex);
+    loadIndex();
+    int n = numEntries;
+    evict(NULL, &programHash);
+    if (n != numEntries || indexDirty)
+        saveIndex();
+    pthread_mutex_unlock(&indexMutex);
+}
+
+// Writes out the usage times recorded by checkCache().
+void flushIndex() {
+    pthread_mutex_lock(&indexMutex);
+    if (indexDirty)
+        saveIndex();
+    pthread_mutex_unlock(&indexMutex);
+}
+
 DLLEXPORT void pxt_vm_start(const char *fn);
 
 DLLEXPORT int pxt_vm_cache_start(const char *scriptId) {
@@ -244,6 +617,14 @@ void del(String name) {
     dmesg("delete %s from cache", pathBuf);
     remove(pathBuf);
     free(pathBuf);
+    pthread_mutex_lock(&indexMutex);
+    loadIndex();
+    int idx = findEntry(scriptId);
+    if (idx >= 0) {
+        removeEntryAndSnapshot(idx);
+        saveIndex();
+    }
+    pthread_mutex_unlock(&indexMutex);
 }
 
 } // namespace vmcache
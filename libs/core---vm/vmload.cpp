@@ -1,33 +1,69 @@
 #include "pxt.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifndef __MINGW32__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 namespace pxt {
 
-VMImage *vmImg;
+// the host runs one program at a time
+static VMInstance mainInstance;
+VMInstance *vmCurrent = &mainInstance;
+
+static uint64_t startTimeUs;
+static bool firstFrameSeen;
+
+// Called by the screen driver on every frame. Reports time to first frame, which is dominated
+// by image load and verification for big programs.
+void vmFrameDone() {
+    if (firstFrameSeen || !startTimeUs)
+        return;
+    firstFrameSeen = true;
+    dmesg("first frame after %d us", (int)(current_time_us() - startTimeUs));
+}
+
+// mappedLength is non-zero when data comes from mmap(); cacheFile is set when the image is
+// loaded from vmcache, which can then skip verification of already verified images
+static void vmStartCore(uint8_t *data, unsigned len, unsigned mappedLength,
+                        const char *cacheFile) {
+    auto inst = vmCurrent;
+    unloadVMImage(inst->img);
+    inst->img = NULL;
 
-static void vmStartCore(uint8_t *data, unsigned len) {
-    unloadVMImage(vmImg);
-    vmImg = NULL;
+    startTimeUs = current_time_us();
+    firstFrameSeen = false;
 
     gcPreStartup();
 
-    auto img = loadVMImage(data, len);
+    auto img = loadVMImage(data, len, cacheFile ? VM_LOAD_FROM_CACHE : 0);
+    img->mappedLength = mappedLength;
     if (img->errorCode) {
         dmesg("validation error %d at 0x%x", img->errorCode, img->errorOffset);
         return;
     } else {
-        dmesg("Validation OK");
+        dmesg("Validation OK; loaded in %d us", (int)(current_time_us() - startTimeUs));
     }
-    vmImg = img;
+    inst->img = img;
+
+    if (cacheFile && !img->preVerified && img->eagerVerify)
+        vmcache::saveVerifiedImage(cacheFile, img);
 
     gcStartup();
 
-    globals = (TValue *)app_alloc(sizeof(TValue) * getNumGlobals());
-    memset(globals, 0, sizeof(TValue) * getNumGlobals());
+    inst->globals = (TValue *)app_alloc(sizeof(TValue) * getNumGlobals());
+    memset(inst->globals, 0, sizeof(TValue) * getNumGlobals());
 
     initRuntime();
 }
 
 static void vmStartFile(const char *fn) {
+    auto cacheFile = vmcache::isCacheFile(fn) ? fn : NULL;
+
+#ifdef __MINGW32__
     auto f = fopen(fn, "rb");
     if (!f) {
         dmesg("cannot open %s", fn);
@@ -41,7 +77,32 @@ static void vmStartFile(const char *fn) {
     fread(data, len, 1, f);
     fclose(f);
 
-    vmStartCore(data, len);
+    vmStartCore(data, len, 0, cacheFile);
+#else
+    // the previous image goes first, so that the new one can take its address
+    unloadVMImage(vmCurrent->img);
+    vmCurrent->img = NULL;
+
+    int fd = open(fn, O_RDONLY);
+    if (fd < 0) {
+        dmesg("cannot open %s", fn);
+        return;
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    auto len = (unsigned)st.st_size;
+    // private mapping - the loader patches the image in memory, but never writes it back
+    auto data = (uint8_t *)mmap((void *)VM_IMAGE_BASE, len, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                                fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        dmesg("cannot mmap %s; err=%d", fn, errno);
+        return;
+    }
+
+    vmStartCore(data, len, len, cacheFile);
+#endif
 }
 
 static uint8_t *vm_data;
@@ -52,7 +113,7 @@ static void *multiStart(void *) {
     if (vm_filename)
         vmStartFile(vm_filename);
     else
-        vmStartCore(vm_data, vm_len);
+        vmStartCore(vm_data, vm_len, 0, NULL);
     return NULL;
 }
 
@@ -67,12 +128,12 @@ int vm_has_thread;
 static void spinThread() {
     if (vm_has_thread) {
         void *dummy;
-        if (!panicCode)
-            panicCode = -1;
+        if (!vmCurrent->panicCode)
+            vmCurrent->panicCode = -1;
         pthread_join(vm_thread, &dummy);
         vm_has_thread = 0;
     }
-    panicCode = 0;
+    vmCurrent->panicCode = 0;
     pthread_create(&vm_thread, NULL, multiStart, NULL);
     vm_has_thread = 1;
 }
@@ -81,7 +142,7 @@ static void *startFromUserWorker(void *fn) {
     void *dummy;
     pthread_join(vm_thread, &dummy);
     vm_thread = pthread_self();
-    panicCode = 0;
+    vmCurrent->panicCode = 0;
     vmStartFile((char*)fn);
     return NULL;
 }
@@ -100,11 +161,13 @@ void vmStartFromUser(const char *fn) {
 }
 
 DLLEXPORT void pxt_vm_start(const char *fn) {
+    dmesgInitLevel();
     vm_filename = fn;
     spinThread();
 }
 
 DLLEXPORT void pxt_vm_start_buffer(uint8_t *data, unsigned len) {
+    dmesgInitLevel();
     vm_filename = NULL;
     vm_data = data;
     vm_len = len;
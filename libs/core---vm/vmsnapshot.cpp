@@ -0,0 +1,508 @@
+#include "pxt.h"
+
+#include <stdio.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <link.h>
+#endif
+
+// Heap snapshots, for starting big programs without running their initialization again.
+//
+// When enabled (PXT_VM_SNAPSHOT=1 or pxt_vm_set_snapshot(1)) and there is a data directory,
+// the state of the program is saved when its top-level code finishes: the GC heap blocks,
+// globals, handler bindings, GC roots, fibers started by the top-level code (which can't have
+// run yet) and native state registered with registerSnapshotState(). On the next start of the
+// same image the state is restored, and the top-level code is not run.
+//
+// The heap lives at GC_BASE, and the image and the loader's literals at their own fixed
+// addresses, so pointers to them are saved as they are. The runtime binary itself may be
+// loaded at a different address; vtables and other words pointing into it are relocated.
+// Anything that doesn't match (different image or runtime build, addresses already taken, a
+// damaged file) means a cold start, after which the snapshot is saved again.
+
+#define SNAPSHOT_MAGIC 0x30504e53 // SNP0
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_MAX_BLOCKS 256
+#define SNAPSHOT_MAX_STATES 16
+#define SNAPSHOT_NAME_LENGTH 32
+
+namespace pxt {
+
+struct SnapshotHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t imageStamp; // image and opcodes, see vmImageStamps()
+    uint64_t runtimeId;  // size and modification time of the runtime binary
+    uint64_t runtimeStart, runtimeEnd;
+    uint64_t imageStart, imageEnd;
+    uint64_t preallocStart, preallocEnd;
+    uint64_t globals;
+    uint64_t handlerBindings;
+    uint32_t numBlocks;
+    uint32_t numRoots;
+    uint32_t numFibers;
+    uint32_t numStates;
+    uint64_t payloadSize; // everything after the header
+    uint64_t hash;        // of the payload, then of this header with hash = 0; see hashBytes()
+};
+
+struct SnapshotBlock {
+    uint64_t addr;
+    uint32_t size;
+    uint32_t reserved;
+};
+
+struct SnapshotRoot {
+    // as in gcRoots: a TValue, or (with the lowest bit set) where one is stored
+    uint64_t root;
+    // the value stored there, when that's outside of the heap
+    uint64_t value;
+};
+
+struct SnapshotFiber {
+    uint64_t action;
+    uint64_t arg;
+    uint32_t forever;
+    uint32_t reserved;
+};
+
+struct SnapshotStateHeader {
+    char name[SNAPSHOT_NAME_LENGTH];
+    uint32_t size;
+    uint32_t reserved;
+};
+
+struct SnapshotState {
+    const char *name;
+    void *data;
+    uint32_t size;
+    bool *restored; // set to true when data is restored; optional
+};
+
+static int snapshotEnabled = -1;
+static SnapshotState states[SNAPSHOT_MAX_STATES];
+static int numStates;
+// restored, but not registered yet
+static SnapshotState pendingStates[SNAPSHOT_MAX_STATES];
+static int numPendingStates;
+
+static uintptr_t relocStart, relocEnd;
+static intptr_t relocDelta;
+
+DLLEXPORT void pxt_vm_set_snapshot(int enabled) {
+    snapshotEnabled = enabled;
+}
+
+static bool isEnabled() {
+    if (snapshotEnabled == -1)
+        snapshotEnabled = getenv("PXT_VM_SNAPSHOT") != NULL;
+    return snapshotEnabled;
+}
+
+#ifdef __linux__
+struct RuntimeRange {
+    uintptr_t anchor;
+    uintptr_t start, end;
+    char path[256];
+};
+
+static int findRuntime(struct dl_phdr_info *info, size_t, void *data) {
+    auto r = (RuntimeRange *)data;
+    uintptr_t start = UINTPTR_MAX, end = 0;
+    for (int i = 0; i < info->dlpi_phnum; ++i) {
+        auto ph = &info->dlpi_phdr[i];
+        if (ph->p_type != PT_LOAD)
+            continue;
+        uintptr_t lo = info->dlpi_addr + ph->p_vaddr;
+        uintptr_t hi = lo + ph->p_memsz;
+        if (lo < start)
+            start = lo;
+        if (hi > end)
+            end = hi;
+    }
+    if (r->anchor < start || r->anchor >= end)
+        return 0;
+    r->start = start;
+    r->end = end;
+    snprintf(r->path, sizeof(r->path), "%s",
+             info->dlpi_name && *info->dlpi_name ? info->dlpi_name : "/proc/self/exe");
+    return 1;
+}
+#endif
+
+// where the runtime (the executable or shared library we're in) is loaded, and its identity
+static bool getRuntime(SnapshotHeader *hd) {
+#ifdef __linux__
+    RuntimeRange r;
+    memset(&r, 0, sizeof(r));
+    r.anchor = (uintptr_t)&getRuntime;
+    if (!dl_iterate_phdr(findRuntime, &r))
+        return false;
+    struct stat st;
+    if (stat(r.path, &st))
+        return false;
+    hd->runtimeStart = r.start;
+    hd->runtimeEnd = r.end;
+    hd->runtimeId = (uint64_t)st.st_size * 1000003 ^ (uint64_t)st.st_mtime;
+    return true;
+#else
+    return false;
+#endif
+}
+
+static bool fillHeader(SnapshotHeader *hd) {
+    memset(hd, 0, sizeof(*hd));
+    if (!getRuntime(hd))
+        return false;
+    hd->magic = SNAPSHOT_MAGIC;
+    hd->version = SNAPSHOT_VERSION;
+    hd->imageStamp = vmCurrent->img->contentStamp;
+    hd->imageStart = (uintptr_t)vmCurrent->img->dataStart;
+    hd->imageEnd = (uintptr_t)vmCurrent->img->dataEnd;
+    uint8_t *pstart, *pend;
+    gcPreallocRange(&pstart, &pend);
+    hd->preallocStart = (uintptr_t)pstart;
+    hd->preallocEnd = (uintptr_t)pend;
+    return true;
+}
+
+// FNV-1a; a torn or corrupted file must not turn into writes all over memory
+static uint64_t hashBytes(uint64_t h, const void *data, size_t size) {
+    auto p = (const uint8_t *)data;
+    while (size--)
+        h = (h ^ *p++) * 0x100000001b3ULL;
+    return h;
+}
+
+#define HASH_INIT 0xcbf29ce484222325ULL
+
+static void writeHashed(FILE *fp, const void *data, size_t size, SnapshotHeader *hd) {
+    fwrite(data, size, 1, fp);
+    hd->hash = hashBytes(hd->hash, data, size);
+    hd->payloadSize += size;
+}
+
+static uint64_t headerHash(const SnapshotHeader *hd, uint64_t payloadHash) {
+    SnapshotHeader tmp = *hd;
+    tmp.hash = 0;
+    return hashBytes(payloadHash, &tmp, sizeof(tmp));
+}
+
+static uintptr_t relocate(uintptr_t w) {
+    if (w - relocStart < relocEnd - relocStart)
+        return w + relocDelta;
+    return w;
+}
+
+void registerSnapshotState(const char *name, void *data, uint32_t size, bool *restored) {
+    if (numStates >= SNAPSHOT_MAX_STATES || strlen(name) >= SNAPSHOT_NAME_LENGTH)
+        target_panic(PANIC_INTERNAL_ERROR);
+    states[numStates++] = {name, data, size, restored};
+    for (int i = 0; i < numPendingStates; ++i) {
+        auto p = &pendingStates[i];
+        if (p->size == size && !strcmp(p->name, name)) {
+            memcpy(data, p->data, size);
+            if (restored)
+                *restored = true;
+            xfree(p->data);
+            free((void *)p->name); // from strdup()
+            *p = pendingStates[--numPendingStates];
+            break;
+        }
+    }
+}
+
+static void clearPendingStates() {
+    for (int i = 0; i < numPendingStates; ++i) {
+        xfree(pendingStates[i].data);
+        free((void *)pendingStates[i].name);
+    }
+    numPendingStates = 0;
+}
+
+// Called when the top-level code of the program is done.
+void vmSnapshotSave() {
+    if (!isEnabled())
+        return;
+
+    for (auto f = vmCurrent->allFibers; f; f = f->next)
+        if (f->instructions) {
+            DMESG("snapshot: not saved; other fibers already ran");
+            return;
+        }
+
+    SnapshotHeader hd;
+    if (!fillHeader(&hd)) {
+        DMESG("snapshot: not supported here");
+        return;
+    }
+    auto path = vmcache::snapshotPath(vmCurrent->img->infoHeader->programHash);
+    if (!path)
+        return;
+
+    auto startTime = current_time_us();
+    gc(0);
+
+    GCBlockInfo blocks[SNAPSHOT_MAX_BLOCKS];
+    int numBlocks = gcGetBlocks(blocks, SNAPSHOT_MAX_BLOCKS);
+    if (numBlocks > SNAPSHOT_MAX_BLOCKS) {
+        DMESG("snapshot: not saved; %d heap blocks", numBlocks);
+        free(path);
+        return;
+    }
+
+    auto roots = gcGetRoots();
+    auto rootData = roots->getData();
+    for (unsigned i = 0; i < roots->getLength(); ++i) {
+        auto r = (uintptr_t)rootData[i];
+        // static variables can only be restored when they are in the runtime binary
+        if ((r & 1) && isReadOnly((TValue)(r & ~1)) &&
+            r - hd.runtimeStart >= hd.runtimeEnd - hd.runtimeStart) {
+            DMESG("snapshot: not saved; GC root at %p", (void *)(r & ~1));
+            free(path);
+            return;
+        }
+    }
+
+    hd.globals = (uintptr_t)vmCurrent->globals;
+    hd.handlerBindings = (uintptr_t)getHandlerBindings();
+    hd.numBlocks = numBlocks;
+    hd.numRoots = roots->getLength();
+    for (auto f = vmCurrent->allFibers; f; f = f->next)
+        hd.numFibers++;
+    hd.numStates = numStates;
+
+    auto tmpPath = (char *)malloc(strlen(path) + 5);
+    strcpy(tmpPath, path);
+    strcat(tmpPath, ".tmp");
+    auto fp = fopen(tmpPath, "wb");
+    if (!fp) {
+        DMESG("snapshot: cannot write %s", tmpPath);
+        free(tmpPath);
+        free(path);
+        return;
+    }
+
+    // the header goes first, and again with the hash once the rest is written
+    hd.hash = HASH_INIT;
+    fwrite(&hd, sizeof(hd), 1, fp);
+    for (int i = 0; i < numBlocks; ++i) {
+        SnapshotBlock b = {(uintptr_t)blocks[i].addr, blocks[i].size, 0};
+        writeHashed(fp, &b, sizeof(b), &hd);
+    }
+    for (int i = 0; i < numBlocks; ++i)
+        writeHashed(fp, blocks[i].addr, blocks[i].size, &hd);
+    for (unsigned i = 0; i < hd.numRoots; ++i) {
+        auto r = (uintptr_t)rootData[i];
+        SnapshotRoot sr = {r, 0};
+        if ((r & 1) && isReadOnly((TValue)(r & ~1)))
+            sr.value = (uintptr_t) * (TValue *)(r & ~1);
+        writeHashed(fp, &sr, sizeof(sr), &hd);
+    }
+    for (auto f = vmCurrent->allFibers; f; f = f->next) {
+        // see setupThread()
+        SnapshotFiber sf = {(uintptr_t)f->currAction, (uintptr_t)f->sp[2], f->foreverPC != NULL,
+                            0};
+        writeHashed(fp, &sf, sizeof(sf), &hd);
+    }
+    for (int i = 0; i < numStates; ++i) {
+        SnapshotStateHeader sh;
+        memset(&sh, 0, sizeof(sh));
+        strcpy(sh.name, states[i].name);
+        sh.size = states[i].size;
+        writeHashed(fp, &sh, sizeof(sh), &hd);
+        writeHashed(fp, states[i].data, states[i].size, &hd);
+    }
+    hd.hash = headerHash(&hd, hd.hash);
+    fseek(fp, 0, SEEK_SET);
+    fwrite(&hd, sizeof(hd), 1, fp);
+
+    bool ok = !ferror(fp);
+    ok = !fclose(fp) && ok;
+    if (ok && rename(tmpPath, path) == 0) {
+        DMESG("snapshot: saved %d heap blocks, %d fibers to %s in %d us", numBlocks, hd.numFibers,
+              path, (int)(current_time_us() - startTime));
+        vmcache::snapshotSaved(vmCurrent->img->infoHeader->programHash);
+    } else {
+        DMESG("snapshot: cannot write %s", path);
+        remove(tmpPath);
+    }
+    free(tmpPath);
+    free(path);
+}
+
+static uint8_t *readSnapshot(const char *path, long *size) {
+    auto fp = fopen(path, "rb");
+    if (!fp)
+        return NULL;
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    auto data = (uint8_t *)xmalloc(*size + 1);
+    if (*size < (long)sizeof(SnapshotHeader) || fread(data, *size, 1, fp) != 1) {
+        xfree(data);
+        data = NULL;
+    }
+    fclose(fp);
+    return data;
+}
+
+static const char *checkHeader(SnapshotHeader *saved, long size) {
+    SnapshotHeader hd;
+    if (!fillHeader(&hd))
+        return "not supported here";
+    if (saved->magic != SNAPSHOT_MAGIC || saved->version != SNAPSHOT_VERSION)
+        return "old format";
+    if (saved->imageStamp != hd.imageStamp || saved->runtimeId != hd.runtimeId ||
+        saved->runtimeEnd - saved->runtimeStart != hd.runtimeEnd - hd.runtimeStart)
+        return "different image or runtime";
+    if (saved->imageStart != hd.imageStart || saved->preallocStart != hd.preallocStart ||
+        saved->preallocEnd != hd.preallocEnd)
+        return "image loaded at a different address";
+    if (saved->payloadSize != (uint64_t)size - sizeof(SnapshotHeader) ||
+        saved->hash != headerHash(saved, hashBytes(HASH_INIT, saved + 1, saved->payloadSize)))
+        return "damaged";
+    if (saved->numBlocks > SNAPSHOT_MAX_BLOCKS || saved->numStates > SNAPSHOT_MAX_STATES)
+        return "invalid";
+    auto blocks = (SnapshotBlock *)(saved + 1);
+    long expected = sizeof(SnapshotHeader) + saved->numBlocks * sizeof(SnapshotBlock);
+    if (expected > size)
+        return "truncated";
+    for (unsigned i = 0; i < saved->numBlocks; ++i)
+        expected += blocks[i].size;
+    auto roots = (SnapshotRoot *)((uint8_t *)saved + expected);
+    expected += saved->numRoots * sizeof(SnapshotRoot) + saved->numFibers * sizeof(SnapshotFiber);
+    if (expected > size)
+        return "truncated";
+    // static variables are written to directly; as in vmSnapshotSave(), they have to be in the
+    // runtime binary
+    for (unsigned i = 0; i < saved->numRoots; ++i) {
+        auto r = (uintptr_t)roots[i].root;
+        if ((r & 1) && isReadOnly((TValue)(r & ~1)) &&
+            (r & ~1) - saved->runtimeStart >= saved->runtimeEnd - saved->runtimeStart)
+            return "GC root outside of the runtime";
+    }
+    relocStart = saved->runtimeStart;
+    relocEnd = saved->runtimeEnd;
+    relocDelta = hd.runtimeStart - saved->runtimeStart;
+    return NULL;
+}
+
+// Called instead of starting the top-level code; returns false for a cold start.
+bool vmSnapshotRestore() {
+    clearPendingStates();
+    if (!isEnabled())
+        return false;
+    auto path = vmcache::snapshotPath(vmCurrent->img->infoHeader->programHash);
+    if (!path)
+        return false;
+
+    auto startTime = current_time_us();
+    long size;
+    auto data = readSnapshot(path, &size);
+    if (!data) {
+        DMESG("snapshot: none for this program");
+        free(path);
+        return false;
+    }
+
+    auto hd = (SnapshotHeader *)data;
+    auto err = checkHeader(hd, size);
+    if (err) {
+        DMESG("snapshot: cold start; %s", err);
+        xfree(data);
+        free(path);
+        return false;
+    }
+
+    auto savedBlocks = (SnapshotBlock *)(hd + 1);
+    GCBlockInfo blocks[SNAPSHOT_MAX_BLOCKS];
+    for (unsigned i = 0; i < hd->numBlocks; ++i) {
+        blocks[i].addr = (void *)(uintptr_t)savedBlocks[i].addr;
+        blocks[i].size = savedBlocks[i].size;
+    }
+    if (!gcRestoreBlocks(blocks, hd->numBlocks)) {
+        DMESG("snapshot: cold start; heap layout differs");
+        xfree(data);
+        free(path);
+        return false;
+    }
+
+    // from here on, there's no going back
+    auto p = (uint8_t *)(savedBlocks + hd->numBlocks);
+    for (unsigned i = 0; i < hd->numBlocks; ++i) {
+        memcpy(blocks[i].addr, p, blocks[i].size);
+        p += blocks[i].size;
+    }
+    gcRestoreDone(relocDelta ? relocate : NULL);
+
+    vmCurrent->globals = (TValue *)(uintptr_t)hd->globals;
+    setHandlerBindings((HandlerBinding *)(uintptr_t)hd->handlerBindings);
+
+    auto roots = gcGetRoots();
+    auto savedRoots = (SnapshotRoot *)p;
+    for (unsigned i = 0; i < hd->numRoots; ++i) {
+        auto r = (uintptr_t)savedRoots[i].root;
+        if ((r & 1) && isReadOnly((TValue)(r & ~1))) {
+            // a static variable of the runtime
+            r = relocate(r & ~1);
+            *(TValue *)r = (TValue)relocate((uintptr_t)savedRoots[i].value);
+            r |= 1;
+        } else if (!(r & 1)) {
+            r = relocate(r);
+        }
+        bool found = false;
+        for (unsigned j = 0; j < roots->getLength(); ++j)
+            if ((uintptr_t)roots->get(j) == r)
+                found = true;
+        if (!found)
+            roots->push((TValue)r);
+    }
+    p = (uint8_t *)(savedRoots + hd->numRoots);
+
+    auto savedFibers = (SnapshotFiber *)p;
+    for (unsigned i = 0; i < hd->numFibers; ++i) {
+        auto sf = &savedFibers[i];
+        auto f = setupThread((TValue)relocate((uintptr_t)sf->action),
+                             (TValue)relocate((uintptr_t)sf->arg));
+        if (sf->forever)
+            f->foreverPC = f->resumePC;
+    }
+    p = (uint8_t *)(savedFibers + hd->numFibers);
+
+    for (unsigned i = 0; i < hd->numStates && p + sizeof(SnapshotStateHeader) <= data + size;
+         ++i) {
+        auto sh = (SnapshotStateHeader *)p;
+        p += sizeof(*sh);
+        if (p + sh->size > data + size)
+            break;
+        sh->name[SNAPSHOT_NAME_LENGTH - 1] = 0;
+        int j;
+        for (j = 0; j < numStates; ++j)
+            if (states[j].size == sh->size && !strcmp(states[j].name, sh->name)) {
+                memcpy(states[j].data, p, sh->size);
+                if (states[j].restored)
+                    *states[j].restored = true;
+                break;
+            }
+        if (j == numStates && numPendingStates < SNAPSHOT_MAX_STATES) {
+            auto ps = &pendingStates[numPendingStates++];
+            ps->name = strdup(sh->name);
+            ps->size = sh->size;
+            ps->data = xmalloc(sh->size);
+            memcpy(ps->data, p, sh->size);
+        }
+        p += sh->size;
+    }
+
+    // rebuild free lists
+    gc(0);
+
+    DMESG("snapshot: restored %d heap blocks, %d fibers in %d us", hd->numBlocks, hd->numFibers,
+          (int)(current_time_us() - startTime));
+    xfree(data);
+    free(path);
+    return true;
+}
+
+} // namespace pxt
@@ -5,6 +5,7 @@ interface SpriteLike {
 
     __update(camera: scene.Camera, dt: number): void;
     __draw(camera: scene.Camera): void;
+    __drawBatched(camera: scene.Camera, batch: image.Batch): boolean;
     __serialize(offset: number): Buffer;
 }
 
@@ -30,8 +31,11 @@ namespace sprites {
 
         set z(v: number) {
             if (this._z !== v) {
+                const old = this._z;
                 this._z = v;
-                game.currentScene().flags |= scene.Flag.NeedsSorting;
+                // sprites get their id when they are added to the scene
+                if (this.id !== undefined)
+                    game.currentScene().__spriteZChanged(this, old);
             }
         }
 
@@ -43,6 +47,14 @@ namespace sprites {
 
         __drawCore(camera: scene.Camera) { }
 
+        /**
+         * Adds the sprite to the batch instead of drawing it, when that is all __draw() would do;
+         * returns false if the sprite needs to be drawn with __draw()
+         */
+        __drawBatched(camera: scene.Camera, batch: image.Batch): boolean {
+            return false;
+        }
+
         __update(camera: scene.Camera, dt: number) { }
 
         __serialize(offset: number): Buffer { return undefined }
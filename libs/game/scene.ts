@@ -85,6 +85,7 @@ namespace scene {
         particleSources: particles.ParticleSource[];
         controlledSprites: controller.ControlledSprite[][];
         followingSprites: sprites.FollowingSprite[];
+        private spriteBatch: image.Batch;
 
         private _millis: number;
         private _data: any;
@@ -118,6 +119,7 @@ namespace scene {
             power.poke(); // keep game alive a little more
             this.allSprites = [];
             this.spriteNextId = 0;
+            this.spriteBatch = new image.Batch();
             // update controller state
             this.eventContext.registerFrameHandler(CONTROLLER_PRIORITY, () => {
                 this._millis += this.eventContext.deltaTimeMillis;
@@ -179,8 +181,52 @@ namespace scene {
         }
 
         addSprite(sprite: SpriteLike) {
-            this.allSprites.push(sprite);
             sprite.id = this.spriteNextId++;
+            // ids only go up, so the new sprite goes after all the others with the same z
+            if (this.flags & (Flag.NeedsSorting | Flag.IsRendering)) {
+                this.allSprites.push(sprite);
+                this.flags |= Flag.NeedsSorting;
+            } else {
+                this.allSprites.insertAt(this.spriteIndexAfter(sprite.z, sprite.id), sprite);
+            }
+        }
+
+        // Returns the index of the first sprite that sorts after (z, id); the moved sprite, if any,
+        // is taken to be still at movedZ.
+        private spriteIndexAfter(z: number, id: number, moved?: SpriteLike, movedZ?: number) {
+            let l = 0;
+            let r = this.allSprites.length;
+            while (l < r) {
+                const m = (l + r) >> 1;
+                const s = this.allSprites[m];
+                const sz = s === moved ? movedZ : s.z;
+                if (sz > z || (sz == z && s.id > id))
+                    r = m;
+                else
+                    l = m + 1;
+            }
+            return l;
+        }
+
+        /**
+         * Moves the sprite to its new place in the drawing order, rather than sorting all the
+         * sprites again before the next frame
+         */
+        __spriteZChanged(sprite: SpriteLike, oldZ: number) {
+            if (!this.allSprites) return;
+            // the array can't change while it's being drawn
+            if (this.flags & (Flag.NeedsSorting | Flag.IsRendering)) {
+                this.flags |= Flag.NeedsSorting;
+                return;
+            }
+            const i = this.spriteIndexAfter(oldZ, sprite.id, sprite, oldZ) - 1;
+            if (i < 0 || this.allSprites[i] !== sprite) {
+                // not in this scene, or out of order
+                this.flags |= Flag.NeedsSorting;
+                return;
+            }
+            this.allSprites.removeAt(i);
+            this.allSprites.insertAt(this.spriteIndexAfter(sprite.z, sprite.id), sprite);
         }
 
         destroy() {
@@ -225,9 +271,15 @@ namespace scene {
             }
 
             control.enablePerfCounter("sprite draw")
+            // runs of plain sprites are drawn with one call
+            const batch = this.spriteBatch;
             for (const s of this.allSprites) {
-                s.__draw(this.camera);
+                if (!s.__drawBatched(this.camera, batch)) {
+                    batch.drawTo(screen);
+                    s.__draw(this.camera);
+                }
             }
+            batch.drawTo(screen);
 
             this.flags &= ~scene.Flag.IsRendering;
         }
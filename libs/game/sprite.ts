@@ -606,6 +606,20 @@ class Sprite extends sprites.BaseSprite {
         return this.right - ox < 0 || this.bottom - oy < 0 || this.left - ox > screen.width || this.top - oy > screen.height;
     }
 
+    // Only sprites from sprites.create() are batched; subclasses may override __draw() or
+    // __drawCore().
+    __drawBatched(camera: scene.Camera, batch: image.Batch): boolean {
+        if (!(this.flags & sprites.Flag.Batched)) return false;
+        // the physics text and debug boxes are drawn by __drawCore()
+        if ((this.flags & SpriteFlag.ShowPhysics) || game.debug) return false;
+        if (!this.__visible() || this.isOutOfScreen(camera)) return true;
+
+        const ox = (this.flags & sprites.Flag.RelativeToCamera) ? 0 : camera.drawOffsetX;
+        const oy = (this.flags & sprites.Flag.RelativeToCamera) ? 0 : camera.drawOffsetY;
+        batch.add(this._image, this.left - ox, this.top - oy);
+        return true;
+    }
+
     __drawCore(camera: scene.Camera) {
         if (this.isOutOfScreen(camera)) return;
 
@@ -36,6 +36,8 @@ namespace sprites {
     export function create(img: Image, kind?: number): Sprite {
         const scene = game.currentScene();
         const sprite = new Sprite(img)
+        // a plain Sprite, not a subclass with its own drawing
+        sprite.flags |= sprites.Flag.Batched;
         sprite.setKind(kind);
         scene.physicsEngine.addSprite(sprite);
 
@@ -159,6 +161,7 @@ namespace sprites {
         ShowPhysics = 1 << 6, // display position, velocity, acc
         Invisible = 1 << 7, // makes the sprite invisible, so it does not show up on the screen
         IsClipping = 1 << 8, // whether the sprite is currently clipping into a wall. This can happen when a sprite is created or moved explicitly.
-        RelativeToCamera = 1 << 9 // draw relative to the camera, not the world (e.g. HUD elements)
+        RelativeToCamera = 1 << 9, // draw relative to the camera, not the world (e.g. HUD elements)
+        Batched = 1 << 10, // only drawn by Sprite.__drawCore(), so it can be added to a draw batch
     }
 }
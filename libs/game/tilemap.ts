@@ -99,6 +99,16 @@ namespace tiles {
     const TM_DATA_PREFIX_LENGTH = 4;
     const TM_WALL = 2;
 
+    //% shim=tiles::_drawTilemap
+    declare function _drawTilemap(img: Image, map: Buffer, tiles: Image[], args: Buffer): void;
+
+    //% shim=tiles::_isWallInRect
+    declare function _isWallInRect(map: Buffer, walls: Image, xy0: number, xy1: number): boolean;
+
+    function pack(x: number, y: number) {
+        return (Math.clamp(-30000, 30000, x | 0) & 0xffff) | (Math.clamp(-30000, 30000, y | 0) << 16)
+    }
+
     export class TileMapData {
         // The tile data for the map (indices into tileset)
         protected data: Buffer;
@@ -113,6 +123,8 @@ namespace tiles {
         protected _width: number;
         protected _height: number;
 
+        protected drawArgs: Buffer;
+
         constructor(data: Buffer, layers: Image, tileset: Image[], scale: TileScale) {
             this.data = data;
             this.layers = layers;
@@ -179,6 +191,30 @@ namespace tiles {
             return cachedImage;
         }
 
+        // the tileset, with the tiles larger than the tile size cropped
+        getTileViews(): Image[] {
+            for (let i = 0; i < this.tileset.length; ++i)
+                if (!this.cachedTileView[i])
+                    this.getTileImage(i);
+            return this.cachedTileView;
+        }
+
+        // draws the tiles from (offsetX, offsetY) in the map at the top-left corner of target
+        draw(target: Image, offsetX: number, offsetY: number, scale: TileScale) {
+            // keep in sync with screen/tilemap.cpp, struct TilemapArgs
+            if (!this.drawArgs)
+                this.drawArgs = control.createBuffer(12);
+            this.drawArgs.setNumber(NumberFormat.Int32LE, 0, offsetX);
+            this.drawArgs.setNumber(NumberFormat.Int32LE, 4, offsetY);
+            this.drawArgs.setNumber(NumberFormat.Int32LE, 8, scale);
+            _drawTilemap(target, this.data, this.getTileViews(), this.drawArgs);
+        }
+
+        // whether any tile in columns left..right and rows top..bottom is a wall or outside the map
+        isWallInRect(left: number, top: number, right: number, bottom: number) {
+            return _isWallInRect(this.data, this.layers, pack(left, top), pack(right, bottom));
+        }
+
         setWall(col: number, row: number, on: boolean) {
             return this.layers.setPixel(col, row, on ? TM_WALL : 0);
         }
@@ -322,19 +358,7 @@ namespace tiles {
             const y0 = Math.max(0, camera.drawOffsetY >> this.scale);
             const yn = Math.min(this._map.height, ((camera.drawOffsetY + target.height) >> this.scale) + 1);
 
-            for (let x = x0; x <= xn; ++x) {
-                for (let y = y0; y <= yn; ++y) {
-                    const index = this._map.getTile(x, y);
-                    const tile = this._map.getTileImage(index);
-                    if (tile) {
-                        target.drawTransparentImage(
-                            tile,
-                            ((x - x0) << this.scale) - offsetX,
-                            ((y - y0) << this.scale) - offsetY
-                        );
-                    }
-                }
-            }
+            this._map.draw(target, camera.drawOffsetX, camera.drawOffsetY, this.scale);
 
             if (game.debug) {
                 // render debug grid overlay
@@ -386,22 +410,15 @@ namespace tiles {
         }
 
         public isOnWall(s: Sprite) {
+            if (!this.enabled) return false;
             const hbox = s._hitbox;
 
-            const left = Fx.toIntShifted(hbox.left, this.scale);
-            const right = Fx.toIntShifted(hbox.right, this.scale);
-            const top = Fx.toIntShifted(hbox.top, this.scale);
-            const bottom = Fx.toIntShifted(hbox.bottom, this.scale);
-
-            for (let col = left; col <= right; ++col) {
-                for (let row = top; row <= bottom; ++row) {
-                    if (this.isObstacle(col, row)) {
-                        return true;
-                    }
-                }
-            }
-
-            return false;
+            return this._map.isWallInRect(
+                Fx.toIntShifted(hbox.left, this.scale),
+                Fx.toIntShifted(hbox.top, this.scale),
+                Fx.toIntShifted(hbox.right, this.scale),
+                Fx.toIntShifted(hbox.bottom, this.scale)
+            );
         }
 
         public getTileImage(index: number) {
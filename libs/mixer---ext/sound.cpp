@@ -12,9 +12,11 @@ DLLEXPORT void pxt_get_audio_samples(int16_t *buf, unsigned numSamples) {
         return;
     }
 
+    PXT_TRACE_BEGIN("fillSamples");
     target_disable_irq();
     dac->src.fillSamples(buf, numSamples);
     target_enable_irq();
+    PXT_TRACE_END("fillSamples");
 
     for (unsigned i = 0; i < numSamples; ++i) {
         // playing at half-volume
@@ -30,9 +30,11 @@ void *LinuxDAC::play(void *self) {
     DMESG("PCM state: %s", snd_pcm_state_name(snd_pcm_state(pcm_handle)));
 
     for (;;) {
+        PXT_TRACE_BEGIN("fillSamples");
         target_disable_irq();
         auto hasData = dac->src.fillSamples(dac->data, sizeof(dac->data) / 2);
         target_enable_irq();
+        PXT_TRACE_END("fillSamples");
         auto len = (int)sizeof(dac->data) / 2;
         if (!hasData) {
             sleep_core_us(5000);
@@ -1,17 +1,119 @@
 #include "pxt.h"
 
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#ifndef __MINGW32__
+#include <sys/mman.h>
+#endif
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+// There are two ways for the host to get the pixels:
+//
+// - pxt_screen_get_pixels() converts the current frame to 32-bit ARGB for the caller; the VM
+//   waits for the host to pick up a frame before drawing the next one
+// - the shared-memory transport: pxt_screen_shm_open() (or PXT_SCREEN_SHM=<name> in the
+//   environment) makes the VM publish raw 4bpp frames with their palette into a ring in shared
+//   memory, without ever waiting for the host; the host sends events back through an input
+//   ring in the same mapping
+//
+// Shared memory layout (all little-endian, offsets in bytes):
+//
+// ScreenShmHeader at 0, then numFrames frames of frameSize bytes each at framesOffset. Each
+// frame is a ScreenShmFrame followed by the pixels in the Image format: column by column, two
+// pixels per byte, the upper one in the low nibble.
+//
+// Only the columns changed since a slot was last used are written to it; dirtyX, dirtyY,
+// dirtyWidth and dirtyHeight of a frame say which part differs from the previous frame (the whole
+// frame when the palette changes).
+//
+// Reading a frame: s = frameSeq; frame = s % numFrames; check frame.seq == s, copy it, and
+// check frame.seq == s again (otherwise the VM has reused the slot meanwhile; start over).
+//
+// Sending an event: if inputWritePos - inputReadPos < SCREEN_SHM_INPUT_SIZE, fill in
+// input[inputWritePos % SCREEN_SHM_INPUT_SIZE], then increment inputWritePos (with release
+// semantics). On Linux also FUTEX_WAKE inputWritePos, otherwise it's picked up within 2ms.
+
+#define SCREEN_SHM_MAGIC 0x4d485350 // PSHM
+#define SCREEN_SHM_VERSION 2
+#define SCREEN_SHM_NUM_FRAMES 4
+#define SCREEN_SHM_INPUT_SIZE 256
+
 namespace pxt {
+
+struct ScreenShmFrame {
+    uint32_t seq; // 0 while being written
+    uint32_t width;
+    uint32_t height;
+    uint32_t pixLength;
+    uint16_t dirtyX, dirtyY, dirtyWidth, dirtyHeight;
+    uint32_t palette[16]; // ARGB
+};
+
+// union of rectangles; empty when x0 >= x1
+struct DirtyRect {
+    int x0, y0, x1, y1;
+
+    bool isEmpty() { return x0 >= x1; }
+    void clear() { x0 = y0 = x1 = y1 = 0; }
+    void add(int x, int y, int w, int h) {
+        if (w <= 0 || h <= 0)
+            return;
+        if (isEmpty()) {
+            x0 = x, y0 = y, x1 = x + w, y1 = y + h;
+        } else {
+            x0 = min(x0, x), y0 = min(y0, y);
+            x1 = max(x1, x + w), y1 = max(y1, y + h);
+        }
+    }
+};
+
+struct ScreenShmInput {
+    int32_t source;
+    int32_t value;
+};
+
+struct ScreenShmHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t numFrames;
+    uint32_t frameSize;
+    uint32_t framesOffset;
+    uint32_t frameSeq;       // last complete frame; written by the VM
+    uint32_t inputWritePos;  // written by the host
+    uint32_t inputReadPos;   // written by the VM
+    uint32_t inputOverflows; // written by the host
+    uint32_t reserved[5];
+    ScreenShmInput input[SCREEN_SHM_INPUT_SIZE];
+};
+
+static const char *screenShmName;
+static ScreenShmHeader *screenShm;
+// changes not yet written to each frame slot
+static DirtyRect screenShmDirty[SCREEN_SHM_NUM_FRAMES];
+
 class WDisplay {
   public:
     uint32_t currPalette[16];
     bool newPalette, dataWaiting;
     uint8_t *screenBuf;
+    // changes in screenBuf not yet picked up by pxt_screen_get_pixels()
+    DirtyRect dirty;
+    // only compared with, not a GC root
+    Image_ lastImg;
 
     int width, height;
 
     WDisplay();
     void updateLoop();
     void update(Image_ img);
+    void initScreenShm();
+    void publishFrame(Image_ img, int x, int y, int w, int h);
 };
 
 SINGLETON(WDisplay);
@@ -22,6 +124,124 @@ WDisplay::WDisplay() {
     DMESG("init display: %dx%d", width, height);
     screenBuf = new uint8_t[width * height / 2 + 20];
     newPalette = false;
+    dirty.clear();
+    lastImg = NULL;
+#ifdef PXT_VM
+    // the host has to be sent the restored palette
+    registerSnapshotState("palette", currPalette, sizeof(currPalette), &newPalette);
+#endif
+    if (screenShmName || getenv("PXT_SCREEN_SHM"))
+        initScreenShm();
+}
+
+static void *screenShmInputLoop(void *) {
+    auto hdr = screenShm;
+    for (;;) {
+        uint32_t readPos = hdr->inputReadPos;
+        uint32_t writePos = __atomic_load_n(&hdr->inputWritePos, __ATOMIC_ACQUIRE);
+        if (readPos == writePos) {
+#ifdef __linux__
+            struct timespec timeout = {0, 100 * 1000 * 1000};
+            // not FUTEX_PRIVATE - the host may be another process
+            syscall(SYS_futex, &hdr->inputWritePos, FUTEX_WAIT, writePos, &timeout, NULL, 0);
+#else
+            sleep_core_us(2000);
+#endif
+            continue;
+        }
+        while (readPos != writePos) {
+            auto ev = &hdr->input[readPos % SCREEN_SHM_INPUT_SIZE];
+            raiseEvent(ev->source, ev->value);
+            readPos++;
+        }
+        __atomic_store_n(&hdr->inputReadPos, readPos, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+void WDisplay::initScreenShm() {
+    uint32_t pixLength = width * ((height + 1) >> 1);
+    uint32_t frameSize = (sizeof(ScreenShmFrame) + pixLength + 63) & ~63;
+    uint32_t framesOffset = (sizeof(ScreenShmHeader) + 63) & ~63;
+    size_t size = framesOffset + SCREEN_SHM_NUM_FRAMES * frameSize;
+
+    void *mem = NULL;
+#ifdef __MINGW32__
+    // no POSIX shared memory; only usable by a host in the same process
+    mem = xmalloc(size);
+#else
+    auto name = screenShmName ? screenShmName : getenv("PXT_SCREEN_SHM");
+    if (name && *name) {
+        int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+        if (fd < 0 || ftruncate(fd, size) < 0) {
+            DMESG("cannot create shared memory %s", name);
+            if (fd >= 0)
+                close(fd);
+            return;
+        }
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+    } else {
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    }
+    if (mem == MAP_FAILED) {
+        DMESG("cannot map shared memory for the screen");
+        return;
+    }
+#endif
+
+    auto hdr = (ScreenShmHeader *)mem;
+    memset(hdr, 0, size);
+    hdr->version = SCREEN_SHM_VERSION;
+    hdr->width = width;
+    hdr->height = height;
+    hdr->numFrames = SCREEN_SHM_NUM_FRAMES;
+    hdr->frameSize = frameSize;
+    hdr->framesOffset = framesOffset;
+    for (int i = 0; i < SCREEN_SHM_NUM_FRAMES; ++i) {
+        screenShmDirty[i].clear();
+        screenShmDirty[i].add(0, 0, width, height);
+    }
+    // the host waits for this
+    __atomic_store_n(&hdr->magic, SCREEN_SHM_MAGIC, __ATOMIC_RELEASE);
+    screenShm = hdr;
+
+    pthread_t pid;
+    pthread_create(&pid, NULL, screenShmInputLoop, NULL);
+    pthread_detach(pid);
+
+    DMESG("screen shared memory: %d bytes", (int)size);
+}
+
+// x, y, w, h is the part changed since the previous frame
+void WDisplay::publishFrame(Image_ img, int x, int y, int w, int h) {
+    auto hdr = screenShm;
+    uint32_t seq = hdr->frameSeq + 1;
+    if (seq == 0)
+        seq = 1; // 0 marks a frame being written
+    for (int i = 0; i < SCREEN_SHM_NUM_FRAMES; ++i)
+        screenShmDirty[i].add(x, y, w, h);
+    auto slot = seq % hdr->numFrames;
+    auto frame =
+        (ScreenShmFrame *)((uint8_t *)hdr + hdr->framesOffset + slot * hdr->frameSize);
+    __atomic_store_n(&frame->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    frame->width = width;
+    frame->height = height;
+    frame->pixLength = img->pixLength();
+    frame->dirtyX = x;
+    frame->dirtyY = y;
+    frame->dirtyWidth = w;
+    frame->dirtyHeight = h;
+    memcpy(frame->palette, currPalette, sizeof(currPalette));
+    auto d = &screenShmDirty[slot];
+    if (!d->isEmpty()) {
+        auto bh = img->byteHeight();
+        memcpy((uint8_t *)(frame + 1) + d->x0 * bh, img->pix(d->x0, 0), (d->x1 - d->x0) * bh);
+        d->clear();
+    }
+    __atomic_store_n(&frame->seq, seq, __ATOMIC_RELEASE);
+    __atomic_store_n(&hdr->frameSeq, seq, __ATOMIC_RELEASE);
 }
 
 //% expose
@@ -51,6 +271,9 @@ void setPalette(Buffer buf) {
 static pthread_mutex_t screenMutex;
 static pthread_cond_t dataBroadcast;
 static int numGetPixels;
+// the buffer passed to the previous pxt_screen_get_pixels(), and what was updated in it
+static uint32_t *lastScreen;
+static DirtyRect lastGetPixels;
 
 DLLEXPORT void pxt_screen_get_pixels(int width, int height, uint32_t *screen) {
     auto disp = instWDisplay;
@@ -65,6 +288,7 @@ DLLEXPORT void pxt_screen_get_pixels(int width, int height, uint32_t *screen) {
         return;
     }
 
+    PXT_TRACE_BEGIN("getPixels");
     pthread_mutex_lock(&screenMutex);
     if (!disp->dataWaiting) {
         struct timespec timeout = {0, 100 * 1000 * 1000}; // up to 100ms
@@ -72,18 +296,28 @@ DLLEXPORT void pxt_screen_get_pixels(int width, int height, uint32_t *screen) {
     }
     if (width != disp->width || height != disp->height)
         target_panic(PANIC_SCREEN_ERROR);
-    if (panicCode > 0) {
+    lastGetPixels.clear();
+    if (vmCurrent->panicCode > 0) {
         int n = width * height;
         uint32_t *p = screen;
         // blue screen
         while (n--)
             *p++ = 0xff0000ff;
+        lastGetPixels.add(0, 0, width, height);
+        lastScreen = NULL;
     } else {
-        auto sp = disp->screenBuf;
+        // the host buffer still has the previous frame if it's the same one
+        if (screen != lastScreen)
+            disp->dirty.add(0, 0, width, height);
+        lastScreen = screen;
+        auto d = &disp->dirty;
+        // rows are converted in pairs
+        int y0 = d->y0 & ~1, y1 = (d->y1 + 1) & ~1;
         auto pal = disp->currPalette;
-        for (int x = 0; x < width; ++x) {
-            uint32_t *p = screen + x;
-            for (int y = 0; y < (height >> 1); ++y) {
+        for (int x = d->x0; x < d->x1; ++x) {
+            auto sp = disp->screenBuf + x * (height >> 1) + (y0 >> 1);
+            uint32_t *p = screen + x + y0 * width;
+            for (int y = y0; y < y1; y += 2) {
                 uint8_t v = *sp++;
                 *p = pal[v & 0xf];
                 p += width;
@@ -91,10 +325,13 @@ DLLEXPORT void pxt_screen_get_pixels(int width, int height, uint32_t *screen) {
                 p += width;
             }
         }
+        lastGetPixels = *d;
+        d->clear();
     }
     pthread_cond_broadcast(&dataBroadcast);
     disp->dataWaiting = false;
     pthread_mutex_unlock(&screenMutex);
+    PXT_TRACE_END("getPixels");
 }
 
 void WDisplay::update(Image_ img) {
@@ -104,18 +341,43 @@ void WDisplay::update(Image_ img) {
     if (img->bpp() != 4 || img->width() != width || img->height() != height)
         target_panic(PANIC_SCREEN_ERROR);
 
+    if (img != lastImg) {
+        lastImg = img;
+        img->markAllDirty();
+    }
+    int x, y, w, h;
+    if (!img->takeDirty(&x, &y, &w, &h))
+        w = h = 0;
+    if (newPalette) {
+        newPalette = false;
+        x = y = 0;
+        w = width;
+        h = height;
+    }
+
+    PXT_TRACE_BEGIN("updateScreen");
+    if (screenShm) {
+        publishFrame(img, x, y, w, h);
+        PXT_TRACE_END("updateScreen");
+        vmFrameDone();
+        return;
+    }
+
     pthread_mutex_lock(&screenMutex);
     // if the data have not been picked up, but it had been in the past, wait
     if (dataWaiting && numGetPixels)
         pthread_cond_wait(&dataBroadcast, &screenMutex);
-    memcpy(screenBuf, img->pix(), img->pixLength());
+    if (w) {
+        auto bh = img->byteHeight();
+        memcpy(screenBuf + x * bh, img->pix(x, 0), w * bh);
+        dirty.add(x, y, w, h);
+    }
     dataWaiting = true;
     pthread_cond_broadcast(&dataBroadcast);
     pthread_mutex_unlock(&screenMutex);
+    PXT_TRACE_END("updateScreen");
 
-    if (newPalette) {
-        newPalette = false;
-    }
+    vmFrameDone();
 }
 
 //% expose
@@ -123,6 +385,30 @@ void updateScreen(Image_ img) {
     getWDisplay()->update(img);
 }
 
+// The part of the screen (x, y, width, height) updated by the last pxt_screen_get_pixels();
+// returns 0 if nothing changed.
+DLLEXPORT int pxt_screen_get_dirty_rect(int *rect) {
+    auto d = &lastGetPixels;
+    rect[0] = d->x0;
+    rect[1] = d->y0;
+    rect[2] = d->x1 - d->x0;
+    rect[3] = d->y1 - d->y0;
+    return !d->isEmpty();
+}
+
+// Publish frames to (and take events from) the shared memory object with the given name,
+// instead of pxt_screen_get_pixels(); name can be NULL for a host in the same process, which
+// then uses pxt_screen_shm(). Has to be called before the program starts.
+DLLEXPORT void pxt_screen_shm_open(const char *name) {
+    screenShmName = name ? strdup(name) : "";
+}
+
+// The shared memory header, or NULL if the transport is not used, or the screen not
+// initialized yet.
+DLLEXPORT void *pxt_screen_shm() {
+    return screenShm;
+}
+
 //% expose
 void updateStats(String msg) {
     DMESG("stats: %s", msg->getUTF8Data());
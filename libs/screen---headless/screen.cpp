@@ -0,0 +1,498 @@
+#include "pxt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <pthread.h>
+
+// A screen that isn't there, for running games (and measuring them) in CI containers.
+//
+// Every frame passed to updateScreen() is copied, with its palette and the time it was drawn,
+// into a ring of PXT_SCREEN_RING (default 8) frames in memory; pxt_screen_get_frame() reads
+// them back. A writer thread can also save the frames:
+//
+// - PXT_SCREEN_CAPTURE=<file>.png - 4 bit paletted PNGs
+// - PXT_SCREEN_CAPTURE=|<command> - 24 bit RGB frames piped to the command, for example
+//   "|ffmpeg -f rawvideo -pix_fmt rgb24 -s 160x120 -r 30 -i - out.mp4"
+// - PXT_SCREEN_CAPTURE=<file> - 24 bit RGB frames, one after another
+//
+// If a file name has %d in it, each frame goes to its own file, with %d replaced by the frame
+// number; otherwise a PNG is overwritten with each frame. PXT_SCREEN_CAPTURE_EVERY=n only
+// saves every n-th frame, and the first frame after a palette change. No frame is skipped when
+// the writer falls behind; the program waits for it once the whole ring is waiting to be saved.
+//
+// PXT_SCREEN_TIMES=<file> writes a line per frame: the frame number, the time since the first
+// frame, the time since the previous frame, and how much of it the program spent drawing (the
+// rest is pacing and waiting for the writer), all in us.
+//
+// Frames are paced to PXT_SCREEN_FPS (default 30) frames per second by putting the drawing
+// fiber to sleep; PXT_SCREEN_FPS=0 runs unthrottled. PXT_SCREEN_FRAMES=n exits after n frames,
+// once they're all saved, logging frame time percentiles.
+
+#define HEADLESS_DEFAULT_RING 8
+#define HEADLESS_DEFAULT_FPS 30
+
+#ifndef DLLEXPORT
+#define DLLEXPORT extern "C"
+#endif
+
+namespace pxt {
+
+struct HeadlessFrame {
+    uint32_t frameNo;
+    uint32_t timeUs; // since the first frame
+    uint32_t palette[16]; // RGB
+    uint8_t *pixels;      // in the Image format
+    bool newPalette;      // captured even when PXT_SCREEN_CAPTURE_EVERY would skip it
+};
+
+enum CaptureKind { CAPTURE_NONE, CAPTURE_PNG, CAPTURE_RAW, CAPTURE_PIPE };
+
+class WDisplay {
+  public:
+    uint32_t currPalette[16];
+    bool newPalette;
+    int width, height;
+    int byteHeight;
+
+    HeadlessFrame *ring;
+    int ringSize;
+    // frames drawn, and saved by the writer thread; protected by mutex
+    uint32_t numFrames, numSaved;
+    pthread_mutex_t mutex;
+    pthread_cond_t frameReady, frameSaved;
+
+    CaptureKind captureKind;
+    const char *captureName;
+    // a file per frame
+    bool capturePerFrame;
+    bool hasWriter;
+    int captureEvery;
+    FILE *captureFile;
+    uint8_t *captureBuf;
+
+    FILE *timesFile;
+    int frameUs;
+    int maxFrames;
+    uint64_t firstFrameUs, lastFrameUs, nextFrameUs;
+    // time spent in update() since the previous frame ended
+    uint64_t waitUs;
+    // time between frames, for the statistics at the end
+    uint32_t *intervals;
+
+    WDisplay();
+    void update(Image_ img);
+    void writerLoop();
+    void saveFrame(HeadlessFrame *frame);
+    void writePng(FILE *f, HeadlessFrame *frame);
+    void writeRgb(FILE *f, HeadlessFrame *frame);
+    void finish();
+};
+
+SINGLETON(WDisplay);
+
+static int envInt(const char *name, int defl) {
+    auto v = getenv(name);
+    return v ? atoi(v) : defl;
+}
+
+static void *headlessWriter(void *wd) {
+    ((WDisplay *)wd)->writerLoop();
+    return NULL;
+}
+
+WDisplay::WDisplay() {
+    width = getConfig(CFG_DISPLAY_WIDTH, 160);
+    height = getConfig(CFG_DISPLAY_HEIGHT, 128);
+    byteHeight = ((height * 4 + 31) >> 5) << 2;
+    memset(currPalette, 0, sizeof(currPalette));
+    newPalette = false;
+#ifdef PXT_VM
+    // the top-level code that sets the palette isn't run again on a warm start
+    registerSnapshotState("palette", currPalette, sizeof(currPalette), &newPalette);
+#endif
+
+    ringSize = max(envInt("PXT_SCREEN_RING", HEADLESS_DEFAULT_RING), 1);
+    ring = new HeadlessFrame[ringSize];
+    for (int i = 0; i < ringSize; ++i) {
+        ring[i].pixels = new uint8_t[width * byteHeight];
+        memset(ring[i].pixels, 0, width * byteHeight);
+    }
+    numFrames = numSaved = 0;
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&frameReady, NULL);
+    pthread_cond_init(&frameSaved, NULL);
+
+    int fps = envInt("PXT_SCREEN_FPS", HEADLESS_DEFAULT_FPS);
+    frameUs = fps > 0 ? 1000000 / fps : 0;
+    maxFrames = envInt("PXT_SCREEN_FRAMES", 0);
+    intervals = maxFrames > 0 ? new uint32_t[maxFrames] : NULL;
+    firstFrameUs = lastFrameUs = nextFrameUs = 0;
+    waitUs = 0;
+
+    timesFile = NULL;
+    auto times = getenv("PXT_SCREEN_TIMES");
+    if (times) {
+        timesFile = fopen(times, "w");
+        if (!timesFile)
+            DMESG("cannot write frame times to %s", times);
+    }
+
+    captureKind = CAPTURE_NONE;
+    captureName = getenv("PXT_SCREEN_CAPTURE");
+    captureEvery = max(envInt("PXT_SCREEN_CAPTURE_EVERY", 1), 1);
+    capturePerFrame = false;
+    captureFile = NULL;
+    captureBuf = NULL;
+    if (captureName && *captureName) {
+        int len = strlen(captureName);
+        if (captureName[0] == '|') {
+            captureKind = CAPTURE_PIPE;
+            // don't get killed when the command exits early
+            signal(SIGPIPE, SIG_IGN);
+            captureFile = popen(captureName + 1, "w");
+        } else {
+            captureKind = len > 4 && !strcmp(captureName + len - 4, ".png") ? CAPTURE_PNG
+                                                                              : CAPTURE_RAW;
+            capturePerFrame = strstr(captureName, "%d") != NULL;
+            if (captureKind == CAPTURE_RAW && !capturePerFrame)
+                captureFile = fopen(captureName, "wb");
+        }
+        if (captureKind != CAPTURE_PNG && !capturePerFrame && !captureFile) {
+            DMESG("cannot open %s", captureName);
+            captureKind = CAPTURE_NONE;
+        }
+        // big enough for an RGB frame, or PNG rows with their filter bytes
+        captureBuf = new uint8_t[width * height * 3 + height];
+    }
+
+    DMESG("headless display: %dx%d, %d fps, capture: %s", width, height, fps,
+          captureKind == CAPTURE_NONE ? "none" : captureName);
+
+    hasWriter = captureKind != CAPTURE_NONE;
+    if (hasWriter) {
+        pthread_t pid;
+        pthread_create(&pid, NULL, headlessWriter, this);
+        pthread_detach(pid);
+    }
+}
+
+// PNG, with the image data in stored (uncompressed) deflate blocks
+
+static uint32_t crcTable[256];
+
+static uint32_t crc32(uint32_t crc, const uint8_t *p, int len) {
+    if (!crcTable[1])
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k)
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            crcTable[i] = c;
+        }
+    crc = ~crc;
+    while (len--)
+        crc = crcTable[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void putBE32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// buf has 8 bytes of space for the length and type, followed by len bytes of data
+static void pngChunk(FILE *f, const char *type, uint8_t *buf, int len) {
+    putBE32(buf, len);
+    memcpy(buf + 4, type, 4);
+    uint8_t crc[4];
+    putBE32(crc, crc32(0, buf + 4, len + 4));
+    fwrite(buf, 1, len + 8, f);
+    fwrite(crc, 1, 4, f);
+}
+
+void WDisplay::writePng(FILE *f, HeadlessFrame *frame) {
+    static const uint8_t signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    uint8_t hdr[8 + 16 * 3];
+    fwrite(signature, 1, sizeof(signature), f);
+
+    putBE32(hdr + 8, width);
+    putBE32(hdr + 12, height);
+    hdr[16] = 4; // bit depth
+    hdr[17] = 3; // paletted
+    hdr[18] = hdr[19] = hdr[20] = 0;
+    pngChunk(f, "IHDR", hdr, 13);
+
+    for (int i = 0; i < 16; ++i) {
+        auto c = frame->palette[i];
+        hdr[8 + i * 3] = c >> 16;
+        hdr[8 + i * 3 + 1] = c >> 8;
+        hdr[8 + i * 3 + 2] = c;
+    }
+    pngChunk(f, "PLTE", hdr, 16 * 3);
+
+    // rows, leftmost pixel in the high nibble, each after a filter type byte of 0
+    int rowLen = (width + 1) / 2 + 1;
+    int rawLen = rowLen * height;
+    auto raw = captureBuf;
+    memset(raw, 0, rawLen);
+    for (int x = 0; x < width; ++x) {
+        auto src = frame->pixels + x * byteHeight;
+        auto dst = raw + 1 + (x >> 1);
+        int shift = x & 1 ? 0 : 4;
+        for (int y = 0; y < height; y += 2) {
+            uint8_t v = *src++;
+            dst[y * rowLen] |= (v & 0xf) << shift;
+            if (y + 1 < height)
+                dst[(y + 1) * rowLen] |= (v >> 4) << shift;
+        }
+    }
+
+    uint32_t adlerA = 1, adlerB = 0;
+    for (int i = 0; i < rawLen; ++i) {
+        adlerA = (adlerA + raw[i]) % 65521;
+        adlerB = (adlerB + adlerA) % 65521;
+    }
+
+    int numBlocks = (rawLen + 0xffff - 1) / 0xffff;
+    int zlen = 2 + rawLen + numBlocks * 5 + 4;
+    auto idat = new uint8_t[8 + zlen];
+    auto p = idat + 8;
+    *p++ = 0x78; // deflate, 32k window
+    *p++ = 0x01;
+    for (int pos = 0; pos < rawLen;) {
+        int n = min(rawLen - pos, 0xffff);
+        *p++ = pos + n == rawLen; // final block flag, stored
+        *p++ = n;
+        *p++ = n >> 8;
+        *p++ = ~n;
+        *p++ = ~n >> 8;
+        memcpy(p, raw + pos, n);
+        p += n;
+        pos += n;
+    }
+    putBE32(p, (adlerB << 16) | adlerA);
+    pngChunk(f, "IDAT", idat, zlen);
+    delete[] idat;
+
+    pngChunk(f, "IEND", hdr, 0);
+}
+
+void WDisplay::writeRgb(FILE *f, HeadlessFrame *frame) {
+    auto dst = captureBuf;
+    for (int y = 0; y < height; ++y) {
+        auto src = frame->pixels + (y >> 1);
+        int shift = y & 1 ? 4 : 0;
+        for (int x = 0; x < width; ++x) {
+            auto c = frame->palette[(*src >> shift) & 0xf];
+            src += byteHeight;
+            *dst++ = c >> 16;
+            *dst++ = c >> 8;
+            *dst++ = c;
+        }
+    }
+    fwrite(captureBuf, 1, width * height * 3, f);
+}
+
+void WDisplay::saveFrame(HeadlessFrame *frame) {
+    auto f = captureFile;
+    if (capturePerFrame) {
+        auto pct = strstr(captureName, "%d");
+        char name[1024];
+        snprintf(name, sizeof(name), "%.*s%05d%s", (int)(pct - captureName), captureName,
+                 frame->frameNo, pct + 2);
+        f = fopen(name, "wb");
+    } else if (captureKind == CAPTURE_PNG) {
+        f = fopen(captureName, "wb");
+    }
+    if (!f) {
+        DMESG("cannot write frame %d to %s", frame->frameNo, captureName);
+        return;
+    }
+
+    if (captureKind == CAPTURE_PNG)
+        writePng(f, frame);
+    else
+        writeRgb(f, frame);
+
+    if (f != captureFile) {
+        fclose(f);
+    } else if (ferror(f)) {
+        DMESG("capture to %s failed; stopping", captureName);
+        captureKind = CAPTURE_NONE;
+    }
+}
+
+void WDisplay::writerLoop() {
+    for (;;) {
+        pthread_mutex_lock(&mutex);
+        while (numSaved == numFrames)
+            pthread_cond_wait(&frameReady, &mutex);
+        // the slot isn't reused until numSaved is incremented
+        auto frame = &ring[numSaved % ringSize];
+        pthread_mutex_unlock(&mutex);
+
+        if (captureKind != CAPTURE_NONE &&
+            (frame->frameNo % captureEvery == 0 || frame->newPalette))
+            saveFrame(frame);
+
+        pthread_mutex_lock(&mutex);
+        numSaved++;
+        pthread_cond_broadcast(&frameSaved);
+        pthread_mutex_unlock(&mutex);
+    }
+}
+
+static int cmpU32(const void *a, const void *b) {
+    return *(uint32_t *)a < *(uint32_t *)b ? -1 : *(uint32_t *)a > *(uint32_t *)b;
+}
+
+// PXT_SCREEN_FRAMES reached; doesn't return
+void WDisplay::finish() {
+    pthread_mutex_lock(&mutex);
+    while (numSaved != numFrames)
+        pthread_cond_wait(&frameSaved, &mutex);
+    pthread_mutex_unlock(&mutex);
+
+    if (captureKind == CAPTURE_PIPE)
+        pclose(captureFile);
+    else if (captureFile)
+        fclose(captureFile);
+    if (timesFile)
+        fclose(timesFile);
+
+    // intervals[0] is always 0
+    int n = maxFrames - 1;
+    if (n > 0) {
+        auto iv = intervals + 1;
+        qsort(iv, n, sizeof(uint32_t), cmpU32);
+        DMESG("%d frames in %d ms; frame time us: p50=%d p90=%d p99=%d max=%d", maxFrames,
+              (int)((lastFrameUs - firstFrameUs) / 1000), iv[n / 2], iv[n * 9 / 10],
+              iv[n * 99 / 100], iv[n - 1]);
+    }
+    target_exit();
+}
+
+void WDisplay::update(Image_ img) {
+    if (!img)
+        return;
+    if (img->bpp() != 4 || img->width() != width || img->height() != height)
+        target_panic(PANIC_SCREEN_ERROR);
+
+    auto enterUs = current_time_us();
+
+    PXT_TRACE_BEGIN("updateScreen");
+    pthread_mutex_lock(&mutex);
+    while (numFrames - numSaved == (uint32_t)ringSize)
+        pthread_cond_wait(&frameSaved, &mutex);
+
+    auto now = current_time_us();
+    if (!firstFrameUs)
+        firstFrameUs = lastFrameUs = now;
+    uint32_t interval = now - lastFrameUs;
+    // the writer wait, and the pacing sleep at the end of the previous frame
+    uint32_t busy = interval - min(waitUs + (now - enterUs), (uint64_t)interval);
+    lastFrameUs = now;
+
+    // the copy is done under the lock, for pxt_screen_get_frame()
+    int frameNo = numFrames;
+    auto frame = &ring[frameNo % ringSize];
+    frame->frameNo = frameNo;
+    frame->timeUs = now - firstFrameUs;
+    memcpy(frame->palette, currPalette, sizeof(currPalette));
+    memcpy(frame->pixels, img->pix(), width * byteHeight);
+    frame->newPalette = newPalette;
+    newPalette = false;
+    numFrames++;
+    if (hasWriter)
+        pthread_cond_signal(&frameReady);
+    else
+        numSaved = numFrames;
+    pthread_mutex_unlock(&mutex);
+    PXT_TRACE_END("updateScreen");
+
+    if (timesFile)
+        fprintf(timesFile, "%d %d %d %d\n", frameNo, (int)(now - firstFrameUs), interval, busy);
+    if (frameNo < maxFrames)
+        intervals[frameNo] = interval;
+    if (maxFrames > 0 && frameNo + 1 >= maxFrames)
+        finish();
+
+    if (frameUs) {
+        // keep to the frame rate on average, but don't try to catch up after a long frame
+        if (!nextFrameUs || now > nextFrameUs + frameUs)
+            nextFrameUs = now;
+        nextFrameUs += frameUs;
+        auto t = current_time_us();
+        if (t + 1000 <= nextFrameUs)
+            sleep_ms((nextFrameUs - t) / 1000);
+    }
+    waitUs = current_time_us() - now;
+}
+
+//%
+int setScreenBrightnessSupported() {
+    return 0;
+}
+
+//%
+void setScreenBrightness(int level) {
+    // no backlight
+}
+
+//%
+void setPalette(Buffer buf) {
+    auto display = getWDisplay();
+    if (48 != buf->length)
+        target_panic(PANIC_SCREEN_ERROR);
+    for (int i = 0; i < 16; ++i) {
+        uint8_t r = buf->data[i * 3];
+        uint8_t g = buf->data[i * 3 + 1];
+        uint8_t b = buf->data[i * 3 + 2];
+        display->currPalette[i] = (r << 16) | (g << 8) | (b << 0);
+    }
+    display->newPalette = true;
+}
+
+//%
+void updateScreen(Image_ img) {
+    getWDisplay()->update(img);
+}
+
+//%
+void updateStats(String msg) {
+    // DMESG("render: %s", msg->data);
+}
+
+// Number of frames drawn so far.
+DLLEXPORT int pxt_screen_frame_count() {
+    auto disp = instWDisplay;
+    return disp ? disp->numFrames : 0;
+}
+
+// Copies frame frameNo, as 32 bit RGB, to pixels (row by row), and returns the time it was
+// drawn in us since the first frame; -1 if it's not in the ring (anymore).
+DLLEXPORT int pxt_screen_get_frame(int frameNo, uint32_t *pixels) {
+    auto disp = instWDisplay;
+    if (!disp)
+        return -1;
+    int res = -1;
+    pthread_mutex_lock(&disp->mutex);
+    uint32_t n = frameNo;
+    if (n < disp->numFrames && disp->numFrames - n <= (uint32_t)disp->ringSize) {
+        auto frame = &disp->ring[n % disp->ringSize];
+        for (int y = 0; y < disp->height; ++y) {
+            auto src = frame->pixels + (y >> 1);
+            int shift = y & 1 ? 4 : 0;
+            for (int x = 0; x < disp->width; ++x) {
+                *pixels++ = frame->palette[(*src >> shift) & 0xf];
+                src += disp->byteHeight;
+            }
+        }
+        res = frame->timeUs;
+    }
+    pthread_mutex_unlock(&disp->mutex);
+    return res;
+}
+} // namespace pxt
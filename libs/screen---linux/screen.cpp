@@ -11,7 +11,22 @@
 #include <sys/ioctl.h>
 #include <pthread.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 namespace pxt {
+class WDisplay;
+
+// helper thread converting a band of rows of each frame
+struct ConvertWorker {
+    WDisplay *display;
+    int index;
+    uint32_t *rowBuf;
+};
+
 class WDisplay {
   public:
     uint32_t currPalette[16];
@@ -21,8 +36,18 @@ class WDisplay {
 
     uint8_t *screenBuf;
     Image_ lastImg;
+    // part of screenBuf changed since updateLoop() last looked; x0 >= x1 if none
+    int dirtyX0, dirtyY0, dirtyX1, dirtyY1;
 
     int width, height;
+    int byteHeight;
+
+    // updateLoop() converts from its own copy of screenBuf, so that the lock is only held
+    // while copying
+    uint8_t *snapBuf;
+    uint32_t snapPalette[16];
+    // colors of the two pixels (row 2k, row 2k+1) in a byte of the image
+    uint32_t expandLut[256][2];
 
     int fb_fd;
     uint32_t *fbuf;
@@ -33,11 +58,29 @@ class WDisplay {
 
     int is32Bit;
 
+    // scaling and placement on the framebuffer, set up by updateLoop()
+    int sx, sy, offx, offy;
+    uint8_t *page;
+
+    // rectangle being converted, in image pixels; rows are split between the workers
+    int convX0, convY0, convX1, convY1;
+    int numWorkers;
+    ConvertWorker *workers;
+    uint32_t workGen;
+    int workPending;
+    pthread_cond_t workCond, doneCond;
+
     pthread_mutex_t mutex;
 
     WDisplay();
     void updateLoop();
     void update(Image_ img);
+    void addDirty(int x, int y, int w, int h);
+    void setupLut();
+    void convertRows(int y0, int y1, uint32_t *rowBuf);
+    void convertBand(int index, uint32_t *rowBuf);
+    void convert();
+    void workerLoop(ConvertWorker *w);
 };
 
 SINGLETON(WDisplay);
@@ -47,14 +90,146 @@ static void *updateDisplay(void *wd) {
     return NULL;
 }
 
+static void *convertWorker(void *w) {
+    ((ConvertWorker *)w)->display->workerLoop((ConvertWorker *)w);
+    return NULL;
+}
+
+static inline void fillWords(uint32_t *dst, uint32_t c, int n) {
+#if defined(__SSE2__)
+    if (n >= 4) {
+        auto v = _mm_set1_epi32(c);
+        for (; n >= 4; n -= 4, dst += 4)
+            _mm_storeu_si128((__m128i *)dst, v);
+    }
+#elif defined(__ARM_NEON)
+    if (n >= 4) {
+        auto v = vdupq_n_u32(c);
+        for (; n >= 4; n -= 4, dst += 4)
+            vst1q_u32(dst, v);
+    }
+#endif
+    while (n--)
+        *dst++ = c;
+}
+
+void WDisplay::setupLut() {
+    for (int i = 0; i < 256; ++i) {
+        expandLut[i][0] = snapPalette[i & 0xf];
+        expandLut[i][1] = snapPalette[i >> 4];
+    }
+}
+
+// Converts rows y0 to y1 (y0 even) of columns convX0 to convX1 of snapBuf. Both rows in a
+// byte are expanded at once into rowBuf, which is then copied sy times to the framebuffer, so
+// that the framebuffer is only ever written, and in whole lines.
+void WDisplay::convertRows(int y0, int y1, uint32_t *rowBuf) {
+    int x0 = convX0, w = convX1 - convX0;
+    int bytesPP = is32Bit ? 4 : 2;
+    int rowBytes = w * sx * bytesPP;
+    // rowBuf holds both rows
+    int rowWords = (rowBytes + 3) >> 2;
+    int stride = finfo.line_length;
+    uint8_t *dst = page + offy * stride + (offx + x0 * sx) * bytesPP;
+    // 32 bit words per image pixel; 16 bit pixels are packed two to a word in the palette
+    int u = is32Bit ? sx : sx / 2;
+
+    for (int y = y0; y < y1; y += 2) {
+        auto src = snapBuf + x0 * byteHeight + (y >> 1);
+        auto r0 = rowBuf, r1 = rowBuf + rowWords;
+        if (u == 0) {
+            auto d0 = (uint16_t *)r0, d1 = (uint16_t *)r1;
+            for (int x = 0; x < w; ++x) {
+                auto e = expandLut[*src];
+                src += byteHeight;
+                d0[x] = e[0];
+                d1[x] = e[1];
+            }
+        } else if (u == 1) {
+            for (int x = 0; x < w; ++x) {
+                auto e = expandLut[*src];
+                src += byteHeight;
+                r0[x] = e[0];
+                r1[x] = e[1];
+            }
+        } else {
+            for (int x = 0; x < w; ++x) {
+                auto e = expandLut[*src];
+                src += byteHeight;
+                fillWords(r0 + x * u, e[0], u);
+                fillWords(r1 + x * u, e[1], u);
+            }
+        }
+
+        auto d = dst + y * sy * stride;
+        for (int i = 0; i < sy; ++i, d += stride)
+            memcpy(d, r0, rowBytes);
+        if (y + 1 < y1)
+            for (int i = 0; i < sy; ++i, d += stride)
+                memcpy(d, r1, rowBytes);
+    }
+}
+
+// Bands are whole row pairs, so that no byte of the image is shared between two bands.
+void WDisplay::convertBand(int index, uint32_t *rowBuf) {
+    int pairs = (convY1 - convY0 + 1) >> 1;
+    int n = numWorkers + 1;
+    int y0 = convY0 + pairs * index / n * 2;
+    int y1 = min(convY0 + pairs * (index + 1) / n * 2, convY1);
+    if (y0 < y1)
+        convertRows(y0, y1, rowBuf);
+}
+
+void WDisplay::workerLoop(ConvertWorker *w) {
+    uint32_t gen = 0;
+    for (;;) {
+        pthread_mutex_lock(&mutex);
+        while (workGen == gen)
+            pthread_cond_wait(&workCond, &mutex);
+        gen = workGen;
+        pthread_mutex_unlock(&mutex);
+
+        convertBand(w->index, w->rowBuf);
+
+        pthread_mutex_lock(&mutex);
+        if (--workPending == 0)
+            pthread_cond_signal(&doneCond);
+        pthread_mutex_unlock(&mutex);
+    }
+}
+
+static uint32_t *allocRowBuf(int width, int sx) {
+    // two rows of up to 4 bytes per pixel
+    return new uint32_t[2 * width * sx];
+}
+
+void WDisplay::convert() {
+    if (!numWorkers) {
+        convertBand(0, workers[0].rowBuf);
+        return;
+    }
+    pthread_mutex_lock(&mutex);
+    workGen++;
+    workPending = numWorkers;
+    pthread_cond_broadcast(&workCond);
+    pthread_mutex_unlock(&mutex);
+
+    convertBand(0, workers[0].rowBuf);
+
+    pthread_mutex_lock(&mutex);
+    while (workPending)
+        pthread_cond_wait(&doneCond, &mutex);
+    pthread_mutex_unlock(&mutex);
+}
+
 void WDisplay::updateLoop() {
     int cur_page = 1;
     int frameNo = 0;
     int numPages = vinfo.yres_virtual / vinfo.yres;
     int ledScreen = getConfigInt("LED_SCREEN", 0);
 
-    int sx = vinfo.xres / width;
-    int sy = vinfo.yres / height;
+    sx = vinfo.xres / width;
+    sy = vinfo.yres / height;
 
     if (ledScreen)
         sx = ledScreen;
@@ -67,8 +242,8 @@ void WDisplay::updateLoop() {
     if (sx > 1)
         sx &= ~1;
 
-    int offx = (vinfo.xres - width * sx) / 2;
-    int offy = (vinfo.yres - height * sy) / 2;
+    offx = (vinfo.xres - width * sx) / 2;
+    offy = (vinfo.yres - height * sy) / 2;
 
     if (ledScreen) {
         offx = getConfigInt("LED_SCREEN_X", 0);
@@ -76,7 +251,6 @@ void WDisplay::updateLoop() {
     }
 
     int screensize = finfo.line_length * vinfo.yres;
-    uint32_t skip = offx;
 
     if (sx > 1)
         offx &= ~1;
@@ -88,6 +262,27 @@ void WDisplay::updateLoop() {
     if (numPages == 1)
         cur_page = 0;
 
+    // SCREEN_THREADS=n converts with n threads, this one included
+    numWorkers = max(getConfigInt("SCREEN_THREADS", 1), 1) - 1;
+    workers = new ConvertWorker[numWorkers + 1];
+    for (int i = 0; i <= numWorkers; ++i) {
+        workers[i].display = this;
+        workers[i].index = i;
+        workers[i].rowBuf = allocRowBuf(width, sx);
+        if (i > 0) {
+            pthread_t pid;
+            pthread_create(&pid, NULL, convertWorker, &workers[i]);
+            pthread_detach(pid);
+        }
+    }
+
+    int prevX0 = 0, prevY0 = 0, prevX1 = 0, prevY1 = 0;
+    uint64_t convTotal = 0;
+    int convMax = 0, convFrames = 0;
+
+    memset(snapPalette, 0, sizeof(snapPalette));
+    setupLut();
+
     dirty = true;
 
     DMESG("loop");
@@ -98,65 +293,52 @@ void WDisplay::updateLoop() {
         while (!dirty)
             sleep_core_us(2000);
 
-        // auto start = current_time_us();
-        // DMESG("update");
-
+        PXT_TRACE_BEGIN("updateLoop");
         pthread_mutex_lock(&mutex);
         dirty = false;
 
-        if (!is32Bit) {
-            uint16_t *dst =
-                (uint16_t *)fbuf + cur_page * screensize / 2 + offx + offy * finfo.line_length / 2;
-            if (sx == 1 && sy == 1) {
-                skip = vinfo.xres - width * sx;
-                for (int yy = 0; yy < height; yy++) {
-                    auto shift = yy & 1 ? 4 : 0;
-                    auto src = screenBuf + yy / 2;
-                    for (int xx = 0; xx < width; ++xx) {
-                        int c = this->currPalette[(*src >> shift) & 0xf];
-                        src += height / 2;
-                        *dst++ = c;
-                    }
-                    dst += skip;
-                }
-            } else {
-                uint32_t *d2 = (uint32_t *)dst;
-                for (int yy = 0; yy < height; yy++) {
-                    auto shift = yy & 1 ? 4 : 0;
-                    for (int i = 0; i < sy; ++i) {
-                        auto src = screenBuf + yy / 2;
-                        for (int xx = 0; xx < width; ++xx) {
-                            int c = this->currPalette[(*src >> shift) & 0xf];
-                            src += height / 2;
-                            for (int j = 0; j < sx / 2; ++j)
-                                *d2++ = c;
-                        }
-                        d2 += skip;
-                    }
-                }
-            }
-        } else {
-            uint32_t *d2 =
-                (uint32_t *)fbuf + cur_page * screensize / 4 + offx + offy * finfo.line_length / 4;
-            skip = vinfo.xres - width * sx;
-            for (int yy = 0; yy < height; yy++) {
-                auto shift = yy & 1 ? 4 : 0;
-                for (int i = 0; i < sy; ++i) {
-                    auto src = screenBuf + yy / 2;
-                    for (int xx = 0; xx < width; ++xx) {
-                        int c = this->currPalette[(*src >> shift) & 0xf];
-                        src += height / 2;
-                        for (int j = 0; j < sx; ++j)
-                            *d2++ = c;
-                    }
-                    d2 += skip;
-                }
-            }
+        // with two pages, this one still has the frame before the previous one
+        int x0 = min(dirtyX0, prevX0), y0 = min(dirtyY0, prevY0);
+        int x1 = max(dirtyX1, prevX1), y1 = max(dirtyY1, prevY1);
+        if (dirtyX0 >= dirtyX1) {
+            x0 = prevX0, y0 = prevY0, x1 = prevX1, y1 = prevY1;
+        } else if (prevX0 >= prevX1) {
+            x0 = dirtyX0, y0 = dirtyY0, x1 = dirtyX1, y1 = dirtyY1;
         }
-
+        // snapBuf only lags behind screenBuf in the columns changed since the last frame
+        if (dirtyX0 < dirtyX1)
+            memcpy(snapBuf + dirtyX0 * byteHeight, screenBuf + dirtyX0 * byteHeight,
+                   (dirtyX1 - dirtyX0) * byteHeight);
+        if (numPages > 1) {
+            prevX0 = dirtyX0, prevY0 = dirtyY0, prevX1 = dirtyX1, prevY1 = dirtyY1;
+        }
+        dirtyX0 = dirtyY0 = dirtyX1 = dirtyY1 = 0;
+        bool paletteChanged = memcmp(snapPalette, currPalette, sizeof(snapPalette)) != 0;
+        if (paletteChanged)
+            memcpy(snapPalette, currPalette, sizeof(snapPalette));
         pthread_mutex_unlock(&mutex);
 
-        // auto len = current_time_us() - start;
+        if (x0 < x1) {
+            auto convStart = current_time_us();
+            if (paletteChanged)
+                setupLut();
+            page = (uint8_t *)fbuf + cur_page * screensize;
+            convX0 = x0, convX1 = x1;
+            convY0 = y0 & ~1, convY1 = min((y1 + 1) & ~1, height);
+            convert();
+
+            int convUs = (int)(current_time_us() - convStart);
+            PXT_TRACE_COUNTER("screenConvert", convUs);
+            convTotal += convUs;
+            convMax = max(convMax, convUs);
+            if (++convFrames == 300) {
+                DMESG("screen convert: avg %d us, max %d us", (int)(convTotal / convFrames),
+                      convMax);
+                convTotal = 0;
+                convMax = convFrames = 0;
+            }
+        }
+        PXT_TRACE_END("updateLoop");
 
         painted = true;
         raiseEvent(DEVICE_ID_NOTIFY_ONE, eventId);
@@ -173,10 +355,6 @@ void WDisplay::updateLoop() {
         if (fulllen < 25000) {
             ioctl(fb_fd, FBIO_WAITFORVSYNC, 0);
         }
-
-        // auto tot = current_time_us() - start;
-        // if (frameNo % 37 == 0)
-        //    DMESG("copy %d us, tot %d us delay %d us",  (int)len, (int)tot, (int)(start-start0));
     }
 }
 
@@ -185,13 +363,25 @@ WDisplay::WDisplay() {
 
     width = getConfig(CFG_DISPLAY_WIDTH, 160);
     height = getConfig(CFG_DISPLAY_HEIGHT, 128);
-    screenBuf = new uint8_t[width * height / 2 + 20];
+    byteHeight = ((height * 4 + 31) >> 5) << 2;
+    screenBuf = new uint8_t[width * byteHeight];
+    snapBuf = new uint8_t[width * byteHeight];
+    memset(snapBuf, 0, width * byteHeight);
+    workers = NULL;
+    workGen = 0;
+    workPending = 0;
+    pthread_cond_init(&workCond, NULL);
+    pthread_cond_init(&doneCond, NULL);
     lastImg = NULL;
     newPalette = false;
+    dirtyX0 = dirtyY0 = dirtyX1 = dirtyY1 = 0;
 
     registerGC((TValue *)&lastImg);
 
     eventId = allocateNotifyEvent();
+    // update() only waits for the latest frame, so there's no point in queuing one event per
+    // frame while the program is busy
+    eventQueueCoalesce(DEVICE_ID_NOTIFY_ONE, eventId);
 
     int tty_fd = open("/dev/tty0", O_RDWR);
     ioctl(tty_fd, KDSETMODE, KD_GRAPHICS);
@@ -264,9 +454,19 @@ void setPalette(Buffer buf) {
     display->newPalette = true;
 }
 
+void WDisplay::addDirty(int x, int y, int w, int h) {
+    if (dirtyX0 >= dirtyX1) {
+        dirtyX0 = x, dirtyY0 = y, dirtyX1 = x + w, dirtyY1 = y + h;
+    } else {
+        dirtyX0 = min(dirtyX0, x), dirtyY0 = min(dirtyY0, y);
+        dirtyX1 = max(dirtyX1, x + w), dirtyY1 = max(dirtyY1, y + h);
+    }
+}
+
 void WDisplay::update(Image_ img) {
     if (img && img != lastImg) {
         lastImg = img;
+        img->markAllDirty();
     }
     img = lastImg;
 
@@ -281,13 +481,22 @@ void WDisplay::update(Image_ img) {
         }
         painted = false;
 
+        PXT_TRACE_BEGIN("updateScreen");
         pthread_mutex_lock(&mutex);
         dirty = true;
+        // only the changed columns are copied, and only the changed rectangle converted; an
+        // unchanged frame still goes through updateLoop() for the page flip and throttling
+        int x, y, w, h;
+        if (img->takeDirty(&x, &y, &w, &h)) {
+            memcpy(screenBuf + x * byteHeight, img->pix(x, 0), w * byteHeight);
+            addDirty(x, y, w, h);
+        }
         if (newPalette) {
             newPalette = false;
+            addDirty(0, 0, width, height);
         }
-        memcpy(screenBuf, img->pix(), img->pixLength());
         pthread_mutex_unlock(&mutex);
+        PXT_TRACE_END("updateScreen");
     }
 }
 
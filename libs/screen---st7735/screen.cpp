@@ -23,6 +23,10 @@ class WDisplay {
 
     uint8_t *screenBuf;
     Image_ lastStatus;
+    // only compared with, not a GC root
+    Image_ lastImg;
+    // the address window is set to some columns of the main area
+    bool partialWindow;
 
     uint16_t width, height;
     uint16_t displayHeight;
@@ -125,6 +129,7 @@ class WDisplay {
         screenBuf = (uint8_t *)app_alloc(sz / 2 + 20);
 
         lastStatus = NULL;
+        lastImg = NULL;
         registerGC((TValue *)&lastStatus);
         inUpdate = false;
     }
@@ -198,11 +203,18 @@ class WDisplay {
             smart->setAddrWindow(offX, offY + displayHeight, width, height - displayHeight);
     }
     void setAddrMain() {
+        partialWindow = false;
         if (lcd)
             lcd->setAddrWindow(offX, offY, width, displayHeight);
         else
             smart->setAddrWindow(offX, offY, width, displayHeight);
     }
+    // columns x to x + w - 1 of the (not doubled) image in the main area; LCD only
+    void setAddrColumns(int x, int w) {
+        int mult = doubleSize ? 2 : 1;
+        partialWindow = true;
+        lcd->setAddrWindow(offX + x * mult, offY, w * mult, displayHeight);
+    }
     void waitForSendDone() {
         if (lcd)
             lcd->waitForSendDone();
@@ -338,10 +350,27 @@ void updateScreen(Image_ img) {
                 palette = NULL;
         }
 
-        memcpy(display->screenBuf, img->pix(), img->pixLength());
+        if (img != display->lastImg) {
+            display->lastImg = img;
+            img->markAllDirty();
+        }
 
-        // DMESG("send");
-        display->sendIndexedImage(display->screenBuf, img->width(), img->height(), palette);
+        int x, y, w, h;
+        if (!img->takeDirty(&x, &y, &w, &h) && !palette) {
+            // nothing changed
+        } else if (display->lcd && !palette && w < img->width()) {
+            // send just the changed columns
+            auto bh = img->byteHeight();
+            memcpy(display->screenBuf + x * bh, img->pix(x, 0), w * bh);
+            display->setAddrColumns(x, w);
+            display->sendIndexedImage(display->screenBuf + x * bh, w, img->height(), NULL);
+        } else {
+            memcpy(display->screenBuf, img->pix(), img->pixLength());
+            if (display->partialWindow)
+                display->setAddrMain();
+            // DMESG("send");
+            display->sendIndexedImage(display->screenBuf, img->width(), img->height(), palette);
+        }
     }
 
     if (display->lastStatus && !display->doubleSize) {
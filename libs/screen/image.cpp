@@ -11,6 +11,66 @@
 #define XX(v) (int)(((int16_t)(v)))
 #define YY(v) (int)(((int16_t)(((int32_t)(v)) >> 16)))
 
+// On hosted targets (Linux, the VM), where screens are larger and blitting is where most of the
+// time goes, drawImageCore() handles 4bpp destinations a column at a time: pixels pairs that fill
+// a whole destination byte are done 16 or 32 bytes at a time with vector instructions, and only
+// the pixels at the ends of the column are done one by one.
+// Building with -DPXT_SIMD_BLIT=0 selects the generic code (cpptests/screen compares the two).
+#ifndef PXT_SIMD_BLIT
+#if defined(__SSE2__) || defined(__ARM_NEON)
+#define PXT_SIMD_BLIT 1
+#else
+#define PXT_SIMD_BLIT 0
+#endif
+#endif
+
+#if PXT_SIMD_BLIT
+#if defined(__AVX2__)
+#include <immintrin.h>
+typedef __m256i blitvec_t;
+#define VSIZE 32
+#define VLOAD(p) _mm256_loadu_si256((const __m256i *)(p))
+#define VSTORE(p, v) _mm256_storeu_si256((__m256i *)(p), v)
+#define VSPLAT(b) _mm256_set1_epi8((char)(b))
+#define VAND(a, b) _mm256_and_si256(a, b)
+#define VOR(a, b) _mm256_or_si256(a, b)
+#define VANDNOT(a, b) _mm256_andnot_si256(b, a) // a & ~b
+#define VSHL4(v) _mm256_slli_epi16(v, 4)
+#define VSHR4(v) _mm256_srli_epi16(v, 4)
+#define VEQZ(v) _mm256_cmpeq_epi8(v, _mm256_setzero_si256())
+#define VISZERO(v) _mm256_testz_si256(v, v)
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+typedef __m128i blitvec_t;
+#define VSIZE 16
+#define VLOAD(p) _mm_loadu_si128((const __m128i *)(p))
+#define VSTORE(p, v) _mm_storeu_si128((__m128i *)(p), v)
+#define VSPLAT(b) _mm_set1_epi8((char)(b))
+#define VAND(a, b) _mm_and_si128(a, b)
+#define VOR(a, b) _mm_or_si128(a, b)
+#define VANDNOT(a, b) _mm_andnot_si128(b, a)
+#define VSHL4(v) _mm_slli_epi16(v, 4)
+#define VSHR4(v) _mm_srli_epi16(v, 4)
+#define VEQZ(v) _mm_cmpeq_epi8(v, _mm_setzero_si128())
+#define VISZERO(v) (_mm_movemask_epi8(VEQZ(v)) == 0xffff)
+#else
+#include <arm_neon.h>
+typedef uint8x16_t blitvec_t;
+#define VSIZE 16
+#define VLOAD(p) vld1q_u8(p)
+#define VSTORE(p, v) vst1q_u8(p, v)
+#define VSPLAT(b) vdupq_n_u8(b)
+#define VAND(a, b) vandq_u8(a, b)
+#define VOR(a, b) vorrq_u8(a, b)
+#define VANDNOT(a, b) vbicq_u8(a, b)
+#define VSHL4(v) vshlq_n_u8(v, 4)
+#define VSHR4(v) vshrq_n_u8(v, 4)
+#define VEQZ(v) vceqq_u8(v, vdupq_n_u8(0))
+#define VISZERO(v)                                                                                 \
+    (vget_lane_u64(vreinterpret_u64_u8(vorr_u8(vget_low_u8(v), vget_high_u8(v))), 0) == 0)
+#endif
+#endif
+
 namespace pxt {
 
 PXT_VTABLE(RefImage, ValType::Object)
@@ -28,7 +88,10 @@ int RefImage::wordHeight() {
 }
 
 void RefImage::makeWritable() {
-    if (buffer->isReadOnly()) {
+    mask = NULL;
+    if (isCompressed()) {
+        expand();
+    } else if (buffer->isReadOnly()) {
         buffer = mkBuffer(data(), length());
     }
 }
@@ -46,11 +109,51 @@ void RefImage::clamp(int *x, int *y) {
     *y = min(max(*y, 0), height() - 1);
 }
 
-RefImage::RefImage(BoxedBuffer *buf) : PXT_VTABLE_INIT(RefImage), buffer(buf) {
+RefImage::RefImage(BoxedBuffer *buf)
+    : PXT_VTABLE_INIT(RefImage), buffer(buf), dirtyX0(0), dirtyY0(0), dirtyX1(0), dirtyY1(-1),
+      mask(NULL) {
     if (!buf)
         oops(21);
 }
 
+void RefImage::markDirtyCore(int x, int y, int w, int h) {
+    int x1 = min(x + w, width());
+    int y1 = min(y + h, height());
+    x = max(x, 0);
+    y = max(y, 0);
+    if (x >= x1 || y >= y1)
+        return;
+    if (dirtyX0 >= dirtyX1) {
+        dirtyX0 = x;
+        dirtyY0 = y;
+        dirtyX1 = x1;
+        dirtyY1 = y1;
+    } else {
+        dirtyX0 = min((int)dirtyX0, x);
+        dirtyY0 = min((int)dirtyY0, y);
+        dirtyX1 = max((int)dirtyX1, x1);
+        dirtyY1 = max((int)dirtyY1, y1);
+    }
+}
+
+// Gets the rectangle changed since the previous call and resets it; returns false if nothing
+// changed. The first call returns the whole image, and starts the tracking.
+bool RefImage::takeDirty(int *x, int *y, int *w, int *h) {
+    if (dirtyY1 < 0) {
+        dirtyX0 = 0;
+        dirtyY0 = 0;
+        dirtyX1 = width();
+        dirtyY1 = height();
+    }
+    bool changed = dirtyX0 < dirtyX1;
+    *x = dirtyX0;
+    *y = dirtyY0;
+    *w = changed ? dirtyX1 - dirtyX0 : 0;
+    *h = changed ? dirtyY1 - dirtyY0 : 0;
+    dirtyX0 = dirtyY0 = dirtyX1 = dirtyY1 = 0;
+    return changed;
+}
+
 static inline int byteSize(int w, int h, int bpp) {
     if (bpp == 1)
         return sizeof(ImageHeader) + ((h + 7) >> 3) * w;
@@ -83,11 +186,95 @@ Image_ mkImage(int width, int height, int bpp) {
     return r;
 }
 
+// runs of a compressed image, in the top two bits of the first byte
+enum { RLE_SKIP, RLE_LITERAL, RLE_FILL };
+
+static inline const uint8_t *rleColumn(Image_ img, int x) {
+    auto offsets = img->header()->pixels;
+    return offsets + 2 * img->width() + (offsets[2 * x] | (offsets[2 * x + 1] << 8));
+}
+
+// The end of the compressed column at p, or NULL if it's invalid.
+static const uint8_t *rleColumnEnd(const uint8_t *p, const uint8_t *end, int h) {
+    while (h > 0) {
+        if (p >= end)
+            return NULL;
+        auto op = *p++;
+        int n = (op & 0x3f) + 1;
+        switch (op >> 6) {
+        case RLE_SKIP:
+            break;
+        case RLE_LITERAL:
+            p += (n + 1) >> 1;
+            break;
+        case RLE_FILL:
+            // the color is a 4bpp pixel value
+            if (p >= end || *p > 15)
+                return NULL;
+            p++;
+            break;
+        default:
+            return NULL;
+        }
+        h -= n;
+    }
+    return h == 0 && p <= end ? p : NULL;
+}
+
+static bool isValidCompressedImage(Buffer buf) {
+    auto hd = (ImageHeader *)(buf->data);
+    if (hd->bpp != 4)
+        return false;
+    auto end = buf->data + buf->length;
+    auto offsets = hd->pixels;
+    auto cols = offsets + 2 * hd->width;
+    if (cols > end)
+        return false;
+    for (int x = 0; x < hd->width; ++x) {
+        auto p = cols + (offsets[2 * x] | (offsets[2 * x + 1] << 8));
+        if (p > end || !rleColumnEnd(p, end, hd->height))
+            return false;
+    }
+    return true;
+}
+
+// Replaces the compressed pixels with the plain format; the compressed data stays with whoever
+// else refers to it.
+void RefImage::expand() {
+    int w = width();
+    int h = height();
+    int bh = ((h * 4 + 31) >> 5) << 2;
+    auto buf = mkBuffer(NULL, byteSize(w, h, 4));
+    auto hd = (ImageHeader *)buf->data;
+    *hd = *header();
+    hd->magic = IMAGE_HEADER_MAGIC;
+    for (int x = 0; x < w; ++x) {
+        auto src = rleColumn(this, x);
+        auto dst = hd->pixels + x * bh;
+        for (int y = 0; y < h;) {
+            auto op = *src++;
+            int n = (op & 0x3f) + 1;
+            int kind = op >> 6;
+            uint8_t c = kind == RLE_FILL ? *src++ : 0;
+            for (int i = 0; i < n; ++i, ++y) {
+                if (kind == RLE_LITERAL)
+                    c = (src[i >> 1] >> ((i & 1) << 2)) & 0xf;
+                dst[y >> 1] |= c << ((y & 1) << 2);
+            }
+            if (kind == RLE_LITERAL)
+                src += (n + 1) >> 1;
+        }
+    }
+    buffer = buf;
+}
+
 bool isValidImage(Buffer buf) {
     if (!buf || buf->length < 9)
         return false;
 
     auto hd = (ImageHeader *)(buf->data);
+    if (hd->magic == IMAGE_HEADER_MAGIC_RLE)
+        return isValidCompressedImage(buf);
     if (hd->magic != IMAGE_HEADER_MAGIC || (hd->bpp != 1 && hd->bpp != 4))
         return false;
 
@@ -150,6 +337,7 @@ void copyFrom(Image_ img, Image_ from) {
         img->bpp() != from->bpp())
         return;
     img->makeWritable();
+    img->markAllDirty();
     memcpy(img->pix(), from->pix(), from->pixLength());
 }
 
@@ -191,6 +379,7 @@ void setPixel(Image_ img, int x, int y, int c) {
     if (!img->inRange(x, y))
         return;
     img->makeWritable();
+    img->markDirty(x, y, 1, 1);
     setCore(img, x, y, c);
 }
 
@@ -216,6 +405,7 @@ void fill(Image_ img, int c) {
         return;
     }
     img->makeWritable();
+    img->markAllDirty();
     memset(img->pix(), img->fillMask(c), img->pixLength());
 }
 
@@ -261,6 +451,7 @@ void setRows(Image_ img, int x, Buffer src) {
     uint8_t *dp = img->pix(x, 0);
     uint8_t *sp = src->data;
     int n = min(src->length, (w - x) * h) >> 1;
+    img->markDirty(x, 0, (n * 2 + h - 1) / h, h);
 
     while (n--) {
         *dp++ = (sp[0] & 0xf) | (sp[1] << 4);
@@ -289,6 +480,7 @@ void fillRect(Image_ img, int x, int y, int w, int h, int c) {
     }
 
     img->makeWritable();
+    img->markDirty(x, y, w, h);
 
     auto bh = img->byteHeight();
     uint8_t f = img->fillMask(c);
@@ -366,6 +558,7 @@ void mapRect(Image_ img, int x, int y, int w, int h, Buffer map) {
     h = y2 - y + 1;
 
     img->makeWritable();
+    img->markDirty(x, y, w, h);
 
     auto bh = img->byteHeight();
     auto m = map->data;
@@ -414,12 +607,53 @@ Image_ clone(Image_ img) {
     return r;
 }
 
+static int rleEncodeColumn(const uint8_t *col, int h, uint8_t *dst);
+
+/**
+ * Return a copy of the current image that takes less memory, unless it's mostly noise. It is drawn
+ * faster by drawTransparentImage() too, but reading or changing its pixels in any other way makes
+ * it a normal image again.
+ */
+//%
+Image_ compressed(Image_ img) {
+    int w = img->width();
+    int h = img->height();
+    if (img->isCompressed() || img->bpp() != 4)
+        return clone(img);
+
+    int bh = img->byteHeight();
+    auto pix = img->pix();
+    int len = 0, lastOffset = 0;
+    for (int x = 0; x < w; ++x) {
+        lastOffset = len;
+        len += rleEncodeColumn(pix + x * bh, h, NULL);
+    }
+    int sz = sizeof(ImageHeader) + 2 * w + len;
+    if (lastOffset > 0xffff || sz >= img->length())
+        return clone(img);
+
+    auto r = allocImage(NULL, sz);
+    auto hd = r->header();
+    *hd = *img->header();
+    hd->magic = IMAGE_HEADER_MAGIC_RLE;
+    auto offsets = hd->pixels;
+    auto dst = offsets + 2 * w;
+    len = 0;
+    for (int x = 0; x < w; ++x) {
+        offsets[2 * x] = len;
+        offsets[2 * x + 1] = len >> 8;
+        len += rleEncodeColumn(img->pix() + x * bh, h, dst + len);
+    }
+    return r;
+}
+
 /**
  * Flips (mirrors) pixels horizontally in the current image
  */
 //%
 void flipX(Image_ img) {
     img->makeWritable();
+    img->markAllDirty();
 
     int bh = img->byteHeight();
     auto a = img->pix();
@@ -442,6 +676,7 @@ void flipX(Image_ img) {
 //%
 void flipY(Image_ img) {
     img->makeWritable();
+    img->markAllDirty();
 
     // this is quite slow - for small 16x16 sprite it will take in the order of 1ms
     // something faster requires quite a bit of bit tweaking, especially for mono images
@@ -483,6 +718,7 @@ void drawImage(Image_ img, Image_ from, int x, int y);
 //%
 void scroll(Image_ img, int dx, int dy) {
     img->makeWritable();
+    img->markAllDirty();
     auto bh = img->byteHeight();
     auto w = img->width();
     if (dy != 0) {
@@ -579,6 +815,7 @@ void replace(Image_ img, int from, int to) {
         return;
 
     img->makeWritable();
+    img->markAllDirty();
 
     // avoid bleeding 'to' color into the overflow areas of the picture
     if (from == 0 && img->hasPadding()) {
@@ -613,6 +850,322 @@ Image_ doubled(Image_ img) {
     return r;
 }
 
+enum { BLIT_COPY, BLIT_TRANSPARENT, BLIT_OVERLAP, BLIT_ICON };
+
+// 0xf in place of every non-zero pixel of a byte
+static inline uint8_t nibbleMask(uint8_t v) {
+    return ((v & 0x0f) ? 0x0f : 0) | ((v & 0xf0) ? 0xf0 : 0);
+}
+
+// Combines the source byte s with the destination byte *t; returns true on overlap.
+template <int mode> static inline bool blitByte(uint8_t *t, uint8_t s) {
+    switch (mode) {
+    case BLIT_COPY:
+        *t = s;
+        break;
+    case BLIT_TRANSPARENT:
+        *t = (*t & ~nibbleMask(s)) | s;
+        break;
+    case BLIT_OVERLAP:
+        return (*t & nibbleMask(s)) != 0;
+    }
+    return false;
+}
+
+// A pixel at the end of a column; v is the source pixel (or 0xf/0 for icons).
+template <int mode> static inline bool blitPixel(uint8_t *tdata, int k, int v, uint8_t color) {
+    auto t = tdata + (k >> 1);
+    int shift = (k & 1) << 2;
+    uint8_t mask = 0xf << shift;
+    if (mode == BLIT_COPY || mode == BLIT_TRANSPARENT) {
+        if (mode == BLIT_TRANSPARENT && !v)
+            return false;
+        *t = (*t & ~mask) | (v << shift);
+    } else if (mode == BLIT_OVERLAP) {
+        return v && (*t & mask);
+    } else if (v) {
+        *t = (*t & ~mask) | (color & mask);
+    }
+    return false;
+}
+
+#if PXT_SIMD_BLIT
+static inline blitvec_t nibbleMaskV(blitvec_t v) {
+    auto lo = VANDNOT(VSPLAT(0x0f), VEQZ(VAND(v, VSPLAT(0x0f))));
+    auto hi = VANDNOT(VSPLAT(0xf0), VEQZ(VAND(v, VSPLAT(0xf0))));
+    return VOR(lo, hi);
+}
+
+// As blitByte(), for VSIZE bytes; for icons, s is the pixel mask.
+template <int mode> static inline bool blitVec(uint8_t *t, blitvec_t s, blitvec_t color) {
+    switch (mode) {
+    case BLIT_COPY:
+        VSTORE(t, s);
+        break;
+    case BLIT_TRANSPARENT:
+        VSTORE(t, VOR(VANDNOT(VLOAD(t), nibbleMaskV(s)), s));
+        break;
+    case BLIT_OVERLAP: {
+        auto d = VAND(VLOAD(t), nibbleMaskV(s));
+        return !VISZERO(d);
+    }
+    case BLIT_ICON:
+        VSTORE(t, VOR(VANDNOT(VLOAD(t), s), VAND(color, s)));
+        break;
+    }
+    return false;
+}
+
+// Draws source pixels of a 4bpp column fdata to pixels [k0, k1) of the destination column tdata;
+// source pixel j goes to destination pixel j + y.
+template <int mode>
+static bool blitColumn4(uint8_t *tdata, const uint8_t *fdata, int y, int k0, int k1) {
+    // destination bytes with both pixels drawn
+    int d0 = (k0 + 1) >> 1;
+    int d1 = max(d0, k1 >> 1);
+
+    for (int k = k0; k < min(k1, d0 << 1); ++k)
+        if (blitPixel<mode>(tdata, k, (fdata[(k - y) >> 1] >> (((k - y) & 1) << 2)) & 0xf, 0))
+            return true;
+
+    int d = d0;
+    auto zero = VSPLAT(0);
+    if (y & 1) {
+        // source pixels are shifted by one nibble relative to the destination
+        auto src = fdata - ((y + 1) >> 1);
+        for (; d + VSIZE <= d1; d += VSIZE) {
+            auto s = VOR(VAND(VSHR4(VLOAD(src + d)), VSPLAT(0x0f)),
+                         VAND(VSHL4(VLOAD(src + d + 1)), VSPLAT(0xf0)));
+            if (blitVec<mode>(tdata + d, s, zero))
+                return true;
+        }
+        for (; d < d1; ++d)
+            if (blitByte<mode>(tdata + d, (src[d] >> 4) | (src[d + 1] << 4)))
+                return true;
+    } else {
+        auto src = fdata - (y >> 1);
+        for (; d + VSIZE <= d1; d += VSIZE) {
+            auto s = VLOAD(src + d);
+            if (blitVec<mode>(tdata + d, s, zero))
+                return true;
+        }
+        for (; d < d1; ++d)
+            if (blitByte<mode>(tdata + d, src[d]))
+                return true;
+    }
+
+    for (int k = d1 << 1; k < k1; ++k)
+        if (blitPixel<mode>(tdata, k, (fdata[(k - y) >> 1] >> (((k - y) & 1) << 2)) & 0xf, 0))
+            return true;
+
+    return false;
+}
+
+// 8 bits of a 1bpp column to 8 pixel masks (4 bytes); little endian
+static uint32_t iconMasks[256];
+
+static void initIconMasks() {
+    for (int b = 0; b < 256; ++b) {
+        uint32_t m = 0;
+        for (int i = 0; i < 8; ++i)
+            if (b & (1 << i))
+                m |= 0xfU << (i * 4);
+        iconMasks[b] = m;
+    }
+}
+
+// 8 source bits starting at bit j of a 1bpp column
+static inline uint32_t iconMask8(const uint8_t *fdata, int j) {
+    auto p = fdata + (j >> 3);
+    int shift = j & 7;
+    unsigned bits = shift ? (p[0] | (p[1] << 8)) >> shift : p[0];
+    return iconMasks[bits & 0xff];
+}
+
+// Draws the set pixels of a 1bpp column fdata in color to pixels [k0, k1) of the 4bpp
+// destination column tdata; source pixel j goes to destination pixel j + y.
+static void blitColumnIcon(uint8_t *tdata, const uint8_t *fdata, int y, int k0, int k1,
+                           int color) {
+    if (!iconMasks[1])
+        initIconMasks();
+    uint8_t c = color * 0x11;
+    int d0 = (k0 + 1) >> 1;
+    int d1 = max(d0, k1 >> 1);
+
+    for (int k = k0; k < min(k1, d0 << 1); ++k)
+        blitPixel<BLIT_ICON>(tdata, k, (fdata[(k - y) >> 3] >> ((k - y) & 7)) & 1, c);
+
+    int d = d0;
+    auto cv = VSPLAT(c);
+    for (; d + VSIZE <= d1; d += VSIZE) {
+        uint32_t m[VSIZE / 4];
+        for (int i = 0; i < VSIZE / 4; ++i)
+            m[i] = iconMask8(fdata, 2 * (d + 4 * i) - y);
+        blitVec<BLIT_ICON>(tdata + d, VLOAD((const uint8_t *)m), cv);
+    }
+    for (; d + 4 <= d1; d += 4) {
+        uint32_t m = iconMask8(fdata, 2 * d - y);
+        uint32_t t;
+        memcpy(&t, tdata + d, 4);
+        t = (t & ~m) | (c * 0x01010101U & m);
+        memcpy(tdata + d, &t, 4);
+    }
+
+    for (int k = d << 1; k < k1; ++k)
+        blitPixel<BLIT_ICON>(tdata, k, (fdata[(k - y) >> 3] >> ((k - y) & 7)) & 1, c);
+}
+#endif
+
+// Compressed images are drawn run by run, straight from the compressed data. Transparent runs
+// are skipped (or cleared when copying), fill runs are memset(), and literal runs starting on
+// the same nibble as the destination are combined a byte at a time.
+
+// Pixels [k0, k1) of the destination column in color c.
+template <int mode> static bool blitRun(uint8_t *tdata, int k0, int k1, uint8_t c) {
+    if (k0 & 1) {
+        if (blitPixel<mode>(tdata, k0, c, 0))
+            return true;
+        k0++;
+    }
+    int n = (k1 - k0) >> 1;
+    auto t = tdata + (k0 >> 1);
+    if (mode == BLIT_OVERLAP) {
+        for (int i = 0; i < n; ++i)
+            if (t[i])
+                return true;
+    } else {
+        memset(t, c * 0x11, n);
+    }
+    k0 += n << 1;
+    return k0 < k1 && blitPixel<mode>(tdata, k0, c, 0);
+}
+
+// Pixels [k0, k1) of the destination column from pixels j, j+1, ... of a literal run src.
+template <int mode>
+static bool blitLiteral(uint8_t *tdata, int k0, int k1, const uint8_t *src, int j) {
+    if ((k0 ^ j) & 1) {
+        for (int k = k0; k < k1; ++k, ++j)
+            if (blitPixel<mode>(tdata, k, (src[j >> 1] >> ((j & 1) << 2)) & 0xf, 0))
+                return true;
+        return false;
+    }
+    if (k0 & 1) {
+        if (blitPixel<mode>(tdata, k0, src[j >> 1] >> 4, 0))
+            return true;
+        k0++;
+        j++;
+    }
+    int n = (k1 - k0) >> 1;
+    auto t = tdata + (k0 >> 1);
+    auto s = src + (j >> 1);
+    if (mode == BLIT_COPY) {
+        memcpy(t, s, n);
+    } else {
+        for (int i = 0; i < n; ++i)
+            if (blitByte<mode>(t + i, s[i]))
+                return true;
+    }
+    k0 += n << 1;
+    j += n << 1;
+    return k0 < k1 && blitPixel<mode>(tdata, k0, src[j >> 1] & 0xf, 0);
+}
+
+// Draws a compressed column to pixels [k0, k1) of the destination column tdata; its first pixel
+// goes to destination pixel y.
+template <int mode>
+static bool blitColumnRle(uint8_t *tdata, const uint8_t *src, int y, int k0, int k1) {
+    while (y < k1) {
+        auto op = *src++;
+        int n = (op & 0x3f) + 1;
+        int a = max(y, k0);
+        int b = min(y + n, k1);
+        switch (op >> 6) {
+        case RLE_SKIP:
+            if (mode == BLIT_COPY && a < b)
+                blitRun<mode>(tdata, a, b, 0);
+            break;
+        case RLE_FILL:
+            if (a < b && blitRun<mode>(tdata, a, b, *src))
+                return true;
+            src++;
+            break;
+        default:
+            if (a < b && blitLiteral<mode>(tdata, a, b, src, a - y))
+                return true;
+            src += (n + 1) >> 1;
+            break;
+        }
+        y += n;
+    }
+    return false;
+}
+
+static inline int pixel4(const uint8_t *col, int y) {
+    return (col[y >> 1] >> ((y & 1) << 2)) & 0xf;
+}
+
+// Whether the pixels from y on are better stored as a run than in a literal; *len is the length
+// of the run (up to maxLen).
+static inline bool isRleRun(const uint8_t *col, int y, int h, int maxLen, int *len) {
+    int c = pixel4(col, y);
+    int r = 1;
+    while (y + r < h && r < maxLen && pixel4(col, y + r) == c)
+        r++;
+    *len = r;
+    return c == 0 ? r >= 2 : r >= 4;
+}
+
+// Compresses a column of h pixels into dst (which can be NULL); returns the number of bytes.
+static int rleEncodeColumn(const uint8_t *col, int h, uint8_t *dst) {
+    int len = 0;
+    for (int y = 0; y < h;) {
+        int n;
+        if (isRleRun(col, y, h, 64, &n)) {
+            int c = pixel4(col, y);
+            if (dst) {
+                dst[len] = ((c ? RLE_FILL : RLE_SKIP) << 6) | (n - 1);
+                if (c)
+                    dst[len + 1] = c;
+            }
+            len += c ? 2 : 1;
+        } else {
+            // up to the next run
+            int r;
+            n = 1;
+            while (y + n < h && n < 64 && !isRleRun(col, y + n, h, 4, &r))
+                n++;
+            if (dst) {
+                dst[len] = (RLE_LITERAL << 6) | (n - 1);
+                memset(dst + len + 1, 0, (n + 1) >> 1);
+                for (int i = 0; i < n; ++i)
+                    dst[len + 1 + (i >> 1)] |= pixel4(col, y + i) << ((i & 1) << 2);
+            }
+            len += 1 + ((n + 1) >> 1);
+        }
+        y += n;
+    }
+    return len;
+}
+
+static bool drawCompressed(Image_ img, Image_ from, int x, int y, int color) {
+    auto k0 = max(y, 0);
+    auto k1 = min(img->height(), y + from->height());
+    auto imgH = img->byteHeight();
+    auto imgBase = img->pix();
+    auto xx1 = min(from->width(), img->width() - x);
+    for (int xx = max(0, -x); xx < xx1; ++xx) {
+        auto tdata = imgBase + imgH * (x + xx);
+        auto fdata = rleColumn(from, xx);
+        if (color == -2)
+            blitColumnRle<BLIT_COPY>(tdata, fdata, y, k0, k1);
+        else if (color >= 0)
+            blitColumnRle<BLIT_TRANSPARENT>(tdata, fdata, y, k0, k1);
+        else if (blitColumnRle<BLIT_OVERLAP>(tdata, fdata, y, k0, k1))
+            return true;
+    }
+    return false;
+}
+
 bool drawImageCore(Image_ img, Image_ from, int x, int y, int color) {
     auto w = from->width();
     auto h = from->height();
@@ -628,11 +1181,17 @@ bool drawImageCore(Image_ img, Image_ from, int x, int y, int color) {
     if (y >= sh)
         return false;
 
+    if (color != -1)
+        img->markDirty(x, y, w, h);
+
     auto len = y < 0 ? min(sh, h + y) : min(sh - y, h);
     auto tbp = img->bpp();
     auto fbp = from->bpp();
     auto y0 = y;
 
+    if (tbp == 4 && from->isCompressed())
+        return drawCompressed(img, from, x, y, color);
+
     if (color == -2 && x == 0 && y == 0 && tbp == fbp && w == sw && h == sh) {
         copyFrom(img, from);
         return false;
@@ -650,6 +1209,26 @@ bool drawImageCore(Image_ img, Image_ from, int x, int y, int color) {
     for (int xx = 0; xx < w; ++xx, ++x)                                                            \
         if (0 <= x && x < sw)
 
+#if PXT_SIMD_BLIT
+    if (tbp == 4 && (fbp == 4 || color >= 0)) {
+        auto k0 = max(y0, 0);
+        auto k1 = min(sh, y0 + h);
+        LOOPHD {
+            auto fdata = fromBase + fromH * xx;
+            auto tdata = img->pix() + imgH * x;
+            if (fbp == 1)
+                blitColumnIcon(tdata, fdata, y0, k0, k1, color);
+            else if (color == -2)
+                blitColumn4<BLIT_COPY>(tdata, fdata, y0, k0, k1);
+            else if (color >= 0)
+                blitColumn4<BLIT_TRANSPARENT>(tdata, fdata, y0, k0, k1);
+            else if (blitColumn4<BLIT_OVERLAP>(tdata, fdata, y0, k0, k1))
+                return true;
+        }
+        return false;
+    }
+#endif
+
     if (tbp == 4 && fbp == 4) {
         auto wordH = fromH >> 2;
         LOOPHD {
@@ -841,12 +1420,156 @@ void drawTransparentImage(Image_ img, Image_ from, int x, int y) {
     drawImageCore(img, from, x, y, 0);
 }
 
+// Collision masks have one bit per pixel, set where the pixel isn't transparent. They're stored
+// column by column, (height + 31) / 32 words each, with the top pixel in the lowest bit, so that
+// an overlap test is a shifted AND of 32 pixels at a time. A mask is built on the first overlap
+// test of an image, and kept until makeWritable() is called on it, which everything changing the
+// pixels does first.
+
+static inline int maskWords(Image_ img) {
+    return (img->height() + 31) >> 5;
+}
+
+static Buffer getMask(Image_ img) {
+    if (img->mask)
+        return img->mask;
+
+    int w = img->width(), h = img->height();
+    int mw = maskWords(img);
+    auto mask = mkBuffer(NULL, w * mw * 4);
+    auto dst = (uint32_t *)mask->data;
+    for (int x = 0; x < w; ++x, dst += mw) {
+        if (img->isCompressed()) {
+            // reading the pixels would expand the image
+            auto src = rleColumn(img, x);
+            for (int y = 0; y < h;) {
+                auto op = *src++;
+                int n = (op & 0x3f) + 1;
+                int kind = op >> 6;
+                for (int i = 0; i < n; ++i, ++y) {
+                    bool set = kind == RLE_FILL ? src[0] != 0
+                                                : kind == RLE_LITERAL &&
+                                                      ((src[i >> 1] >> ((i & 1) << 2)) & 0xf);
+                    if (set)
+                        dst[y >> 5] |= 1U << (y & 31);
+                }
+                if (kind == RLE_LITERAL)
+                    src += (n + 1) >> 1;
+                else if (kind == RLE_FILL)
+                    src++;
+            }
+        } else if (img->bpp() == 1) {
+            // already the same bits, on little endian targets
+            memcpy(dst, img->pix(x, 0), img->byteHeight());
+            if (h & 31)
+                dst[mw - 1] &= (1U << (h & 31)) - 1;
+        } else {
+            auto src = img->pix(x, 0);
+            for (int y = 0; y < h; y += 2) {
+                auto b = src[y >> 1];
+                uint32_t bits = (b & 0x0f ? 1 : 0) | (b & 0xf0 && y + 1 < h ? 2 : 0);
+                dst[y >> 5] |= bits << (y & 31);
+            }
+        }
+    }
+
+    img->mask = mask;
+    return mask;
+}
+
+// 32 bits of a mask column, starting at bit s, which may be negative; zero outside of the column.
+static inline uint32_t maskBits(const uint32_t *col, int words, int s) {
+    int k = s >> 5, r = s & 31;
+    uint32_t lo = 0 <= k && k < words ? col[k] : 0;
+    if (r == 0)
+        return lo;
+    uint32_t hi = -1 <= k && k + 1 < words ? col[k + 1] : 0;
+    return (lo >> r) | (hi << (32 - r));
+}
+
 /**
  * Check if the current image "collides" with another
  */
 //%
 bool overlapsWith(Image_ img, Image_ other, int x, int y) {
-    return drawImageCore(img, other, x, y, -1);
+    int x0 = max(x, 0), x1 = min(x + other->width(), img->width());
+    int y0 = max(y, 0), y1 = min(y + other->height(), img->height());
+    if (x0 >= x1 || y0 >= y1)
+        return false;
+
+    // img keeps its mask alive while the other one is allocated
+    auto mask = getMask(img);
+    auto otherMask = getMask(other);
+
+    int mw = maskWords(img), omw = maskWords(other);
+    auto col = (uint32_t *)mask->data + x0 * mw;
+    auto ocol = (uint32_t *)otherMask->data + (x0 - x) * omw;
+    for (int cx = x0; cx < x1; ++cx, col += mw, ocol += omw) {
+        for (int k = y0 >> 5; k <= (y1 - 1) >> 5; ++k)
+            if (col[k] & maskBits(ocol, omw, (k << 5) - y))
+                return true;
+    }
+    return false;
+}
+
+// keep in sync with image.ts, class image.Batch
+struct BatchEntry {
+    int16_t x, y;
+    uint16_t flags;
+    uint16_t reserved;
+};
+
+#define BATCH_FLIP_X 0x01
+#define BATCH_FLIP_Y 0x02
+#define BATCH_OPAQUE 0x04
+
+static void drawFlipped(Image_ img, Image_ from, int x, int y, int flags) {
+    int w = from->width(), h = from->height();
+    int x0 = max(x, 0), x1 = min(x + w, img->width());
+    int y0 = max(y, 0), y1 = min(y + h, img->height());
+    if (x0 >= x1 || y0 >= y1)
+        return;
+    img->markDirty(x0, y0, x1 - x0, y1 - y0);
+
+    bool opaque = (flags & BATCH_OPAQUE) != 0;
+    for (int dx = x0; dx < x1; ++dx) {
+        int sx = flags & BATCH_FLIP_X ? x + w - 1 - dx : dx - x;
+        for (int dy = y0; dy < y1; ++dy) {
+            int sy = flags & BATCH_FLIP_Y ? y + h - 1 - dy : dy - y;
+            int c = getCore(from, sx, sy);
+            if (c || opaque)
+                setCore(img, dx, dy, c);
+        }
+    }
+}
+
+// Draws images[i] at the position from entries[i], in order; images that are not on img at all
+// are skipped before doing any work for them.
+void drawBatch(Image_ img, TValue *images, BatchEntry *entries, int n) {
+    int sw = img->width(), sh = img->height();
+    img->makeWritable();
+    for (int i = 0; i < n; ++i) {
+        auto vt = getAnyVTable(images[i]);
+        if (!vt || vt->classNo != BuiltInType::RefImage)
+            continue;
+        auto from = (Image_)images[i];
+        auto e = &entries[i];
+        int x = e->x, y = e->y;
+        if (x >= sw || y >= sh || x + from->width() <= 0 || y + from->height() <= 0)
+            continue;
+        if (e->flags & (BATCH_FLIP_X | BATCH_FLIP_Y))
+            drawFlipped(img, from, x, y, e->flags);
+        else if (e->flags & BATCH_OPAQUE)
+            drawImage(img, from, x, y);
+        else
+            drawImageCore(img, from, x, y, 0);
+    }
+}
+
+//%
+void _drawBatch(Image_ img, RefCollection *images, Buffer entries) {
+    int n = min((int)images->length(), entries->length / (int)sizeof(BatchEntry));
+    drawBatch(img, images->getData(), (BatchEntry *)entries->data, n);
 }
 
 // Image_ format (legacy)
@@ -1001,6 +1724,7 @@ void drawLine(Image_ img, int x0, int y0, int x1, int y1, int c) {
     }
 
     img->makeWritable();
+    img->markDirty(x0, min(y0, y1), x1 - x0 + 1, max(y0, y1) - min(y0, y1) + 1);
 
     if (h < 0) {
         h = -h;
@@ -1038,6 +1762,9 @@ void blitRow(Image_ img, int x, int y, Image_ from, int fromX, int fromH) {
         y = 0;
     }
 
+    img->makeWritable();
+    img->markDirty(x, y, 1, endY - y);
+
     auto dp = img->pix(x, y);
     auto sp = from->pix(fromX, 0);
 
@@ -1063,6 +1790,133 @@ void _blitRow(Image_ img, int xy, Image_ from, int xh) {
     blitRow(img, XX(xy), YY(xy), from, XX(xh), YY(xh));
 }
 
+static inline int64_t floorDiv(int64_t a, int64_t b) {
+    int64_t q = a / b;
+    if ((a % b) && ((a < 0) != (b < 0)))
+        q--;
+    return q;
+}
+
+// Narrows [*lo, *hi) to the t's for which 0 <= p + t * dp < lim.
+static void clipSpan(int p, int dp, int lim, int *lo, int *hi) {
+    int64_t a, b;
+    if (dp == 0) {
+        if (p < 0 || p >= lim)
+            *hi = *lo;
+        return;
+    } else if (dp > 0) {
+        a = -floorDiv(p, dp);
+        b = floorDiv((int64_t)lim - 1 - p, dp) + 1;
+    } else {
+        a = -floorDiv((int64_t)lim - 1 - p, -dp);
+        b = floorDiv(-(int64_t)p, dp) + 1;
+    }
+    if (a > *lo)
+        *lo = (int)min(a, (int64_t)*hi);
+    if (b < *hi)
+        *hi = (int)max(b, (int64_t)*lo);
+}
+
+// scaling by more than 256x either way is likely a bug, and would overflow the fixed point math
+static bool isScaleInRange(int a, int b, int c, int d) {
+    const int lim = 1 << 24;
+    return -lim < a && a < lim && -lim < b && b < lim && -lim < c && c < lim && -lim < d && d < lim;
+}
+
+// Draws from with transparent background, transformed by the 16.16 fixed point matrix
+// [a b; c d] around its center, which ends up where drawTransparentImage(img, from, x, y) would
+// put it. Each destination pixel takes the source pixel its center maps back to.
+void drawTransformed(Image_ img, Image_ from, int x, int y, int a, int b, int c, int d) {
+    if (!isScaleInRange(a, b, c, d))
+        return;
+    int64_t det = (int64_t)a * d - (int64_t)b * c;
+    if (det == 0)
+        return;
+
+    // inverse matrix, mapping destination offsets to source offsets
+    const int64_t one = 0x10000;
+    int ia = (int)(d * one * one / det);
+    int ib = (int)(-b * one * one / det);
+    int ic = (int)(-c * one * one / det);
+    int id = (int)(a * one * one / det);
+    if (!isScaleInRange(ia, ib, ic, id))
+        return;
+
+    int sw = from->width(), sh = from->height();
+    int64_t dcx = x * one + (sw << 15);
+    int64_t dcy = y * one + (sh << 15);
+
+    // bounding box of the transformed source rectangle
+    int64_t hx = (int64_t)sw << 15, hy = (int64_t)sh << 15;
+    int64_t ex = (((a < 0 ? -a : a) * hx + (b < 0 ? -b : b) * hy) >> 16) + 0x10000;
+    int64_t ey = (((c < 0 ? -c : c) * hx + (d < 0 ? -d : d) * hy) >> 16) + 0x10000;
+    int x0 = (int)max((dcx - ex) >> 16, (int64_t)0);
+    int y0 = (int)max((dcy - ey) >> 16, (int64_t)0);
+    int x1 = (int)min(((dcx + ex) >> 16) + 1, (int64_t)img->width());
+    int y1 = (int)min(((dcy + ey) >> 16) + 1, (int64_t)img->height());
+    if (x0 >= x1 || y0 >= y1)
+        return;
+
+    img->makeWritable();
+    img->markDirty(x0, y0, x1 - x0, y1 - y0);
+
+    int ulim = sw << 16, vlim = sh << 16;
+    int64_t ddy = y0 * one + 0x8000 - dcy;
+    bool fast = img->bpp() == 4 && from->bpp() == 4;
+    auto sp = from->pix();
+    int sbh = from->byteHeight();
+
+    for (int px = x0; px < x1; ++px) {
+        int64_t ddx = px * one + 0x8000 - dcx;
+        int u = (int)(hx + ((ia * ddx + ib * ddy) >> 16));
+        int v = (int)(hy + ((ic * ddx + id * ddy) >> 16));
+        int lo = 0, hi = y1 - y0;
+        clipSpan(u, ib, ulim, &lo, &hi);
+        clipSpan(v, id, vlim, &lo, &hi);
+        if (lo >= hi)
+            continue;
+        u += lo * ib;
+        v += lo * id;
+        int py = y0 + lo, endY = y0 + hi;
+
+        if (!fast) {
+            for (; py < endY; ++py) {
+                int col = getCore(from, u >> 16, v >> 16);
+                if (col)
+                    setCore(img, px, py, col);
+                u += ib;
+                v += id;
+            }
+            continue;
+        }
+
+        auto dp = img->pix(px, py);
+        for (; py < endY; ++py) {
+            int sv = v >> 16;
+            uint8_t s = sp[(u >> 16) * sbh + (sv >> 1)];
+            int col = sv & 1 ? s >> 4 : s & 0xf;
+            if (py & 1) {
+                if (col)
+                    *dp = (*dp & 0x0f) | (col << 4);
+                dp++;
+            } else if (col) {
+                *dp = (*dp & 0xf0) | col;
+            }
+            u += ib;
+            v += id;
+        }
+    }
+}
+
+//%
+void _drawTransformed(Image_ img, Image_ from, int xy, Buffer m) {
+    if (m->length < 16)
+        return;
+    int32_t k[4];
+    memcpy(k, m->data, sizeof(k));
+    drawTransformed(img, from, XX(xy), YY(xy), k[0], k[1], k[2], k[3]);
+}
+
 void fillCircle(Image_ img, int cx, int cy, int r, int c) {
     int x = r - 1;
     int y = 0;
@@ -24,6 +24,58 @@ namespace image {
         }
         return r
     }
+
+    export const enum BatchFlag {
+        FlipX = 0x01,
+        FlipY = 0x02,
+        // draw the transparent pixels too, like drawImage()
+        Opaque = 0x04,
+    }
+
+    //% shim=ImageMethods::_drawBatch
+    declare function _drawBatch(img: Image, images: Image[], entries: Buffer): void;
+
+    /**
+     * A list of images to be drawn in order with a single call, like sprites in a frame.
+     */
+    export class Batch {
+        images: Image[]
+        // x, y and flags of every image; keep in sync with BatchEntry in image.cpp
+        entries: Buffer
+
+        constructor() {
+            this.images = []
+            this.entries = control.createBuffer(8 * 16)
+        }
+
+        get length() {
+            return this.images.length
+        }
+
+        add(img: Image, x: number, y: number, flags = 0) {
+            const n = this.images.length
+            if (this.entries.length < 8 * (n + 1)) {
+                const bigger = control.createBuffer(this.entries.length * 2)
+                bigger.write(0, this.entries)
+                this.entries = bigger
+            }
+            this.images.push(img)
+            const off = 8 * n
+            this.entries.setNumber(NumberFormat.Int16LE, off, Math.clamp(-30000, 30000, x | 0))
+            this.entries.setNumber(NumberFormat.Int16LE, off + 2, Math.clamp(-30000, 30000, y | 0))
+            this.entries.setNumber(NumberFormat.UInt16LE, off + 4, flags)
+        }
+
+        /**
+         * Draws all the images added since the last call onto target, and empties the batch
+         */
+        drawTo(target: Image) {
+            if (this.images.length) {
+                _drawBatch(target, this.images, this.entries)
+                this.images.splice(0, this.images.length)
+            }
+        }
+    }
 }
 
 
@@ -68,11 +120,18 @@ interface Image {
     fillCircle(cx: number, cy: number, r: number, c: color): void;
 
     /**
-     * Returns an image rotated by -90, 0, 90, 180, 270 deg clockwise
+     * Returns an image rotated by deg degrees clockwise, large enough to hold all of it
      */
     //% helper=imageRotated
     rotated(deg: number): Image;
 
+    /**
+     * Draw given image with transparent background, rotated by angle degrees clockwise and scaled
+     * around its center, which stays where drawTransparentImage(from, x, y) would put it
+     */
+    //% helper=imageDrawTransformed
+    drawTransformed(from: Image, x: number, y: number, angle: number, sx: number, sy: number): void;
+
     /**
      * Scale and copy a row of pixels from a texture.
      */
@@ -97,6 +156,8 @@ interface ScreenImage extends Image {
 // pxt compiler currently crashes on non-functions in helpers namespace; will fix
 namespace _helpers_workaround {
     export let brightness = 100
+    export let transform: Buffer = null
+    export let printArgs: Buffer = null
 }
 
 namespace helpers {
@@ -118,6 +179,9 @@ namespace helpers {
     //% shim=ImageMethods::_blitRow
     declare function _blitRow(img: Image, xy: number, from: Image, xh: number): void;
 
+    //% shim=ImageMethods::_drawTransformed
+    declare function _drawTransformed(img: Image, from: Image, xy: number, m: Buffer): void;
+
     function pack(x: number, y: number) {
         return (Math.clamp(-30000, 30000, x | 0) & 0xffff) | (Math.clamp(-30000, 30000, y | 0) << 16)
     }
@@ -126,6 +190,22 @@ namespace helpers {
         _blitRow(img, pack(dstX, dstY), from, pack(fromX, fromH))
     }
 
+    export function imageDrawTransformed(img: Image, from: Image, x: number, y: number,
+        angle: number, scaleX: number, scaleY: number): void {
+        let m = _helpers_workaround.transform
+        if (!m)
+            m = _helpers_workaround.transform = control.createBuffer(16)
+        const rad = angle * Math.PI / 180
+        const cos = Math.cos(rad) * 65536
+        const sin = Math.sin(rad) * 65536
+        // 16.16 fixed point [a b; c d] mapping source offsets from the center to the screen
+        m.setNumber(NumberFormat.Int32LE, 0, Math.round(cos * scaleX))
+        m.setNumber(NumberFormat.Int32LE, 4, Math.round(-sin * scaleY))
+        m.setNumber(NumberFormat.Int32LE, 8, Math.round(sin * scaleX))
+        m.setNumber(NumberFormat.Int32LE, 12, Math.round(cos * scaleY))
+        _drawTransformed(img, from, pack(x, y), m)
+    }
+
     export function imageDrawIcon(img: Image, icon: Buffer, x: number, y: number, c: color): void {
         _drawIcon(img, icon, pack(x, y), c)
     }
@@ -185,7 +265,7 @@ namespace helpers {
     }
 
     /**
-     * Returns an image rotated by 90, 180, 270 deg clockwise
+     * Returns an image rotated by deg clockwise; multiples of 90 deg are exact
      */
     export function imageRotated(img: Image, deg: number) {
         if (deg == -90 || deg == 270) {
@@ -201,8 +281,20 @@ namespace helpers {
             let r = img.transposed();
             r.flipX();
             return r;
+        } else if (deg == 0) {
+            return img.clone();
         } else {
-            return null;
+            const rad = deg * Math.PI / 180
+            const cos = Math.abs(Math.cos(rad))
+            const sin = Math.abs(Math.sin(rad))
+            let w = Math.ceil(img.width * cos + img.height * sin - 0.001)
+            let h = Math.ceil(img.width * sin + img.height * cos - 0.001)
+            // keep the center on the same pixel boundary
+            w += (w - img.width) & 1
+            h += (h - img.height) & 1
+            let r = image.create(w, h)
+            r.drawTransformed(img, (w - img.width) >> 1, (h - img.height) >> 1, deg, 1, 1)
+            return r;
         }
     }
 
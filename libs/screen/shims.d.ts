@@ -63,6 +63,14 @@ declare interface Image {
     //% shim=ImageMethods::clone
     clone(): Image;
 
+    /**
+     * Return a copy of the current image that takes less memory, unless it's mostly noise. It is drawn
+     * faster by drawTransparentImage() too, but reading or changing its pixels in any other way makes
+     * it a normal image again.
+     */
+    //% shim=ImageMethods::compressed
+    compressed(): Image;
+
     /**
      * Flips (mirrors) pixels horizontally in the current image
      */
@@ -188,6 +188,11 @@ namespace pxsim.ImageMethods {
         return r
     }
 
+    export function compressed(img: RefImage) {
+        // the simulator doesn't need to save memory
+        return clone(img)
+    }
+
     export function flipX(img: RefImage) {
         img.makeWritable()
         const w = img._width
@@ -630,6 +635,140 @@ namespace pxsim.ImageMethods {
             fy += stepFY
         }
     }
+
+    export function _print(img: RefImage, text: string, font: RefBuffer, args: RefBuffer) {
+        if (args.data.length < 8)
+            return
+        const a = new DataView(args.data.buffer, args.data.byteOffset)
+        const x0 = a.getInt16(0, true)
+        const color = args.data[4]
+        const w = args.data[5], h = args.data[6]
+        const mult = Math.max(args.data[7], 1)
+        const byteH = (h + 7) >> 3
+        const glyphSize = 2 + byteH * w
+        const fd = font.data
+        const numGlyphs = (fd.length / glyphSize) | 0
+        const numOffsets = (args.data.length - 8) >> 2
+        if (!w || !h || !numGlyphs)
+            return
+        let x = x0
+        let y = a.getInt16(2, true)
+        for (let idx = 0; idx < text.length; ++idx) {
+            const ch = text.charCodeAt(idx)
+            if (ch == 10) {
+                y += h * mult + 2
+                x = x0
+            }
+            if (ch < 32)
+                continue
+            let off = 0
+            let l = 0, r = numGlyphs - 1
+            while (l <= r) {
+                const m = (l + r) >> 1
+                const v = fd[m * glyphSize] | (fd[m * glyphSize + 1] << 8)
+                if (v == ch) {
+                    off = m * glyphSize
+                    break
+                }
+                if (v < ch) l = m + 1
+                else r = m - 1
+            }
+            let dx = x, dy = y
+            if (idx < numOffsets) {
+                dx += a.getInt16(8 + 4 * idx, true) * mult
+                dy += a.getInt16(10 + 4 * idx, true) * mult
+            }
+            for (let i = 0; i < w; ++i) {
+                const px = dx + i * mult
+                if (px + mult <= 0 || px >= img._width)
+                    continue
+                for (let j = 0; j < h; ++j) {
+                    const py = dy + j * mult
+                    if (py + mult > 0 && py < img._height &&
+                        (fd[off + 2 + i * byteH + (j >> 3)] & (1 << (j & 7))))
+                        fillRect(img, px, py, mult, mult, color)
+                }
+            }
+            x += w * mult
+        }
+    }
+
+    export function _drawTransformed(img: RefImage, from: RefImage, xy: number, m: RefBuffer) {
+        if (m.data.length < 16)
+            return
+        const v = new DataView(m.data.buffer, m.data.byteOffset)
+        drawTransformed(img, from, XX(xy), YY(xy),
+            v.getInt32(0, true), v.getInt32(4, true), v.getInt32(8, true), v.getInt32(12, true))
+    }
+
+    export function drawTransformed(img: RefImage, from: RefImage, x: number, y: number,
+        a: number, b: number, c: number, d: number) {
+        const det = a * d - b * c
+        if (det == 0)
+            return
+        // inverse, in floating point rather than 16.16
+        const one = 65536
+        const ia = d * one / det, ib = -b * one / det, ic = -c * one / det, id = a * one / det
+        const sw = from._width, sh = from._height
+        const dcx = x + sw / 2, dcy = y + sh / 2
+        const ex = (Math.abs(a) * sw + Math.abs(b) * sh) / one / 2 + 1
+        const ey = (Math.abs(c) * sw + Math.abs(d) * sh) / one / 2 + 1
+        const [x0, y0] = img.clamp(dcx - ex, dcy - ey)
+        const [x1, y1] = img.clamp(dcx + ex, dcy + ey)
+        img.makeWritable()
+        for (let py = y0; py <= y1; ++py) {
+            const dy = py + 0.5 - dcy
+            for (let px = x0; px <= x1; ++px) {
+                const dx = px + 0.5 - dcx
+                const u = Math.floor(sw / 2 + ia * dx + ib * dy)
+                const v = Math.floor(sh / 2 + ic * dx + id * dy)
+                if (!from.inRange(u, v))
+                    continue
+                const col = from.data[from.pix(u, v)]
+                if (col)
+                    img.data[img.pix(px, py)] = col
+            }
+        }
+    }
+
+    // see BatchEntry in image.cpp
+    const BATCH_FLIP_X = 0x01
+    const BATCH_FLIP_Y = 0x02
+    const BATCH_OPAQUE = 0x04
+
+    export function _drawBatch(img: RefImage, images: RefCollection, entries: RefBuffer) {
+        const imgs = images.toArray()
+        const e = new DataView(entries.data.buffer, entries.data.byteOffset)
+        const n = Math.min(imgs.length, entries.data.length >> 3)
+        for (let i = 0; i < n; ++i) {
+            const from = imgs[i]
+            if (!(from instanceof RefImage))
+                continue
+            const x = e.getInt16(8 * i, true)
+            const y = e.getInt16(8 * i + 2, true)
+            const flags = e.getUint16(8 * i + 4, true)
+            if (flags & (BATCH_FLIP_X | BATCH_FLIP_Y))
+                drawFlipped(img, from, x, y, flags)
+            else if (flags & BATCH_OPAQUE)
+                drawImage(img, from, x, y)
+            else
+                drawTransparentImage(img, from, x, y)
+        }
+    }
+
+    function drawFlipped(img: RefImage, from: RefImage, x: number, y: number, flags: number) {
+        const w = from._width, h = from._height
+        img.makeWritable()
+        for (let sx = 0; sx < w; ++sx) {
+            const dx = flags & BATCH_FLIP_X ? x + w - 1 - sx : x + sx
+            for (let sy = 0; sy < h; ++sy) {
+                const dy = flags & BATCH_FLIP_Y ? y + h - 1 - sy : y + sy
+                const c = from.data[from.pix(sx, sy)]
+                if ((c || flags & BATCH_OPAQUE) && img.inRange(dx, dy))
+                    img.data[img.pix(dx, dy)] = c
+            }
+        }
+    }
 }
 
 
@@ -833,3 +972,56 @@ namespace pxsim.pxtcore {
             state.setScreenBrightness(b);
     }
 }
+
+namespace pxsim.tiles {
+    function XX(x: number) { return (x << 16) >> 16 }
+    function YY(x: number) { return x >> 16 }
+
+    // see TM_DATA_PREFIX_LENGTH and TM_WALL in game/tilemap.ts
+    const PREFIX = 4
+    const WALL = 2
+
+    export function _drawTilemap(img: RefImage, map: RefBuffer, tiles: RefCollection, args: RefBuffer) {
+        if (args.data.length < 12 || map.data.length < PREFIX)
+            return
+        const a = new DataView(args.data.buffer, args.data.byteOffset)
+        const offsetX = a.getInt32(0, true)
+        const offsetY = a.getInt32(4, true)
+        const scale = a.getInt32(8, true)
+        const d = map.data
+        const mapW = d[0] | (d[1] << 8), mapH = d[2] | (d[3] << 8)
+        if (d.length < PREFIX + mapW * mapH)
+            return
+        const bitmask = (1 << scale) - 1
+        const dx = offsetX & bitmask, dy = offsetY & bitmask
+        const x0 = Math.max(0, offsetX >> scale)
+        const xn = Math.min(mapW, ((offsetX + img._width) >> scale) + 1)
+        const y0 = Math.max(0, offsetY >> scale)
+        const yn = Math.min(mapH, ((offsetY + img._height) >> scale) + 1)
+        const ts = tiles.toArray()
+        for (let x = x0; x <= xn; ++x) {
+            for (let y = y0; y <= yn; ++y) {
+                const index = x < mapW && y < mapH ? d[PREFIX + x + y * mapW] : 0
+                const tile = ts[index]
+                if (tile instanceof RefImage)
+                    ImageMethods.drawTransparentImage(img, tile,
+                        ((x - x0) << scale) - dx, ((y - y0) << scale) - dy)
+            }
+        }
+    }
+
+    export function _isWallInRect(map: RefBuffer, walls: RefImage, xy0: number, xy1: number) {
+        const d = map.data
+        if (d.length < PREFIX)
+            return true
+        const mapW = d[0] | (d[1] << 8), mapH = d[2] | (d[3] << 8)
+        const x0 = XX(xy0), y0 = YY(xy0), x1 = XX(xy1), y1 = YY(xy1)
+        if (x0 < 0 || y0 < 0 || x1 >= mapW || y1 >= mapH)
+            return true
+        for (let x = x0; x <= x1; ++x)
+            for (let y = y0; y <= y1; ++y)
+                if (ImageMethods.getPixel(walls, x, y) == WALL)
+                    return true
+        return false
+    }
+}
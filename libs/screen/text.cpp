@@ -0,0 +1,202 @@
+#include "pxt.h"
+
+// Text rendering for image.print() in text.ts.
+//
+// Font data is a list of glyphs sorted by code point; each is the 16 bit little-endian code point
+// followed by the columns of the glyph, (height + 7) / 8 bytes each, top pixel in the lowest bit.
+// Rather than a binary search over the whole font for every character, the first glyph of every
+// block of 64 code points is indexed once per font, and only that block is searched.
+//
+// Fonts are practically always literals, so the index is keyed on the address and size of the
+// data; it is thrown away when the program is reset in-process (see PXT_REGISTER_RESET).
+
+#define FONT_BLOCK_SHIFT 6
+#define FONT_INDEX_CACHE_SIZE 4
+
+namespace ImageMethods {
+
+void fillRect(Image_ img, int x, int y, int w, int h, int c);
+
+struct FontIndex {
+    const uint8_t *data;
+    int length;
+    int glyphSize;
+    int numBlocks;
+    // numBlocks + 1 entries, the last one being the number of glyphs
+    uint16_t firstGlyph[0];
+};
+
+static FontIndex *fontIndexes[FONT_INDEX_CACHE_SIZE];
+static int nextFontIndex;
+static bool fontIndexResetRegistered;
+
+static void clearFontIndexes() {
+    for (int i = 0; i < FONT_INDEX_CACHE_SIZE; ++i) {
+        if (fontIndexes[i])
+            xfree(fontIndexes[i]);
+        fontIndexes[i] = NULL;
+    }
+}
+
+static inline int glyphCodePoint(const uint8_t *data, int glyphSize, int idx) {
+    auto p = data + idx * glyphSize;
+    return p[0] | (p[1] << 8);
+}
+
+static FontIndex *getFontIndex(Buffer font, int glyphSize) {
+    for (int i = 0; i < FONT_INDEX_CACHE_SIZE; ++i) {
+        auto fi = fontIndexes[i];
+        if (fi && fi->data == font->data && fi->length == font->length &&
+            fi->glyphSize == glyphSize)
+            return fi;
+    }
+
+    int numGlyphs = min(font->length / glyphSize, 0xffff);
+    int maxCh = numGlyphs ? glyphCodePoint(font->data, glyphSize, numGlyphs - 1) : 0;
+    int numBlocks = (maxCh >> FONT_BLOCK_SHIFT) + 1;
+    auto fi = (FontIndex *)xmalloc(sizeof(FontIndex) + (numBlocks + 1) * sizeof(uint16_t));
+    fi->data = font->data;
+    fi->length = font->length;
+    fi->glyphSize = glyphSize;
+    fi->numBlocks = numBlocks;
+    int g = 0;
+    for (int b = 0; b < numBlocks; ++b) {
+        while (g < numGlyphs && glyphCodePoint(font->data, glyphSize, g) < b << FONT_BLOCK_SHIFT)
+            g++;
+        fi->firstGlyph[b] = g;
+    }
+    fi->firstGlyph[numBlocks] = numGlyphs;
+
+    if (!fontIndexResetRegistered) {
+        fontIndexResetRegistered = true;
+        PXT_REGISTER_RESET(clearFontIndexes);
+    }
+    if (fontIndexes[nextFontIndex])
+        xfree(fontIndexes[nextFontIndex]);
+    fontIndexes[nextFontIndex] = fi;
+    nextFontIndex = (nextFontIndex + 1) % FONT_INDEX_CACHE_SIZE;
+    return fi;
+}
+
+// Returns the glyph for ch, or the first one (normally the space) when the font doesn't have it.
+static const uint8_t *findGlyph(FontIndex *fi, int ch) {
+    int b = ch >> FONT_BLOCK_SHIFT;
+    if (b < fi->numBlocks) {
+        int l = fi->firstGlyph[b];
+        int r = fi->firstGlyph[b + 1] - 1;
+        while (l <= r) {
+            int m = (l + r) >> 1;
+            int v = glyphCodePoint(fi->data, fi->glyphSize, m);
+            if (v == ch)
+                return fi->data + m * fi->glyphSize;
+            if (v < ch)
+                l = m + 1;
+            else
+                r = m - 1;
+        }
+    }
+    return fi->data;
+}
+
+static int nextCodePoint(const uint8_t *&p, const uint8_t *end) {
+    int c = *p++;
+    int n = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : 0;
+    if (n == 0 || p + n > end)
+        return c;
+    c &= 0x3f >> n;
+    while (n--)
+        c = (c << 6) | (*p++ & 0x3f);
+    return c;
+}
+
+static void drawGlyph(Image_ img, const uint8_t *glyph, int w, int h, int x, int y, int mult,
+                      int c) {
+    int byteHeight = (h + 7) >> 3;
+
+    if (mult == 1 && img->bpp() == 4 && x >= 0 && y >= 0 && x + w <= img->width() &&
+        y + h <= img->height()) {
+        img->markDirty(x, y, w, h);
+        c &= 0xf;
+        for (int i = 0; i < w; ++i) {
+            auto col = img->pix(x + i, 0);
+            for (int j = 0; j < h; ++j) {
+                if (!(glyph[j >> 3] & (1 << (j & 7))))
+                    continue;
+                int py = y + j;
+                auto p = col + (py >> 1);
+                if (py & 1)
+                    *p = (*p & 0x0f) | (c << 4);
+                else
+                    *p = (*p & 0xf0) | c;
+            }
+            glyph += byteHeight;
+        }
+        return;
+    }
+
+    // partially off the image, or scaled; draw runs of pixels in a column
+    for (int i = 0; i < w; ++i) {
+        int j = 0;
+        while (j < h) {
+            int n = 0;
+            while (j + n < h && (glyph[(j + n) >> 3] & (1 << ((j + n) & 7))))
+                n++;
+            if (n) {
+                fillRect(img, x + i * mult, y + j * mult, mult, n * mult, c);
+                j += n;
+            } else {
+                j++;
+            }
+        }
+        glyph += byteHeight;
+    }
+}
+
+// keep in sync with text.ts, function imagePrint()
+struct PrintArgs {
+    int16_t x, y;
+    uint8_t color;
+    uint8_t glyphWidth, glyphHeight;
+    uint8_t multiplier;
+    // per character x, y offsets, in glyph pixels
+    int16_t offsets[0];
+};
+
+//%
+void _print(Image_ img, String text, Buffer font, Buffer args) {
+    if (args->length < (int)sizeof(PrintArgs))
+        return;
+    auto pa = (PrintArgs *)args->data;
+    int mult = max((int)pa->multiplier, 1);
+    int w = pa->glyphWidth, h = pa->glyphHeight;
+    int glyphSize = 2 + ((h + 7) >> 3) * w;
+    if (w == 0 || h == 0 || font->length < glyphSize)
+        return;
+    int numOffsets = (args->length - sizeof(PrintArgs)) / 4;
+
+    img->makeWritable();
+
+    auto fi = getFontIndex(font, glyphSize);
+    auto p = (const uint8_t *)PXT_STRING_DATA(text);
+    auto end = p + PXT_STRING_DATA_LENGTH(text);
+    int x = pa->x, y = pa->y;
+    for (int idx = 0; p < end; ++idx) {
+        int ch = nextCodePoint(p, end);
+        if (ch == 10) {
+            y += h * mult + 2;
+            x = pa->x;
+        }
+        if (ch < 32)
+            continue; // skip control chars
+
+        int dx = 0, dy = 0;
+        if (idx < numOffsets) {
+            dx = pa->offsets[2 * idx] * mult;
+            dy = pa->offsets[2 * idx + 1] * mult;
+        }
+        drawGlyph(img, findGlyph(fi, ch) + 2, w, h, x + dx, y + dy, mult, pa->color);
+        x += w * mult;
+    }
+}
+
+} // namespace ImageMethods
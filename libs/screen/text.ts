@@ -211,98 +211,32 @@ namespace helpers {
         imagePrint(img, text, x, y, color, font)
     }
 
+    //% shim=ImageMethods::_print
+    declare function _print(img: Image, text: string, font: Buffer, args: Buffer): void;
+
     export function imagePrint(img: Image, text: string, x: number, y: number, color?: number, font?: image.Font, offsets?: texteffects.TextEffectState[]) {
-        x |= 0
-        y |= 0
         if (!font)
             font = image.getFontForText(text)
         if (!color) color = 1
-        let x0 = x
-        let cp = 0
-        let mult = font.multiplier ? font.multiplier : 1
-        let dataW = Math.idiv(font.charWidth, mult)
-        let dataH = Math.idiv(font.charHeight, mult)
-        let byteHeight = (dataH + 7) >> 3
-        let charSize = byteHeight * dataW
-        let dataSize = 2 + charSize
-        let fontdata = font.data
-        let lastchar = Math.idiv(fontdata.length, dataSize) - 1
-        let imgBuf: Buffer
-        if (mult == 1) {
-            imgBuf = control.createBuffer(8 + charSize)
-            imgBuf[0] = 0x87
-            imgBuf[1] = 1
-            imgBuf[2] = dataW
-            imgBuf[4] = dataH
-        }
-        while (cp < text.length) {
-            let xOffset = 0, yOffset = 0;
-            if (offsets && cp < offsets.length) {
-                xOffset = offsets[cp].xOffset
-                yOffset = offsets[cp].yOffset
-            }
-
-            let ch = text.charCodeAt(cp++)
-            if (ch == 10) {
-                y += font.charHeight + 2
-                x = x0
-            }
-
-            if (ch < 32)
-                continue // skip control chars
-
-            let l = 0
-            let r = lastchar
-            let off = 0 // this should be a space (0x0020)
-            let guess = (ch - 32) * dataSize
-            if (fontdata.getNumber(NumberFormat.UInt16LE, guess) == ch)
-                off = guess
-            else {
-                while (l <= r) {
-                    let m = l + ((r - l) >> 1);
-                    let v = fontdata.getNumber(NumberFormat.UInt16LE, m * dataSize)
-                    if (v == ch) {
-                        off = m * dataSize
-                        break
-                    }
-                    if (v < ch)
-                        l = m + 1
-                    else
-                        r = m - 1
-                }
-            }
-
-            if (mult == 1) {
-                imgBuf.write(8, fontdata.slice(off + 2, charSize))
-                img.drawIcon(imgBuf, x + xOffset, y + yOffset, color)
-                x += font.charWidth
-            } else {
-                off += 2
-                for (let i = 0; i < dataW; ++i) {
-                    let j = 0
-                    let mask = 0x01
-                    let c = fontdata[off++]
-                    while (j < dataH) {
-                        if (mask == 0x100) {
-                            c = fontdata[off++]
-                            mask = 0x01
-                        }
-                        let n = 0
-                        while (c & mask) {
-                            n++
-                            mask <<= 1
-                        }
-                        if (n) {
-                            img.fillRect(x + xOffset * mult, y + (j + yOffset) * mult, mult, mult * n, color)
-                            j += n
-                        } else {
-                            mask <<= 1
-                            j++
-                        }
-                    }
-                    x += mult
-                }
+        const mult = font.multiplier ? font.multiplier : 1
+        // keep in sync with text.cpp, struct PrintArgs
+        let args = _helpers_workaround.printArgs
+        if (offsets) {
+            const n = Math.min(offsets.length, text.length)
+            args = control.createBuffer(8 + 4 * n)
+            for (let i = 0; i < n; ++i) {
+                args.setNumber(NumberFormat.Int16LE, 8 + 4 * i, offsets[i].xOffset)
+                args.setNumber(NumberFormat.Int16LE, 10 + 4 * i, offsets[i].yOffset)
             }
+        } else if (!args) {
+            args = _helpers_workaround.printArgs = control.createBuffer(8)
         }
+        args.setNumber(NumberFormat.Int16LE, 0, Math.clamp(-30000, 30000, x | 0))
+        args.setNumber(NumberFormat.Int16LE, 2, Math.clamp(-30000, 30000, y | 0))
+        args[4] = color
+        args[5] = Math.idiv(font.charWidth, mult)
+        args[6] = Math.idiv(font.charHeight, mult)
+        args[7] = mult
+        _print(img, text, font.data, args)
     }
 }
@@ -0,0 +1,176 @@
+#include "pxt.h"
+
+// Tile map rendering and wall checks for TileMap in game/tilemap.ts.
+//
+// The map buffer starts with the width and height in tiles (16 bit each), followed by one tileset
+// index per tile, row by row. The wall layer is an image with one pixel per tile, set to TM_WALL
+// for walls.
+
+#define TM_DATA_PREFIX_LENGTH 4
+#define TM_WALL 2
+
+#define XX(v) (int)(((int16_t)(v)))
+#define YY(v) (int)(((int16_t)(((int32_t)(v)) >> 16)))
+
+namespace ImageMethods {
+bool drawImageCore(Image_ img, Image_ from, int x, int y, int color);
+}
+
+namespace tiles {
+
+enum { TILE_UNKNOWN, TILE_EMPTY, TILE_OPAQUE, TILE_MIXED };
+
+static Image_ tileAt(TValue *tiles, int numTiles, int index) {
+    if (index >= numTiles)
+        return NULL;
+    auto vt = getAnyVTable(tiles[index]);
+    if (!vt || vt->classNo != BuiltInType::RefImage)
+        return NULL;
+    return (Image_)tiles[index];
+}
+
+// Empty tiles are skipped, opaque ones copied without looking at the pixels.
+static int tileKind(Image_ tile) {
+    // reading a compressed image would expand it
+    if (tile->bpp() != 4 || tile->isCompressed())
+        return TILE_MIXED;
+    int w = tile->width(), h = tile->height();
+    int bh = tile->byteHeight();
+    auto p = tile->pix();
+    bool anySet = false, anyClear = false;
+    for (int i = 0; i < w; ++i, p += bh) {
+        for (int j = 0; j < h; ++j) {
+            int c = j & 1 ? p[j >> 1] >> 4 : p[j >> 1] & 0xf;
+            if (c)
+                anySet = true;
+            else
+                anyClear = true;
+        }
+        if (anySet && anyClear)
+            return TILE_MIXED;
+    }
+    return anySet ? TILE_OPAQUE : TILE_EMPTY;
+}
+
+static void drawOpaqueTile(Image_ img, Image_ tile, int x, int y) {
+    // the pixel pairs in a byte only line up when y is even
+    if ((y & 1) || img->bpp() != 4) {
+        ImageMethods::drawImageCore(img, tile, x, y, -2);
+        return;
+    }
+
+    int w = tile->width(), h = tile->height();
+    int x0 = max(x, 0), x1 = min(x + w, img->width());
+    int y0 = max(y, 0), y1 = min(y + h, img->height());
+    if (x0 >= x1 || y0 >= y1)
+        return;
+    img->markDirty(x0, y0, x1 - x0, y1 - y0);
+
+    int n = (y1 - y0) >> 1;
+    int tbh = tile->byteHeight(), ibh = img->byteHeight();
+    auto src = tile->pix(x0 - x, 0) + ((y0 - y) >> 1);
+    auto dst = img->pix(x0, 0) + (y0 >> 1);
+    for (int i = x0; i < x1; ++i, src += tbh, dst += ibh) {
+        memcpy(dst, src, n);
+        if ((y1 - y0) & 1)
+            dst[n] = (dst[n] & 0xf0) | (src[n] & 0x0f);
+    }
+}
+
+// Draws the tiles under the camera, like drawing every one of them with
+// drawTransparentImage(tiles[index], ...). Tiles are expected to be at most 1 << scale pixels
+// wide and high.
+void drawTilemap(Image_ img, Buffer map, TValue *tiles, int numTiles, int offsetX, int offsetY,
+                 int scale) {
+    if (map->length < TM_DATA_PREFIX_LENGTH || scale < 0 || scale > 8)
+        return;
+    int mapW = map->data[0] | (map->data[1] << 8);
+    int mapH = map->data[2] | (map->data[3] << 8);
+    if (map->length < TM_DATA_PREFIX_LENGTH + mapW * mapH)
+        return;
+    auto data = map->data + TM_DATA_PREFIX_LENGTH;
+
+    int bitmask = (1 << scale) - 1;
+    int dx = offsetX & bitmask, dy = offsetY & bitmask;
+    int x0 = max(0, offsetX >> scale);
+    int xn = min(mapW, ((offsetX + img->width()) >> scale) + 1);
+    int y0 = max(0, offsetY >> scale);
+    int yn = min(mapH, ((offsetY + img->height()) >> scale) + 1);
+
+    img->makeWritable();
+
+    uint8_t kinds[256];
+    memset(kinds, TILE_UNKNOWN, sizeof(kinds));
+
+    for (int x = x0; x <= xn; ++x) {
+        for (int y = y0; y <= yn; ++y) {
+            // like TileMapData.getTile(), outside of the map is tile 0
+            int index = x < mapW && y < mapH ? data[x + y * mapW] : 0;
+            if (kinds[index] == TILE_EMPTY)
+                continue;
+            auto tile = tileAt(tiles, numTiles, index);
+            if (!tile) {
+                kinds[index] = TILE_EMPTY;
+                continue;
+            }
+            if (kinds[index] == TILE_UNKNOWN) {
+                kinds[index] = tileKind(tile);
+                if (kinds[index] == TILE_EMPTY)
+                    continue;
+            }
+            int px = ((x - x0) << scale) - dx;
+            int py = ((y - y0) << scale) - dy;
+            if (kinds[index] == TILE_OPAQUE)
+                drawOpaqueTile(img, tile, px, py);
+            else
+                ImageMethods::drawImageCore(img, tile, px, py, 0);
+        }
+    }
+}
+
+// keep in sync with tilemap.ts, TileMap.draw()
+struct TilemapArgs {
+    int32_t offsetX, offsetY;
+    int32_t scale;
+};
+
+//%
+void _drawTilemap(Image_ img, Buffer map, RefCollection *tiles, Buffer args) {
+    if (args->length < (int)sizeof(TilemapArgs))
+        return;
+    auto ta = (TilemapArgs *)args->data;
+    drawTilemap(img, map, tiles->getData(), tiles->length(), ta->offsetX, ta->offsetY, ta->scale);
+}
+
+// Checks if any of the tiles in columns x0..x1 and rows y0..y1 is a wall, or outside of the map.
+bool isWallInRect(Buffer map, Image_ walls, int x0, int y0, int x1, int y1) {
+    if (map->length < TM_DATA_PREFIX_LENGTH)
+        return true;
+    int mapW = map->data[0] | (map->data[1] << 8);
+    int mapH = map->data[2] | (map->data[3] << 8);
+    if (x0 < 0 || y0 < 0 || x1 >= mapW || y1 >= mapH)
+        return true;
+
+    // past the wall layer is not a wall
+    x1 = min(x1, walls->width() - 1);
+    y1 = min(y1, walls->height() - 1);
+    // TM_WALL doesn't fit in a monochrome image
+    if (walls->bpp() != 4)
+        return false;
+    for (int x = x0; x <= x1; ++x) {
+        auto col = walls->pix(x, 0);
+        for (int y = y0; y <= y1; ++y) {
+            int c = y & 1 ? col[y >> 1] >> 4 : col[y >> 1] & 0xf;
+            if (c == TM_WALL)
+                return true;
+        }
+    }
+    return false;
+}
+
+//%
+bool _isWallInRect(Buffer map, Image_ walls, int xy0, int xy1) {
+    return isWallInRect(map, walls, XX(xy0), YY(xy0), XX(xy1), YY(xy1));
+}
+
+} // namespace tiles